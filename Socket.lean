@@ -2,3 +2,23 @@ import Socket.Init
 import Socket.Basic
 import Socket.Socket
 import Socket.SockAddr
+import Socket.Affinity
+import Socket.HandleTable
+import Socket.Bpf
+import Socket.PrefixTrie
+import Socket.RateLimiter
+import Socket.ByteSlice
+import Socket.Redis
+import Socket.Framing
+import Socket.WebSocket
+import Socket.Chunked
+import Socket.Http
+import Socket.Router
+import Socket.StaticFiles
+import Socket.StaticBytes
+import Socket.Splice
+import Socket.Maglev
+import Socket.HealthCheck
+import Socket.Dns
+import Socket.Impair
+import Socket.Transport
@@ -0,0 +1,26 @@
+namespace Socket
+
+/-!
+  # CPU Affinity
+
+  Pinning of the current OS thread to a set of CPUs. Together with
+  [`Socket.incomingCpu`](##Socket.Socket.incomingCpu) this lets a server keep
+  each connection on the core which already handles its packets.
+
+  *NOTE:* Lean tasks are scheduled on a shared thread pool, so pin only threads
+  started with `Task.Priority.dedicated`.
+-/
+
+/-- Restrict the calling OS thread to the given CPUs (`sched_setaffinity`). Linux only. -/
+@[extern "lean_socket_set_thread_affinity"] opaque setThreadAffinity (cpus : @& Array UInt32) : IO Unit
+
+/-- Pin the calling OS thread to a single CPU. Linux only. -/
+def pinThread (cpu : UInt32) : IO Unit := setThreadAffinity #[cpu]
+
+/-- Get the CPUs the calling OS thread may run on (`sched_getaffinity`). Linux only. -/
+@[extern "lean_socket_get_thread_affinity"] opaque threadAffinity : IO (Array UInt32)
+
+/-- Get the CPU the calling OS thread is currently running on (`sched_getcpu`). Linux only. -/
+@[extern "lean_socket_current_cpu"] opaque currentCpu : IO UInt32
+
+end Socket
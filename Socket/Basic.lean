@@ -112,9 +112,48 @@ inductive ShutdownHow where
   | readwrite
   deriving Inhabited
 
+/--
+  Ancillary data of a message,
+  which is used in [`Socket.recvMsg`](##Socket.Socket.recvMsg) and [`Socket.sendMsg`](##Socket.Socket.sendMsg).
+-/
+inductive ControlMessage where
+  /--
+    Received: the local address a datagram was sent to and the interface it arrived on.
+    Sent: the source address and interface to send from (`IP_PKTINFO`, `IPV6_PKTINFO`).
+  -/
+  | pktInfo (addr : SockAddr) (iface : UInt32)
+  /-- Original destination of a redirected datagram (`IP_ORIGDSTADDR`), receive only. -/
+  | origDstAddr (addr : SockAddr)
+  /-- TTL (IPv4) or hop limit (IPv6). -/
+  | ttl (value : UInt8)
+  /-- Type of service (IPv4) or traffic class (IPv6), which holds the DSCP and ECN bits. -/
+  | tos (value : UInt8)
+
+/--
+  Kinds of `ControlMessage` the kernel can attach to received messages,
+  which is used in [`Socket.setRecvControl`](##Socket.Socket.setRecvControl).
+-/
+inductive ControlKind where
+  | pktInfo
+  | origDstAddr
+  | ttl
+  | tos
+  deriving Inhabited
+
+/--
+  A message received with [`Socket.recvMsg`](##Socket.Socket.recvMsg).
+-/
+structure Message where
+  data : ByteArray
+  addr : SockAddr
+  control : Array ControlMessage
+
 /-- Get hostname of current machine. -/
 @[extern "lean_gethostname"] opaque hostname : IO String
 
+/-- Get the index of a network interface by name (`if_nametoindex`), e.g. `"lo"`. -/
+@[extern "lean_socket_interface_index"] opaque interfaceIndex (name : @& String) : IO UInt32
+
 end Socket
 
 /-!
@@ -0,0 +1,117 @@
+import Socket.Socket
+
+namespace Socket
+
+/-!
+  # Classic BPF Filters
+
+  A small builder for socket filters attached with
+  [`Socket.attachFilter`](##Socket.Socket.attachFilter).
+
+  For UDP and TCP sockets the filter sees the packet starting at the transport
+  header, the IP header is reachable through `Bpf.netOff`. Loads convert from
+  network byte order, so all values are given in host order.
+
+  ```lean
+  -- only accept datagrams from 10.0.0.0/8 whose payload starts with 0x01
+  let prog ← IO.ofExcept <| Bpf.all #[.srcPrefix4 0x0A000000 8, .udpPayloadByte 0 0x01]
+  sock.attachProgram prog
+  ```
+-/
+
+namespace Bpf
+
+/-- A classic BPF instruction (`struct sock_filter`). -/
+structure Insn where
+  code : UInt16
+  jt : UInt8 := 0
+  jf : UInt8 := 0
+  k : UInt32 := 0
+  deriving Inhabited, Repr
+
+/-- `BPF_LD | BPF_W | BPF_ABS`: load a 32-bit word at offset `k`. -/
+def ldAbsW : UInt16 := 0x20
+/-- `BPF_LD | BPF_H | BPF_ABS`: load a 16-bit half word at offset `k`. -/
+def ldAbsH : UInt16 := 0x28
+/-- `BPF_LD | BPF_B | BPF_ABS`: load a byte at offset `k`. -/
+def ldAbsB : UInt16 := 0x30
+/-- `BPF_ALU | BPF_AND | BPF_K`: `A := A &&& k`. -/
+def andK : UInt16 := 0x54
+/-- `BPF_JMP | BPF_JEQ | BPF_K`: skip `jt` instructions if `A == k`, `jf` otherwise. -/
+def jeqK : UInt16 := 0x15
+/-- `BPF_RET | BPF_K`: accept `k` bytes of the packet, `0` drops it. -/
+def retK : UInt16 := 0x06
+
+/-- Base offset of the network header for absolute loads (`SKF_NET_OFF`). -/
+def netOff : UInt32 := 0xFFF00000
+
+/-- Keep the whole packet. -/
+def acceptAll : Array Insn := #[{ code := retK, k := 0xFFFFFFFF }]
+
+/-- Drop every packet. -/
+def dropAll : Array Insn := #[{ code := retK, k := 0 }]
+
+/--
+  Encode a program in the layout expected by [`Socket.attachFilter`](##Socket.Socket.attachFilter).
+-/
+def encode (prog : Array Insn) : ByteArray :=
+  prog.foldl (init := ByteArray.mkEmpty (prog.size * 8)) fun b i =>
+    b |>.push (i.code &&& 0xFF).toUInt8 |>.push (i.code >>> 8).toUInt8
+      |>.push i.jt |>.push i.jf
+      |>.push (i.k &&& 0xFF).toUInt8 |>.push ((i.k >>> 8) &&& 0xFF).toUInt8
+      |>.push ((i.k >>> 16) &&& 0xFF).toUInt8 |>.push (i.k >>> 24).toUInt8
+
+/-- A condition on a packet, see [`all`](##Socket.Bpf.all). -/
+inductive Match where
+  /-- Transport source port. -/
+  | srcPort (port : UInt16)
+  /-- Transport destination port. -/
+  | dstPort (port : UInt16)
+  /-- IPv4 source address within `addr/len`, `addr` in host order (`0x0A000000` is `10.0.0.0`). -/
+  | srcPrefix4 (addr : UInt32) (len : Nat)
+  /-- Byte at `offset` from the start of the transport header. -/
+  | transportByte (offset : UInt32) (value : UInt8)
+  deriving Inhabited, Repr
+
+/-- Byte at `offset` in a UDP payload. -/
+def Match.udpPayloadByte (offset : UInt32) (value : UInt8) : Match :=
+  .transportByte (8 + offset) value
+
+/-- Instructions testing a match, always ending with a `jeq` on success. -/
+private def Match.insns : Match → Array Insn
+  | .srcPort port => #[{ code := ldAbsH, k := 0 }, { code := jeqK, k := port.toUInt32 }]
+  | .dstPort port => #[{ code := ldAbsH, k := 2 }, { code := jeqK, k := port.toUInt32 }]
+  | .srcPrefix4 addr len =>
+    let mask : UInt32 := if len == 0 then 0 else (0xFFFFFFFF : UInt32) <<< (32 - len).toUInt32
+    #[{ code := ldAbsW, k := netOff + 12 }, { code := andK, k := mask }, { code := jeqK, k := addr &&& mask }]
+  | .transportByte offset value => #[{ code := ldAbsB, k := offset }, { code := jeqK, k := value.toUInt32 }]
+
+/--
+  Build a program accepting only packets satisfying every match.
+  Fails if the program is too long for 8-bit jump offsets.
+-/
+def all (ms : Array Match) : Except String (Array Insn) := do
+  let body := ms.foldl (init := #[]) fun acc m => acc ++ m.insns
+  -- on mismatch every `jeq` jumps past the accepting `ret` to the final drop
+  let mut prog := Array.mkEmpty (body.size + 2)
+  for insn in body do
+    if insn.code == jeqK then
+      let jf := body.size - prog.size
+      if jf > 255 then
+        throw s!"Bpf.all: program of {body.size} instructions is too long"
+      prog := prog.push { insn with jf := jf.toUInt8 }
+    else
+      prog := prog.push insn
+  return prog ++ acceptAll ++ dropAll
+
+end Bpf
+
+namespace Socket
+
+/-- Attach a program built with [`Bpf`](##Socket.Bpf) (see [`attachFilter`](##Socket.Socket.attachFilter)). -/
+def attachProgram (s : Socket) (prog : Array Bpf.Insn) : IO Unit :=
+  s.attachFilter (Bpf.encode prog)
+
+end Socket
+
+end Socket
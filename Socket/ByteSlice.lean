@@ -0,0 +1,66 @@
+namespace Socket
+
+/-!
+  # Byte Slices
+
+  A view into a `ByteArray`, used by the protocol modules to hand out parts of a
+  receive buffer without copying them.
+-/
+
+/--
+  The bytes of `arr` in `[start, stop)`. The slice keeps `arr` alive, so
+  copy it with [`toByteArray`](##Socket.ByteSlice.toByteArray) to keep a small part of a large buffer.
+-/
+structure ByteSlice where
+  arr : ByteArray
+  start : Nat
+  stop : Nat
+  deriving Inhabited
+
+namespace ByteSlice
+
+/-- A slice covering the whole array. -/
+def ofByteArray (arr : ByteArray) : ByteSlice := ⟨arr, 0, arr.size⟩
+
+/-- Number of bytes in the slice. -/
+def size (s : ByteSlice) : Nat := s.stop - s.start
+
+/-- Byte at index `i` of the slice. -/
+def get! (s : ByteSlice) (i : Nat) : UInt8 := s.arr.get! (s.start + i)
+
+/-- Copy the bytes out of the slice. -/
+def toByteArray (s : ByteSlice) : ByteArray := s.arr.extract s.start s.stop
+
+/-- Append the bytes of the slice to `dst`, copying once. -/
+def appendTo (s : ByteSlice) (dst : ByteArray) : ByteArray :=
+  s.arr.copySlice s.start dst dst.size s.size
+
+/-- Decode the slice as UTF-8, without validation. -/
+def toString (s : ByteSlice) : String := String.fromUTF8Unchecked s.toByteArray
+
+instance : ToString ByteSlice := ⟨ByteSlice.toString⟩
+
+/-- Compare the slice with a byte array without copying. -/
+def eqBytes (s : ByteSlice) (b : ByteArray) : Bool := Id.run do
+  if s.size != b.size then return false
+  for i in [0:b.size] do
+    if s.arr.get! (s.start + i) != b.get! i then return false
+  return true
+
+/-- Compare two slices without copying. -/
+def eqSlice (a b : ByteSlice) : Bool := Id.run do
+  if a.size != b.size then return false
+  for i in [0:a.size] do
+    if a.arr.get! (a.start + i) != b.arr.get! (b.start + i) then return false
+  return true
+
+instance : BEq ByteSlice := ⟨eqSlice⟩
+
+/-- Sub-slice of `len` bytes starting at offset `off` of the slice. -/
+def slice (s : ByteSlice) (off len : Nat) : ByteSlice :=
+  let start := min (s.start + off) s.stop
+  ⟨s.arr, start, min (start + len) s.stop⟩
+
+end ByteSlice
+
+end Socket
@@ -0,0 +1,112 @@
+import Socket.Socket
+import Socket.Transport
+import Socket.ByteSlice
+
+namespace Socket
+
+/-!
+  # Chunked Transfer Encoding
+
+  Incremental decoder and encoder for HTTP/1.1 `Transfer-Encoding: chunked` bodies.
+
+  The decoder runs natively over a whole receive buffer per call and returns the
+  body as slices of that buffer, including partial chunks, so a body is streamed
+  without ever being buffered. Chunk extensions are skipped; trailer lines are
+  returned raw. Only the bytes of an incomplete size or trailer line are kept
+  between calls.
+
+  The encoder sends each chunk's header, data and terminator with one vectored send,
+  without copying the data.
+-/
+
+namespace Chunked
+
+/-- Where the decoder is within the chunked body. -/
+inductive Phase where
+  | size
+  | data
+  | dataEnd
+  | trailer
+  | done
+  deriving Inhabited, BEq
+
+/-- Result of one native decoding pass. -/
+structure Step where
+  chunks : Array ByteSlice
+  trailers : Array ByteSlice
+  /-- Offset of the first byte not consumed. -/
+  consumed : Nat
+  /-- Data bytes left in the current chunk. -/
+  remaining : UInt64
+  phase : Phase
+
+/--
+  Decode from offset `start` of `buf`, resuming in `phase` with `remaining` chunk bytes left.
+-/
+@[extern "lean_chunked_decode"]
+opaque decode (phase : Phase) (remaining : UInt64) (buf : @& ByteArray) (start : @& Nat := 0) : Except String Step
+
+/-- Body data and trailers decoded by one [`Decoder.feed`](##Socket.Chunked.Decoder.feed). -/
+structure Output where
+  body : Array ByteSlice
+  /-- Raw trailer lines, e.g. `Digest: ...`, without the CRLF. -/
+  trailers : Array ByteSlice
+  /-- Bytes following the end of the body, which belong to the next message. -/
+  rest : ByteSlice
+
+/-- Incremental decoder for one chunked body. -/
+structure Decoder where
+  phase : Phase := .size
+  remaining : UInt64 := 0
+  pending : ByteArray := ByteArray.empty
+  deriving Inhabited
+
+/-- Whether the terminating chunk and trailers have been read. -/
+def Decoder.done (d : Decoder) : Bool := d.phase == .done
+
+/--
+  Decode received bytes from offset `start` of `chunk` on, e.g. after the headers
+  that were read with the first part of the body.
+-/
+def Decoder.feed (d : Decoder) (chunk : ByteArray) (start : Nat := 0) : Except String (Output × Decoder) := do
+  let (buf, start) :=
+    if d.pending.size == 0 then (chunk, start) else (d.pending ++ chunk.extract start chunk.size, 0)
+  let step ← decode d.phase d.remaining buf start
+  let (pending, rest) :=
+    if step.phase == .done then
+      (ByteArray.empty, ⟨buf, step.consumed, buf.size⟩)
+    else
+      (buf.extract step.consumed buf.size, ⟨buf, buf.size, buf.size⟩)
+  let out : Output := { body := step.chunks, trailers := step.trailers, rest }
+  return (out, { phase := step.phase, remaining := step.remaining, pending })
+
+/-- Header line of a chunk of `len` bytes. -/
+def chunkHeader (len : Nat) : ByteArray :=
+  (String.mk (Nat.toDigits 16 len) ++ "\r\n").toUTF8
+
+private def crlf : ByteArray := "\r\n".toUTF8
+
+/-- The last chunk, followed by optional trailer fields and the final CRLF. -/
+def lastChunk (trailers : Array (String × String) := #[]) : ByteArray :=
+  let fields := trailers.foldl (fun acc (k, v) => acc ++ s!"{k}: {v}\r\n") ""
+  s!"0\r\n{fields}\r\n".toUTF8
+
+/-- Encode `data` as one chunk. -/
+def encode (data : ByteArray) : ByteArray :=
+  chunkHeader data.size ++ data ++ crlf
+
+/--
+  Send `data` as one chunk with a single vectored send. Empty data is skipped,
+  since an empty chunk would end the body.
+-/
+def sendChunk [Transport τ] (t : τ) (data : ByteArray) : IO Unit := do
+  if data.size != 0 then
+    Transport.sendvAll t #[chunkHeader data.size, data, crlf]
+
+/-- End the body. -/
+def sendLast [Transport τ] (t : τ) (trailers : Array (String × String) := #[]) : IO Unit :=
+  Transport.sendvAll t #[lastChunk trailers]
+
+end Chunked
+
+end Socket
@@ -0,0 +1,460 @@
+import Socket.Socket
+import Socket.ByteSlice
+
+namespace Socket
+
+/-!
+  # DNS
+
+  A stub resolver speaking DNS over UDP to the nameservers of `/etc/resolv.conf`, as an
+  alternative to the `getaddrinfo` behind `SockAddr.mk`, which blocks its thread and resolves
+  one name at a time.
+
+  Any number of queries can be outstanding. A single receiver task matches responses to
+  queries by ID and question, retransmits unanswered queries to the next nameserver, and
+  caches answers for their TTL unless they were truncated. `/etc/hosts` is consulted first.
+  Search domains are not applied, so names are taken as fully qualified.
+
+  ```lean
+  let r ← Dns.Resolver.ofSystem
+  let tasks ← names.mapM (r.query · .a)
+  for t in tasks do
+    match t.get with
+    | .ok ips => ...
+    | .error e => ...
+  ```
+-/
+
+namespace Dns
+
+/-- Record types queried for. -/
+inductive RecordType where
+  | a
+  | aaaa
+  deriving Inhabited, BEq
+
+/-- Wire value of a record type. -/
+def RecordType.toUInt16 : RecordType → UInt16
+  | .a => 1
+  | .aaaa => 28
+
+/-- Record type of `SOA` records, which carry the TTL of negative answers. -/
+def typeSOA : UInt16 := 6
+
+private def push16 (b : ByteArray) (v : UInt16) : ByteArray :=
+  (b.push (v >>> 8).toUInt8).push v.toUInt8
+
+private def read16 (b : ByteArray) (i : Nat) : Nat :=
+  (b.get! i).toNat <<< 8 ||| (b.get! (i + 1)).toNat
+
+private def read32 (b : ByteArray) (i : Nat) : Nat :=
+  read16 b i <<< 16 ||| read16 b (i + 2)
+
+/-- Canonical form of a name: lower case and without a trailing dot. -/
+def normalize (name : String) : String :=
+  (if name.endsWith "." then name.dropRight 1 else name).toLower
+
+/-- Encode a name as a sequence of labels. -/
+def encodeName (name : String) : Except String ByteArray := do
+  let mut out := ByteArray.empty
+  for label in (normalize name).splitOn "." do
+    let bytes := label.toUTF8
+    if bytes.size == 0 || bytes.size > 63 then
+      throw s!"DNS: invalid name {name}"
+    out := out.push bytes.size.toUInt8 ++ bytes
+  out := out.push 0
+  if out.size > 255 then
+    throw s!"DNS: name too long {name}"
+  return out
+
+/-- Encode a recursive query for one question. -/
+def encodeQuery (id : UInt16) (name : String) (type : RecordType) : Except String ByteArray := do
+  let qname ← encodeName name
+  let header := push16 (push16 (push16 (push16 (push16 (push16 .empty id) 0x0100) 1) 0) 0) 0
+  return push16 (push16 (header ++ qname) type.toUInt16) 1
+
+/--
+  Decode the possibly compressed name at `start`, returning it and the offset after it.
+  Compression pointers must point backwards, which rules out loops.
+-/
+def decodeName (buf : ByteArray) (start : Nat) : Except String (String × Nat) := do
+  let mut pos := start
+  let mut labels : Array String := #[]
+  let mut after : Option Nat := none
+  for _ in [0:buf.size] do
+    if pos >= buf.size then
+      throw "DNS: truncated name"
+    let len := (buf.get! pos).toNat
+    if len == 0 then
+      return (".".intercalate labels.toList, after.getD (pos + 1))
+    else if len &&& 0xC0 == 0xC0 then
+      if pos + 1 >= buf.size then
+        throw "DNS: truncated name"
+      let target := (len &&& 0x3F) <<< 8 ||| (buf.get! (pos + 1)).toNat
+      if target >= pos then
+        throw "DNS: invalid compression pointer"
+      if after.isNone then
+        after := some (pos + 2)
+      pos := target
+    else if len &&& 0xC0 != 0 then
+      throw "DNS: invalid label"
+    else
+      if pos + 1 + len > buf.size then
+        throw "DNS: truncated name"
+      labels := labels.push (String.fromUTF8Unchecked (buf.extract (pos + 1) (pos + 1 + len)))
+      pos := pos + 1 + len
+  throw "DNS: invalid name"
+
+/-- A resource record, its data a slice of the message. -/
+structure Record where
+  name : String
+  type : UInt16
+  ttl : UInt32
+  data : ByteSlice
+
+/-- A DNS message, without its additional section. -/
+structure Message where
+  id : UInt16
+  flags : UInt16
+  questions : Array (String × UInt16)
+  answers : Array Record
+  authority : Array Record
+
+def Message.isResponse (m : Message) : Bool := m.flags &&& 0x8000 != 0
+
+/-- Whether the response was truncated to fit into a datagram, so its answers may be incomplete. -/
+def Message.truncated (m : Message) : Bool := m.flags &&& 0x0200 != 0
+
+/-- Response code, `0` for success and `3` for a name that does not exist. -/
+def Message.rcode (m : Message) : UInt16 := m.flags &&& 0xF
+
+/-- Parse a query or response. -/
+def parse (buf : ByteArray) : Except String Message := do
+  if buf.size < 12 then
+    throw "DNS: message too short"
+  let mut pos := 12
+  let mut questions : Array (String × UInt16) := #[]
+  for _ in [0:read16 buf 4] do
+    let (name, next) ← decodeName buf pos
+    if next + 4 > buf.size then
+      throw "DNS: truncated question"
+    questions := questions.push (name, (read16 buf next).toUInt16)
+    pos := next + 4
+  let answers := read16 buf 6
+  let mut records : Array Record := #[]
+  for _ in [0:answers + read16 buf 8] do
+    let (name, next) ← decodeName buf pos
+    if next + 10 > buf.size then
+      throw "DNS: truncated record"
+    let stop := next + 10 + read16 buf (next + 8)
+    if stop > buf.size then
+      throw "DNS: truncated record"
+    records := records.push {
+      name
+      type := (read16 buf next).toUInt16
+      ttl := (read32 buf (next + 4)).toUInt32
+      data := ⟨buf, next + 10, stop⟩
+    }
+    pos := stop
+  return {
+    id := (read16 buf 0).toUInt16
+    flags := (read16 buf 2).toUInt16
+    questions
+    answers := records.extract 0 answers
+    authority := records.extract answers records.size
+  }
+
+/-- Addresses found for a name, or why there are none. An empty array means no records of the type. -/
+abbrev Answer := Except String (Array ByteArray)
+
+/-- Resolver settings, usually read from `/etc/resolv.conf`. -/
+structure Config where
+  /-- Up to three nameservers, tried in order. -/
+  nameservers : Array SockAddr
+  /-- Time to wait for a response before retransmitting. -/
+  timeoutMs : Nat := 5000
+  /-- Rounds over all nameservers before giving up. -/
+  attempts : Nat := 2
+  /-- Upper bound on the time answers are cached, in seconds. -/
+  maxTtl : Nat := 3600
+  /-- Time negative answers are cached without an `SOA` record saying otherwise, in seconds. -/
+  negativeTtl : Nat := 30
+
+/--
+  Parse `resolv.conf` contents: `nameserver` lines and the `timeout` and `attempts` options.
+  Without a usable nameserver, `127.0.0.1` is used.
+-/
+def Config.parse (text : String) : Config := Id.run do
+  let mut c : Config := { nameservers := #[] }
+  for line in text.splitOn "\n" do
+    let line := ((line.splitOn "#").head!.splitOn ";").head!
+    match (line.split Char.isWhitespace).filter (· != "") with
+    | ["nameserver", ip] =>
+      if let some addr := (SockAddr.parseIP ip).bind (SockAddr.ofBytes · 53) then
+        if c.nameservers.size < 3 then
+          c := { c with nameservers := c.nameservers.push addr }
+    | "options" :: options =>
+      for option in options do
+        match option.splitOn ":" with
+        | ["timeout", n] => c := { c with timeoutMs := n.toNat?.getD 5 * 1000 }
+        | ["attempts", n] => c := { c with attempts := max 1 (n.toNat?.getD 2) }
+        | _ => pure ()
+    | _ => pure ()
+  if c.nameservers.isEmpty then
+    if let some addr := (SockAddr.parseIP "127.0.0.1").bind (SockAddr.ofBytes · 53) then
+      c := { c with nameservers := #[addr] }
+  return c
+
+/-- Read the resolver settings from a `resolv.conf` file, the defaults if it is missing. -/
+def Config.load (path : System.FilePath := "/etc/resolv.conf") : IO Config := do
+  try
+    return Config.parse (← IO.FS.readFile path)
+  catch _ =>
+    return Config.parse ""
+
+/-- Parse `hosts` file contents into names and their addresses. -/
+def parseHosts (text : String) : Array (String × ByteArray) := Id.run do
+  let mut entries : Array (String × ByteArray) := #[]
+  for line in text.splitOn "\n" do
+    match ((line.splitOn "#").head!.split Char.isWhitespace).filter (· != "") with
+    | ip :: names =>
+      if let some bytes := SockAddr.parseIP ip then
+        for name in names do
+          entries := entries.push (normalize name, bytes)
+    | [] => pure ()
+  return entries
+
+/-- Read a `hosts` file, no entries if it is missing. -/
+def loadHosts (path : System.FilePath := "/etc/hosts") : IO (Array (String × ByteArray)) := do
+  try
+    return parseHosts (← IO.FS.readFile path)
+  catch _ =>
+    return #[]
+
+/-- Answer of a response to a question of type `type`, with the time to cache it for in seconds. -/
+def outcome (c : Config) (type : RecordType) (m : Message) : Answer × Nat :=
+  let negativeTtl :=
+    match m.authority.find? (·.type == typeSOA) with
+    | some soa =>
+      -- the `minimum` field ending the SOA data bounds the TTL of negative answers
+      let minimum := if soa.data.size >= 4 then read32 soa.data.arr (soa.data.stop - 4) else c.negativeTtl
+      min (min soa.ttl.toNat minimum) c.maxTtl
+    | none => c.negativeTtl
+  if m.rcode == 3 then
+    (.error "DNS: no such host", negativeTtl)
+  else if m.rcode != 0 then
+    (.error s!"DNS: server error {m.rcode}", 0)
+  else
+    let records := m.answers.filter (·.type == type.toUInt16)
+    if records.isEmpty then
+      (.ok #[], negativeTtl)
+    else
+      (.ok (records.map (·.data.toByteArray)), records.foldl (fun t r => min t r.ttl.toNat) c.maxTtl)
+
+/-- A query waiting for its response. -/
+structure Pending where
+  id : UInt16
+  name : String
+  type : RecordType
+  query : ByteArray
+  /-- Transmissions so far, which also selects the next nameserver. -/
+  sent : Nat
+  deadline : Nat
+  promise : IO.Promise Answer
+
+/-- A cached answer. -/
+structure CacheEntry where
+  name : String
+  type : RecordType
+  answer : Answer
+  expires : Nat
+
+/-- A stub resolver with its cache. -/
+structure Resolver where
+  config : Config
+  hosts : Array (String × ByteArray)
+  /-- One connected socket per nameserver, so responses from elsewhere are never seen. -/
+  socks : Array Socket
+  pending : IO.Ref (Array Pending)
+  ways : Nat
+  sets : Array (IO.Ref (Array CacheEntry))
+  closed : IO.Ref Bool
+
+namespace Resolver
+
+private def setOf (r : Resolver) (name : String) (type : RecordType) : Option (IO.Ref (Array CacheEntry)) :=
+  r.sets.get? ((mixHash (hash name) type.toUInt16.toUInt64).toNat % r.sets.size)
+
+private def cached (r : Resolver) (name : String) (type : RecordType) (now : Nat) : IO (Option Answer) := do
+  let some set := r.setOf name type | return none
+  return ((← set.get).find? fun e => e.name == name && e.type == type && e.expires > now).map (·.answer)
+
+/-- Cache an answer, evicting the entry of its set that expires first when it is full. -/
+private def store (r : Resolver) (name : String) (type : RecordType) (answer : Answer) (ttl now : Nat) : IO Unit := do
+  let some set := r.setOf name type | return
+  if ttl == 0 then
+    return
+  let e : CacheEntry := { name, type, answer, expires := now + ttl * 1000 }
+  set.modify fun es =>
+    let es := es.filter fun x => !(x.name == name && x.type == type) && x.expires > now
+    if es.size < r.ways then
+      es.push e
+    else
+      let first := es.foldl (fun m x => min m x.expires) (es.get? 0 |>.map (·.expires) |>.getD 0)
+      (es.filter (·.expires != first)).push e
+
+/--
+  Send a query to its next nameserver and wait for the response until its deadline.
+  Fails the query instead when the resolver was closed, which may happen while it is
+  being retransmitted after `close` failed the pending queries.
+-/
+private def transmit (r : Resolver) (p : Pending) : IO Unit := do
+  let some sock := r.socks.get? (p.sent % r.socks.size) | p.promise.resolve (.error "DNS: no nameservers")
+  let now ← IO.monoMsNow
+  r.pending.modify (·.push { p with sent := p.sent + 1, deadline := now + r.config.timeoutMs })
+  -- `close` sets the flag before taking the pending queries, so one of both sees this query
+  if (← r.closed.get) then
+    let isThis (q : Pending) := q.id == p.id && q.name == p.name && q.type == p.type
+    if (← r.pending.modifyGet fun ps => (ps.any isThis, ps.filter (!isThis ·))) then
+      p.promise.resolve (.error "DNS: resolver closed")
+    return
+  try discard <| sock.send p.query catch _ => pure ()
+
+private def respond (r : Resolver) (buf : ByteArray) : IO Unit := do
+  let .ok m := parse buf | return
+  let some (qname, qtype) := m.questions.get? 0 | return
+  if !m.isResponse then
+    return
+  let isFor (p : Pending) := p.id == m.id && p.name == normalize qname && p.type.toUInt16 == qtype
+  let found ← r.pending.modifyGet fun ps => (ps.find? isFor, ps.filter (!isFor ·))
+  let some p := found | return
+  let (answer, ttl) := outcome r.config p.type m
+  -- a truncated answer may lack records, so it serves this query but is not cached
+  unless m.truncated do
+    r.store p.name p.type answer ttl (← IO.monoMsNow)
+  p.promise.resolve answer
+
+/-- Retransmit the queries past their deadline, failing those out of attempts. -/
+private def expire (r : Resolver) (now : Nat) : IO Unit := do
+  let due ← r.pending.modifyGet fun ps => (ps.filter (·.deadline <= now), ps.filter (·.deadline > now))
+  for p in due do
+    if p.sent >= r.config.attempts * r.socks.size then
+      p.promise.resolve (.error "DNS: timed out")
+    else
+      r.transmit p
+
+private partial def receive (r : Resolver) : IO Unit := do
+  if (← r.closed.get) then
+    return
+  let timeout : UInt32 := if (← r.pending.get).isEmpty then 100 else 10
+  let polled ← Socket.poll (r.socks.map fun s => { sock := s, events := Poll.in, revents := 0, ignore := false }) timeout
+  for p in polled.val do
+    if p.revents != 0 then
+      try
+        if let some buf := (← p.sock.recv 4096) then
+          r.respond buf
+      catch _ =>
+        -- ICMP errors of earlier sends surface here, the retransmit timer covers them
+        pure ()
+  r.expire (← IO.monoMsNow)
+  r.receive
+
+/-- Start a resolver caching up to `capacity` answers. -/
+def create (config : Config) (hosts : Array (String × ByteArray) := #[]) (capacity : Nat := 1024) : IO Resolver := do
+  let mut socks : Array Socket := #[]
+  for ns in config.nameservers do
+    let s ← Socket.mk (ns.family.getD AddressFamily.inet) SockType.dgram
+    s.connect ns
+    socks := socks.push s
+  let ways := 4
+  let mut sets : Array (IO.Ref (Array CacheEntry)) := #[]
+  for _ in [0:max 1 (capacity / ways)] do
+    sets := sets.push (← IO.mkRef #[])
+  let r : Resolver := { config, hosts, socks, pending := (← IO.mkRef #[]), ways, sets, closed := (← IO.mkRef false) }
+  discard <| IO.asTask r.receive Task.Priority.dedicated
+  return r
+
+/-- Start a resolver configured by `/etc/resolv.conf` and `/etc/hosts`. -/
+def ofSystem : IO Resolver := do
+  create (← Config.load) (← loadHosts)
+
+/--
+  A query ID from the operating system's random source. `IO.rand` is a predictable
+  generator, which would let an off-path attacker guess IDs and spoof responses.
+-/
+private def randomId : IO UInt16 := do
+  let b ← IO.getRandomBytes 2
+  return (b.get! 0).toUInt16 <<< 8 ||| (b.get! 1).toUInt16
+
+/--
+  Look up the addresses of one type for `name` without waiting for them. Identical queries
+  in flight are sent only once.
+-/
+def query (r : Resolver) (name : String) (type : RecordType) : IO (Task Answer) := do
+  let name := normalize name
+  let fromHosts := r.hosts.filterMap fun (n, ip) =>
+    if n == name && ip.size == (if type == .a then 4 else 16) then some ip else none
+  if !fromHosts.isEmpty then
+    return .pure (.ok fromHosts)
+  if let some answer := (← r.cached name type (← IO.monoMsNow)) then
+    return .pure answer
+  if (← r.closed.get) then
+    return .pure (.error "DNS: resolver closed")
+  if let some p := (← r.pending.get).find? (fun p => p.name == name && p.type == type) then
+    return p.promise.result
+  let inUse := (← r.pending.get).map (·.id)
+  let mut id ← randomId
+  while inUse.contains id do
+    id ← randomId
+  match encodeQuery id name type with
+  | .error e => return .pure (.error e)
+  | .ok bytes =>
+    let promise ← IO.Promise.new
+    r.transmit { id, name, type, query := bytes, sent := 0, deadline := 0, promise }
+    return promise.result
+
+/--
+  Socket addresses for `name` and `port` without waiting for them: numeric addresses as they
+  are, otherwise IPv4 and IPv6 addresses as `family` allows, IPv4 first.
+-/
+def resolveAsync (r : Resolver) (name : String) (port : UInt16 := 0) (family := AddressFamily.unspecified) :
+    IO (Task (Except String (Array SockAddr))) := do
+  let toAddrs (ips : Array ByteArray) := ips.filterMap (SockAddr.ofBytes · port)
+  if let some ip := SockAddr.parseIP name then
+    return .pure (.ok (toAddrs #[ip]))
+  let skipped : Task Answer := .pure (.ok #[])
+  let v4 ← match family with
+    | .inet6 => pure skipped
+    | _ => r.query name .a
+  let v6 ← match family with
+    | .inet => pure skipped
+    | _ => r.query name .aaaa
+  return v4.bind fun a4 => v6.map fun a6 =>
+    match a4, a6 with
+    | .ok ips4, .ok ips6 => .ok (toAddrs (ips4 ++ ips6))
+    | .ok ips, .error _ | .error _, .ok ips => .ok (toAddrs ips)
+    | .error e, .error _ => .error e
+
+/-- Socket addresses for `name` and `port`. Throws when there are none. -/
+def resolve (r : Resolver) (name : String) (port : UInt16 := 0) (family := AddressFamily.unspecified) : IO (Array SockAddr) := do
+  match ← IO.wait (← r.resolveAsync name port family) with
+  | .ok addrs =>
+    if addrs.isEmpty then
+      throw <| IO.userError s!"DNS: no addresses for {name}"
+    return addrs
+  | .error e => throw <| IO.userError e
+
+/-- Stop the receiver, failing queries still waiting, and close the sockets. -/
+def close (r : Resolver) : IO Unit := do
+  r.closed.set true
+  let waiting ← r.pending.modifyGet fun ps => (ps, #[])
+  for p in waiting do
+    p.promise.resolve (.error "DNS: resolver closed")
+  for s in r.socks do
+    s.close
+
+end Resolver
+
+end Dns
+
+end Socket
@@ -0,0 +1,124 @@
+import Socket.ByteSlice
+
+namespace Socket
+
+/-!
+  # Framing
+
+  Length-prefixed framing over the `ByteArray`s returned by `Socket.recv`.
+  A single [`decode`](##Socket.Framing.decode) call splits every complete frame out of
+  a receive buffer as slices of it, so a buffer holding many small frames costs
+  one native call rather than one Lean iteration per frame:
+
+  ```lean
+  let mut d : Framing.Decoder := { kind := .u32be }
+  repeat
+    match ← sock.recv 65536 with
+    | some chunk =>
+      if chunk.size == 0 then break
+      let (frames, d') ← IO.ofExcept (d.feed chunk)
+      d := d'
+      for f in frames do handle f
+    | none => break
+  ```
+-/
+
+namespace Framing
+
+/-- How the payload length of a frame is encoded in front of it. -/
+inductive Prefix where
+  | u16be
+  | u16le
+  | u32be
+  | u32le
+  | u64be
+  | u64le
+  /-- Unsigned LEB128, 1 to 10 bytes. -/
+  | varint
+  deriving Inhabited, BEq
+
+/-- Default upper bound on a declared frame length, 16 MiB. -/
+def defaultMaxFrame : USize := 0x1000000
+
+/--
+  Decode every complete frame of `buf` from offset `start` on.
+  Returns the payloads as slices of `buf` and the offset of the first byte not consumed,
+  i.e. the start of an incomplete frame or `buf.size`.
+  A frame declaring more than `maxFrame` bytes, or a varint longer than 64 bits, is an error.
+-/
+@[extern "lean_framing_decode"]
+opaque decode (p : Prefix) (buf : @& ByteArray) (start : @& Nat := 0) (maxFrame : USize := defaultMaxFrame) : Except String (Array ByteSlice × Nat)
+
+/--
+  Encode payloads as consecutive frames into one array, ready for a single `Socket.send`.
+  A payload longer than the prefix can express is an error.
+-/
+@[extern "lean_framing_encode_many"]
+opaque encodeMany (p : Prefix) (payloads : @& Array ByteArray) : Except String ByteArray
+
+/-- Encode a single frame. -/
+def encode (p : Prefix) (payload : ByteArray) : Except String ByteArray :=
+  encodeMany p #[payload]
+
+/--
+  Size of the prefix and declared payload length of the frame at `pos`,
+  `none` while the prefix is incomplete.
+-/
+def Prefix.peek (p : Prefix) (buf : ByteArray) (pos : Nat) : Option (Nat × Nat) := Id.run do
+  let fixed (width : Nat) (bigEndian : Bool) : Option (Nat × Nat) := Id.run do
+    if pos + width > buf.size then return none
+    let mut n := 0
+    for i in [0:width] do
+      let b := buf.get! (if bigEndian then pos + i else pos + width - 1 - i)
+      n := n * 256 + b.toNat
+    return some (width, n)
+  match p with
+  | .u16be => fixed 2 true
+  | .u16le => fixed 2 false
+  | .u32be => fixed 4 true
+  | .u32le => fixed 4 false
+  | .u64be => fixed 8 true
+  | .u64le => fixed 8 false
+  | .varint =>
+    let mut n := 0
+    for i in [0:10] do
+      if pos + i >= buf.size then return none
+      let b := buf.get! (pos + i)
+      n := n + (b &&& 0x7f).toNat * 2 ^ (7 * i)
+      if b &&& 0x80 == 0 then return some (i + 1, n)
+    return none
+
+/--
+  Incremental decoder keeping the bytes of an incomplete frame between receives.
+-/
+structure Decoder where
+  kind : Prefix
+  maxFrame : USize := defaultMaxFrame
+  pending : ByteArray := ByteArray.empty
+
+/--
+  Append received bytes and return the frames completed by them.
+  The frames are slices of a buffer shared with the decoder. The tail of an incomplete
+  frame is copied once into a buffer reserved for the whole frame, and later chunks of
+  the frame are appended to it in place.
+-/
+def Decoder.feed (d : Decoder) (chunk : ByteArray) : Except String (Array ByteSlice × Decoder) := do
+  -- taking `d` apart leaves `pending` unshared, so appending to it does not copy
+  let ⟨kind, maxFrame, pending⟩ := d
+  let reserved := pending.size != 0
+  let buf := if reserved then pending ++ chunk else chunk
+  let (frames, rest) ← decode kind buf 0 maxFrame
+  let pending :=
+    if rest == buf.size then ByteArray.empty
+    else if rest == 0 && reserved then buf
+    else
+      let tail := buf.size - rest
+      let size := match kind.peek buf rest with
+        | some (header, length) => header + length
+        | none => tail
+      buf.copySlice rest (ByteArray.mkEmpty (max size tail)) 0 tail
+  return (frames, { kind, maxFrame, pending })
+
+end Framing
+
+end Socket
@@ -0,0 +1,57 @@
+import Socket.Basic
+
+namespace Socket
+
+/-!
+  # Handle Table
+
+  A native table owning `Socket` references, addressed by compact `UInt64` tokens
+  that fit into event user data (e.g. `epoll_event.data.u64`).
+
+  A token holds the socket descriptor in its low 32 bits, which is the slot index,
+  and the slot's generation in its high 32 bits. Lookups are a single array index,
+  and a token whose socket was removed (even if the descriptor was reused since)
+  no longer resolves. Tokens are never `0`.
+
+  A socket closed while in the table no longer resolves either. Its slot is reclaimed
+  when the descriptor is reused by a socket inserted later, or by `remove?`.
+-/
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `HandleTable`.
+-/
+opaque HandleTable.Nonempty : NonemptyType
+
+/--
+  Thread-safe table mapping tokens to `Socket`s. See the [module docs](#Handle-Table).
+-/
+def HandleTable : Type := HandleTable.Nonempty.type
+
+instance : Nonempty HandleTable := HandleTable.Nonempty.property
+
+namespace HandleTable
+
+/-- Create an empty table with room for descriptors below `capacity`; it grows on demand. -/
+@[extern "lean_handle_table_mk"] opaque mk (capacity : UInt32 := 1024) : IO HandleTable
+
+/--
+  Insert a `Socket` and return its token. Fails if the socket is closed
+  or already in the table. A closed socket left in the slot of its descriptor is dropped.
+-/
+@[extern "lean_handle_table_insert"] opaque insert (t : @& HandleTable) (s : Socket) : IO UInt64
+
+/-- Find the `Socket` referenced by a token, `none` if the token is stale or the socket closed. -/
+@[extern "lean_handle_table_find"] opaque find? (t : @& HandleTable) (token : UInt64) : IO (Option Socket)
+
+/--
+  Remove the `Socket` referenced by a token and return it, `none` if the token is stale.
+  Tokens issued for it become stale.
+-/
+@[extern "lean_handle_table_remove"] opaque remove? (t : @& HandleTable) (token : UInt64) : IO (Option Socket)
+
+/-- Number of sockets in the table. -/
+@[extern "lean_handle_table_size"] opaque size (t : @& HandleTable) : IO USize
+
+end HandleTable
+
+end Socket
@@ -0,0 +1,146 @@
+import Socket.Basic
+
+namespace Socket
+
+/-!
+  # Health Checks
+
+  Active TCP health checking of many backends from one thread. A probe round is a single
+  native call: every target is connected to without blocking, optionally sent a request
+  whose response must start with an expected prefix, and all of them are driven by one
+  `poll` loop with a deadline per target.
+
+  A [`HealthChecker`](##Socket.HealthChecker) repeats rounds on an interval and keeps an
+  up/down table with hysteresis, calling back when a target changes state:
+
+  ```lean
+  let checker ← HealthChecker.create targets (onChange := fun i up _ => setReady i up)
+  discard <| IO.asTask checker.run Task.Priority.dedicated
+  ```
+-/
+
+namespace HealthCheck
+
+/-- A backend to probe. With an empty `send` and `expect` a completed connect is a success. -/
+structure Target where
+  addr : SockAddr
+  /-- Sent once connected. -/
+  send : ByteArray := ByteArray.empty
+  /-- Prefix the response must start with. -/
+  expect : ByteArray := ByteArray.empty
+  /-- Time allowed for the whole probe. -/
+  timeoutMs : UInt32 := 1000
+
+/-- Result of one probe. -/
+inductive Outcome where
+  /-- The probe succeeded after `micros` microseconds. -/
+  | up (micros : UInt32)
+  | down (reason : String)
+  deriving Inhabited
+
+def Outcome.isUp : Outcome → Bool
+  | .up _ => true
+  | .down _ => false
+
+instance : ToString Outcome where
+  toString
+    | .up micros => s!"up ({micros} µs)"
+    | .down reason => s!"down ({reason})"
+
+/--
+  Probe all targets concurrently, with at most `concurrency` sockets open at once, and
+  return their outcomes in order. Not supported on Windows.
+-/
+@[extern "lean_health_probe"]
+opaque probe (targets : @& Array Target) (concurrency : UInt32 := 256) : IO (Array Outcome)
+
+/-- State of a target in a [`HealthChecker`](##Socket.HealthChecker). -/
+structure Status where
+  up : Bool
+  /-- Consecutive outcomes disagreeing with `up`. -/
+  streak : Nat := 0
+  last : Option Outcome := none
+  deriving Inhabited
+
+/-- Apply one outcome to a status, returning whether the target changed state. -/
+def Status.update (s : Status) (o : Outcome) (rise fall : Nat) : Status × Bool :=
+  if o.isUp == s.up then
+    ({ s with streak := 0, last := some o }, false)
+  else if s.streak + 1 >= (if s.up then fall else rise) then
+    ({ up := !s.up, streak := 0, last := some o }, true)
+  else
+    ({ s with streak := s.streak + 1, last := some o }, false)
+
+end HealthCheck
+
+open HealthCheck in
+/-- Periodic health checks of a fixed set of targets. -/
+structure HealthChecker where
+  targets : Array Target
+  /-- Consecutive successes that bring a target that is down up. -/
+  rise : Nat
+  /-- Consecutive failures that take a target that is up down. -/
+  fall : Nat
+  intervalMs : Nat
+  concurrency : UInt32
+  /-- Called with the index of a target, its new state and the outcome that changed it. -/
+  onChange : Nat → Bool → Outcome → IO Unit
+  states : IO.Ref (Array Status)
+  stopped : IO.Ref Bool
+
+namespace HealthChecker
+
+open HealthCheck
+
+/-- Create a checker. Targets start out as `initiallyUp`, without calling `onChange`. -/
+def create (targets : Array Target) (rise : Nat := 2) (fall : Nat := 3) (intervalMs : Nat := 1000)
+    (concurrency : UInt32 := 256) (initiallyUp := false)
+    (onChange : Nat → Bool → Outcome → IO Unit := fun _ _ _ => pure ()) : IO HealthChecker := do
+  return {
+    targets, rise, fall, intervalMs, concurrency, onChange
+    states := (← IO.mkRef (Array.mkArray targets.size ({ up := initiallyUp } : Status)))
+    stopped := (← IO.mkRef false)
+  }
+
+/-- Run one probe round and update the state table, calling `onChange` for every flip. -/
+def round (c : HealthChecker) : IO Unit := do
+  let outcomes ← probe c.targets c.concurrency
+  let mut changes : Array (Nat × Bool × Outcome) := #[]
+  let mut states ← c.states.get
+  for i in [0:outcomes.size] do
+    let o := outcomes[i]!
+    let (s, changed) := states[i]!.update o c.rise c.fall
+    states := states.set! i s
+    if changed then
+      changes := changes.push (i, s.up, o)
+  c.states.set states
+  for (i, up, o) in changes do
+    c.onChange i up o
+
+/-- Run rounds every `intervalMs` milliseconds until [`stop`](##Socket.HealthChecker.stop). -/
+partial def run (c : HealthChecker) : IO Unit := do
+  unless (← c.stopped.get) do
+    let start ← IO.monoMsNow
+    c.round
+    let elapsed := (← IO.monoMsNow) - start
+    if elapsed < c.intervalMs then
+      IO.sleep (c.intervalMs - elapsed).toUInt32
+    c.run
+
+/-- Make [`run`](##Socket.HealthChecker.run) return after its current round. -/
+def stop (c : HealthChecker) : IO Unit :=
+  c.stopped.set true
+
+/-- Whether target `i` is up. -/
+def isUp (c : HealthChecker) (i : Nat) : IO Bool := do
+  return match (← c.states.get).get? i with
+    | some s => s.up
+    | none => false
+
+/-- Current state of every target. -/
+def status (c : HealthChecker) : IO (Array Status) :=
+  c.states.get
+
+end HealthChecker
+
+end Socket
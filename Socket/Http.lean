@@ -0,0 +1,335 @@
+import Socket.Socket
+import Socket.Transport
+import Socket.SockAddr
+import Socket.ByteSlice
+import Socket.Chunked
+
+namespace Socket
+
+/-!
+  # HTTP Client
+
+  HTTP/1.1 client with streamed response bodies, keep-alive connection reuse and
+  request pipelining.
+
+  Response heads are parsed natively in one pass over the receive buffer; the reason
+  phrase and header fields are slices of that buffer. Bodies delimited by
+  `Content-Length`, by chunked encoding or by the end of the connection are handed to a
+  callback as slices of the receive buffers, so a large body is never buffered:
+
+  ```lean
+  let pool ← Http.Pool.create addr "example.com"
+  let resp ← pool.fetch { path := "/" }
+  IO.println resp.head.status
+  ```
+-/
+
+namespace Http
+
+/-- A header field, as slices of the receive buffer. -/
+structure Header where
+  name : ByteSlice
+  value : ByteSlice
+  deriving Inhabited
+
+/-- Status line and header fields of a response. -/
+structure Head where
+  reason : ByteSlice
+  headers : Array Header
+  /-- Offset just past the empty line ending the head. -/
+  stop : Nat
+  status : UInt16
+  /-- Minor HTTP version, `1` for HTTP/1.1. -/
+  minor : UInt8
+  deriving Inhabited
+
+/--
+  Parse a response head starting at offset `start` of `buf`, `none` if the head is
+  incomplete. Obsolete line folding is rejected, and so are heads over 64 KiB.
+-/
+@[extern "lean_http_parse_head"]
+opaque parseHead (buf : @& ByteArray) (start : @& Nat := 0) : Except String (Option Head)
+
+private def eqIgnoreCase (s : ByteSlice) (lower : ByteArray) : Bool := Id.run do
+  if s.size != lower.size then return false
+  for i in [0:lower.size] do
+    let c := s.get! i
+    let c := if c >= 65 && c <= 90 then c + 32 else c
+    if c != lower.get! i then return false
+  return true
+
+/-- Value of the first header field called `name`, compared case-insensitively. -/
+def Head.header? (h : Head) (name : String) : Option ByteSlice :=
+  let lower := name.toLower.toUTF8
+  h.headers.find? (eqIgnoreCase ·.name lower) |>.map (·.value)
+
+/-- Whether the server lets the connection be reused after this response. -/
+def Head.keepAlive (h : Head) : Bool :=
+  match h.header? "connection" with
+  | some v =>
+    let v := v.toString.toLower
+    if h.minor == 0 then v == "keep-alive" else v != "close"
+  | none => h.minor != 0
+
+/-- How a response body is delimited. -/
+private inductive BodyKind where
+  | empty
+  | length (n : Nat)
+  | chunked
+  | eof
+
+private def bodyKind (method : String) (h : Head) : Except String BodyKind :=
+  if method == "HEAD" || h.status / 100 == 1 || h.status == 204 || h.status == 304 then
+    return .empty
+  else
+    match h.header? "transfer-encoding" with
+    | some te =>
+      if te.toString.toLower.trim.endsWith "chunked" then return .chunked else return .eof
+    | none =>
+      match h.header? "content-length" with
+      | some v =>
+        match v.toString.trim.toNat? with
+        | some n => return .length n
+        | none => throw "Http: invalid Content-Length"
+      | none => return .eof
+
+/-- A request. `Host`, and `Content-Length` when there is a body, are added when sent. -/
+structure Request where
+  method : String := "GET"
+  path : String := "/"
+  headers : Array (String × String) := #[]
+  body : ByteArray := ByteArray.empty
+
+/-- Whether repeating the request has the same effect as sending it once. -/
+def Request.idempotent (r : Request) : Bool :=
+  ["GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"].contains r.method
+
+/-- Request line and header fields of a request. -/
+def Request.encodeHead (r : Request) (host : String) : ByteArray :=
+  let fields := r.headers.foldl (fun acc (k, v) => acc ++ s!"{k}: {v}\r\n") ""
+  let length :=
+    if r.body.size > 0 || r.method == "POST" || r.method == "PUT" then
+      s!"Content-Length: {r.body.size}\r\n"
+    else
+      ""
+  s!"{r.method} {r.path} HTTP/1.1\r\nHost: {host}\r\n{length}{fields}\r\n".toUTF8
+
+/-- A response with its whole body. -/
+structure Response where
+  head : Head
+  body : ByteArray
+
+/-- Size of the receive buffer. -/
+def recvSize : USize := 65536
+
+/-- A connection to one server. -/
+structure Connection where
+  sock : Socket
+  host : String
+  /-- Received bytes past the last response, the start of the next pipelined one. -/
+  buffer : IO.Ref ByteArray
+  /-- Cleared once the server asked to close, or a body ran until end of stream. -/
+  reusable : IO.Ref Bool
+
+namespace Connection
+
+/-- Connect to `addr`. `host` is sent in the `Host` header. -/
+def connect (addr : SockAddr) (host : String) : IO Connection := do
+  let family := addr.family.getD AddressFamily.inet
+  let sock ← Socket.mk family SockType.stream
+  sock.connect addr
+  return { sock, host, buffer := (← IO.mkRef ByteArray.empty), reusable := (← IO.mkRef true) }
+
+/-- Close the connection. -/
+def close (c : Connection) : IO Unit :=
+  c.sock.close
+
+/-- Receive more bytes, `none` at end of stream. -/
+private def recvMore (c : Connection) : IO (Option ByteArray) := do
+  match ← c.sock.recv recvSize with
+  | some chunk => return if chunk.size == 0 then none else some chunk
+  | none => return none
+
+private def closedError : IO.Error :=
+  IO.userError "Http: connection closed before the end of the response"
+
+private partial def readHead (c : Connection) (buf : ByteArray) : IO (Head × ByteArray) := do
+  match ← IO.ofExcept (parseHead buf) with
+  | some head => return (head, buf)
+  | none =>
+    match ← c.recvMore with
+    | some chunk => readHead c (buf ++ chunk)
+    | none => throw closedError
+
+private def keep (c : Connection) (buf : ByteArray) (pos : Nat) : IO Unit :=
+  c.buffer.set (if pos >= buf.size then ByteArray.empty else buf.extract pos buf.size)
+
+private partial def readLength (c : Connection) (buf : ByteArray) (pos n : Nat) (onBody : ByteSlice → IO Unit) : IO Unit := do
+  let take := min n (buf.size - pos)
+  if take > 0 then
+    onBody ⟨buf, pos, pos + take⟩
+  if take == n then
+    c.keep buf (pos + take)
+  else
+    match ← c.recvMore with
+    | some chunk => readLength c chunk 0 (n - take) onBody
+    | none => throw closedError
+
+private partial def readChunked (c : Connection) (d : Chunked.Decoder) (buf : ByteArray) (pos : Nat) (onBody : ByteSlice → IO Unit) : IO Unit := do
+  let (out, d) ← IO.ofExcept (d.feed buf pos)
+  for s in out.body do
+    onBody s
+  if d.done then
+    c.keep out.rest.arr out.rest.start
+  else
+    match ← c.recvMore with
+    | some chunk => readChunked c d chunk 0 onBody
+    | none => throw closedError
+
+private partial def readToEof (c : Connection) (buf : ByteArray) (pos : Nat) (onBody : ByteSlice → IO Unit) : IO Unit := do
+  if pos < buf.size then
+    onBody ⟨buf, pos, buf.size⟩
+  match ← c.recvMore with
+  | some chunk => readToEof c chunk 0 onBody
+  | none => c.buffer.set ByteArray.empty
+
+/--
+  Read the next response to a request with the given method, passing its body to
+  `onBody` piece by piece. The slices are only valid for reading; copy what must outlive
+  the callback. Interim `1xx` responses are skipped.
+-/
+partial def readResponse (c : Connection) (method : String) (onBody : ByteSlice → IO Unit) : IO Head := do
+  let (head, buf) ← readHead c (← c.buffer.swap ByteArray.empty)
+  if head.status / 100 == 1 && head.status != 101 then
+    c.keep buf head.stop
+    return (← c.readResponse method onBody)
+  if !head.keepAlive then
+    c.reusable.set false
+  match ← IO.ofExcept (bodyKind method head) with
+  | .empty => c.keep buf head.stop
+  | .length n => readLength c buf head.stop n onBody
+  | .chunked => readChunked c {} buf head.stop onBody
+  | .eof =>
+    c.reusable.set false
+    readToEof c buf head.stop onBody
+  return head
+
+/-- Send a request without waiting for its response. -/
+def send (c : Connection) (r : Request) : IO Unit :=
+  c.sock.sendvAll #[r.encodeHead c.host, r.body]
+
+/-- Send a request and stream its response body to `onBody`. -/
+def request (c : Connection) (r : Request) (onBody : ByteSlice → IO Unit) : IO Head := do
+  c.send r
+  c.readResponse r.method onBody
+
+/--
+  Wait for the first byte of a response, returning `false` when the connection was
+  closed or reset before any arrived.
+-/
+private def awaitResponse (c : Connection) : IO Bool := do
+  if (← c.buffer.get).size > 0 then
+    return true
+  match ← tryCatch c.recvMore fun _ => pure none with
+  | some chunk =>
+    c.buffer.set chunk
+    return true
+  | none => return false
+
+private def collect (c : Connection) (method : String) : IO Response := do
+  let body ← IO.mkRef ByteArray.empty
+  let head ← c.readResponse method fun s => body.modify s.appendTo
+  return { head, body := (← body.get) }
+
+/-- Send a request and read its whole response. -/
+def fetch (c : Connection) (r : Request) : IO Response := do
+  c.send r
+  c.collect r.method
+
+/--
+  Send all requests with one vectored send, then read their responses in order.
+  A batch should fit in the socket buffers, since nothing is read while it is sent.
+-/
+def pipeline (c : Connection) (rs : Array Request) : IO (Array Response) := do
+  c.sock.sendvAll <| rs.foldl (fun bufs r => (bufs.push (r.encodeHead c.host)).push r.body) #[]
+  rs.mapM fun r => c.collect r.method
+
+end Connection
+
+/-- Idle keep-alive connections to one server. -/
+structure Pool where
+  addr : SockAddr
+  host : String
+  maxIdle : Nat
+  idle : IO.Ref (Array Connection)
+
+namespace Pool
+
+/-- A pool keeping at most `maxIdle` idle connections. -/
+def create (addr : SockAddr) (host : String) (maxIdle : Nat := 16) : IO Pool :=
+  return { addr, host, maxIdle, idle := (← IO.mkRef #[]) }
+
+/-- Take an idle connection, or connect a new one. -/
+def acquire (p : Pool) : IO Connection := do
+  match ← p.idle.modifyGet fun cs => (cs.back?, cs.pop) with
+  | some c => return c
+  | none => Connection.connect p.addr p.host
+
+/-- Return a connection after its last response was read completely. -/
+def release (p : Pool) (c : Connection) : IO Unit := do
+  if (← c.reusable.get) then
+    let kept ← p.idle.modifyGet fun cs =>
+      if cs.size < p.maxIdle then (true, cs.push c) else (false, cs)
+    if !kept then
+      c.close
+  else
+    c.close
+
+/-- Run `read` on a connection, releasing it afterwards or closing it when `read` throws. -/
+private def finish (p : Pool) (c : Connection) (read : IO Response) : IO Response := do
+  try
+    let resp ← read
+    p.release c
+    return resp
+  catch e =>
+    c.close
+    throw e
+
+/--
+  Send a request on a pooled connection and read its whole response. When an idle
+  connection turns out to be closed, as it is after the server timed it out, the request
+  is sent again on a new connection if `retry` is set, which it is for idempotent methods.
+  Only requests that got no byte of a response are sent again.
+-/
+def fetch (p : Pool) (r : Request) (retry : Bool := r.idempotent) : IO Response := do
+  match ← p.idle.modifyGet fun cs => (cs.back?, cs.pop) with
+  | some c =>
+    if !retry then
+      return (← p.finish c (c.fetch r))
+    let sent ← tryCatch (c.send r *> pure true) fun _ => pure false
+    if sent && (← c.awaitResponse) then
+      p.finish c (c.collect r.method)
+    else
+      c.close
+      let c ← Connection.connect p.addr p.host
+      p.finish c (c.fetch r)
+  | none =>
+    let c ← Connection.connect p.addr p.host
+    p.finish c (c.fetch r)
+
+/-- Run `f` with a pooled connection, which is released afterwards unless `f` throws. -/
+def withConnection (p : Pool) (f : Connection → IO α) : IO α := do
+  let c ← p.acquire
+  try
+    let a ← f c
+    p.release c
+    return a
+  catch e =>
+    c.close
+    throw e
+
+end Pool
+
+end Http
+
+end Socket
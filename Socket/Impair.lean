@@ -0,0 +1,241 @@
+import Socket.Socket
+import Socket.Transport
+
+namespace Socket
+
+/-!
+  # Impair
+
+  Proxies that make loopback behave like a wide-area link, for benchmarking batching and
+  pipelining under realistic conditions on one machine. Each direction is a link with its
+  own latency, jitter and bandwidth. UDP datagrams can additionally be dropped and reordered.
+
+  ```lean
+  let profile : Impair.Profile := { latencyMs := 20, jitterMs := 2, bytesPerSec := 1250000 }
+  discard <| IO.asTask (Impair.tcpProxy profile listenAddr serverAddr) Task.Priority.dedicated
+  ```
+
+  Delays have millisecond resolution.
+-/
+
+namespace Impair
+
+/-- Conditions of one direction of a link. -/
+structure Profile where
+  /-- One-way delay added to everything. -/
+  latencyMs : Nat := 0
+  /-- Upper bound of a uniformly distributed extra delay. Never reorders TCP data. -/
+  jitterMs : Nat := 0
+  /-- Bandwidth cap in bytes per second, `0` for none. -/
+  bytesPerSec : Nat := 0
+  /-- Share of UDP datagrams dropped, in percent. -/
+  lossPercent : Float := 0
+  /-- Share of UDP datagrams held back by `reorderMs`, letting later ones overtake them, in percent. -/
+  reorderPercent : Float := 0
+  reorderMs : Nat := 0
+  /-- TCP bytes queued in the link before the proxy stops reading, like a receive window. -/
+  bufferBytes : Nat := 1048576
+  deriving Inhabited
+
+private def chance (percent : Float) : IO Bool := do
+  if percent <= 0 then
+    return false
+  return (← IO.rand 0 999999).toFloat < percent * 10000
+
+private def millis (ms : Nat) : Nat := ms * 1000000
+
+/-- Actions run in order of their times by one task. -/
+structure DelayLine where
+  /-- Actions with their times in `IO.monoNanosNow` nanoseconds, sorted by time. -/
+  queue : IO.Ref (Array (Nat × IO Unit))
+  /-- Resolved to wake up the task waiting on an empty queue. -/
+  wake : IO.Ref (Option (IO.Promise Unit))
+  closed : IO.Ref Bool
+
+namespace DelayLine
+
+private partial def run (d : DelayLine) : IO Unit := do
+  if (← d.closed.get) then
+    return
+  let now ← IO.monoNanosNow
+  let due ← d.queue.modifyGet fun q => (q.filter (·.1 <= now), q.filter (·.1 > now))
+  for (_, action) in due do
+    try action catch _ => pure ()
+  if due.isEmpty then
+    if (← d.queue.get).isEmpty then
+      let p ← IO.Promise.new
+      d.wake.set (some p)
+      -- an action scheduled before the promise was stored would otherwise be missed
+      if (← d.queue.get).isEmpty then
+        IO.wait p.result
+    else
+      -- also bounds the delay of actions scheduled ahead of the current first one
+      IO.sleep 1
+  d.run
+
+/-- Start a delay line with its task. -/
+def create : IO DelayLine := do
+  let d : DelayLine := { queue := (← IO.mkRef #[]), wake := (← IO.mkRef none), closed := (← IO.mkRef false) }
+  discard <| IO.asTask d.run Task.Priority.dedicated
+  return d
+
+/-- Run `action` at `time`, after the actions scheduled for the same time or earlier. -/
+def schedule (d : DelayLine) (time : Nat) (action : IO Unit) : IO Unit := do
+  d.queue.modify fun q => (q.filter (·.1 <= time)).push (time, action) ++ q.filter (·.1 > time)
+  if let some p := (← d.wake.modifyGet fun w => (w, none)) then
+    p.resolve ()
+
+/-- Wait until every action scheduled so far has run. -/
+def flush (d : DelayLine) : IO Unit := do
+  let p ← IO.Promise.new
+  let last := (← d.queue.get).foldl (fun t e => max t e.1) 0
+  d.schedule last (p.resolve ())
+  IO.wait p.result
+
+/-- Stop the task, dropping actions not run yet. -/
+def close (d : DelayLine) : IO Unit := do
+  d.closed.set true
+  d.queue.set #[]
+  if let some p := (← d.wake.modifyGet fun w => (w, none)) then
+    p.resolve ()
+
+end DelayLine
+
+/-- Serialization and propagation state of one direction. -/
+structure Link where
+  profile : Profile
+  line : DelayLine
+  /-- When the capped link finishes sending what it was given so far. -/
+  freeAt : IO.Ref Nat
+  /-- Latest delivery time so far, which TCP deliveries must not precede. -/
+  lastDelivery : IO.Ref Nat
+  /-- TCP bytes waiting for delivery. -/
+  queued : IO.Ref Nat
+
+namespace Link
+
+def create (profile : Profile) : IO Link := do
+  return {
+    profile
+    line := (← DelayLine.create)
+    freeAt := (← IO.mkRef 0)
+    lastDelivery := (← IO.mkRef 0)
+    queued := (← IO.mkRef 0)
+  }
+
+/-- Delivery time of `size` bytes handed to the link now, before any reordering. -/
+def deliveryTime (l : Link) (size : Nat) : IO Nat := do
+  let now ← IO.monoNanosNow
+  let sent ←
+    if l.profile.bytesPerSec == 0 then
+      pure now
+    else
+      l.freeAt.modifyGet fun free =>
+        let done := max now free + size * 1000000000 / l.profile.bytesPerSec
+        (done, done)
+  let jitter ← if l.profile.jitterMs == 0 then pure 0 else IO.rand 0 (millis l.profile.jitterMs)
+  return sent + millis l.profile.latencyMs + jitter
+
+end Link
+
+/-- Forward a TCP stream through a link until the end of the stream, which is passed on. -/
+partial def forwardTcp (l : Link) (src dst : Socket) : IO Unit := do
+  while (← l.queued.get) > l.profile.bufferBytes do
+    IO.sleep 1
+  let chunk ← try src.recv 65536 catch _ => pure none
+  match chunk with
+  | some bytes =>
+    if bytes.size == 0 then
+      l.line.schedule (← l.lastDelivery.get) (dst.shutdown ShutdownHow.write)
+    else
+      let time ← l.deliveryTime bytes.size
+      let time ← l.lastDelivery.modifyGet fun last => (max time last, max time last)
+      l.queued.modify (· + bytes.size)
+      l.line.schedule time do
+        l.queued.modify (· - bytes.size)
+        dst.sendvAll #[bytes]
+      forwardTcp l src dst
+  | none =>
+    l.line.schedule (← l.lastDelivery.get) (dst.shutdown ShutdownHow.readwrite)
+
+/-- Proxy one accepted connection to `target`, impairing both directions. -/
+def proxyTcpConnection (up down : Profile) (client : Socket) (target : SockAddr) : IO Unit := do
+  let server ← Socket.mk (target.family.getD AddressFamily.inet) SockType.stream
+  try
+    server.connect target
+  catch _ =>
+    client.close
+    server.close
+    return
+  let toServer ← Link.create up
+  let toClient ← Link.create down
+  let reader ← IO.asTask (forwardTcp toServer client server) Task.Priority.dedicated
+  forwardTcp toClient server client
+  discard <| IO.wait reader
+  toServer.line.flush
+  toClient.line.flush
+  toServer.line.close
+  toClient.line.close
+  client.close
+  server.close
+
+/--
+  Accept TCP connections on `listen` and proxy each to `target`, applying `up` to data sent
+  to the server and `down` to data sent back. Runs until the listener fails.
+-/
+partial def tcpProxy (up : Profile) (listen target : SockAddr) (down : Profile := up) : IO Unit := do
+  let l ← Socket.mk (listen.family.getD AddressFamily.inet) SockType.stream
+  l.setReuseAddr true
+  l.bind listen
+  l.listen 128
+  let rec loop : IO Unit := do
+    let (_, client) ← l.accept
+    discard <| IO.asTask (proxyTcpConnection up down client target) Task.Priority.dedicated
+    loop
+  loop
+
+/-- Schedule a datagram for delivery by `send`, unless it is lost. -/
+def forwardDatagram (l : Link) (bytes : ByteArray) (send : IO Unit) : IO Unit := do
+  if (← chance l.profile.lossPercent) then
+    return
+  let time ← l.deliveryTime bytes.size
+  let extra := if (← chance l.profile.reorderPercent) then millis l.profile.reorderMs else 0
+  l.line.schedule (time + extra) send
+
+private partial def relayReplies (down : Link) (listener server : Socket) (client : SockAddr) : IO Unit := do
+  try
+    if let some bytes := (← server.recv 65536) then
+      down.forwardDatagram bytes (discard <| listener.sendto bytes client)
+  catch _ =>
+    -- ICMP errors of earlier sends surface here, e.g. while the server is down
+    IO.sleep 1
+  relayReplies down listener server client
+
+/--
+  Receive UDP datagrams on `listen` and forward them to `target` from one socket per client,
+  relaying the replies back. Runs until the listening socket fails.
+-/
+partial def udpProxy (up : Profile) (listen target : SockAddr) (down : Profile := up) : IO Unit := do
+  let family := listen.family.getD AddressFamily.inet
+  let listener ← Socket.mk family SockType.dgram
+  listener.bind listen
+  let toServer ← Link.create up
+  let toClient ← Link.create down
+  let clients ← IO.mkRef (#[] : Array (SockAddr × Socket))
+  let rec loop : IO Unit := do
+    let some (peer, bytes) ← listener.recvfrom 65536 | loop
+    let server ← match (← clients.get).find? (·.1.beq peer) with
+      | some (_, s) => pure s
+      | none => do
+        let s ← Socket.mk (target.family.getD family) SockType.dgram
+        s.connect target
+        clients.modify (·.push (peer, s))
+        discard <| IO.asTask (relayReplies toClient listener s peer) Task.Priority.dedicated
+        pure s
+    toServer.forwardDatagram bytes (discard <| server.send bytes)
+    loop
+  loop
+
+end Impair
+
+end Socket
@@ -0,0 +1,56 @@
+import Socket.Basic
+
+namespace Socket
+
+/-!
+  # Maglev
+
+  Consistent hashing of keys onto backends with a native Maglev lookup table
+  (Eisenbud et al., NSDI 2016). Every backend fills the slots of the table following its own
+  permutation of them, so rebuilding after a backend joins or leaves moves few keys, and a
+  lookup is a single indexed read. The `some` results are built with the table, so lookups
+  allocate nothing.
+
+  ```lean
+  let table ← Maglev.mk #[(cacheA, 1), (cacheB, 1), (cacheC, 2)]
+  match table.lookup (hash key) with
+  | some node => ...
+  | none => noBackends
+  ```
+-/
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `Maglev`.
+-/
+opaque Maglev.Nonempty : NonemptyType
+
+/--
+  Immutable table mapping `UInt64` keys to weighted backend addresses.
+-/
+def Maglev : Type := Maglev.Nonempty.type
+
+instance : Nonempty Maglev := Maglev.Nonempty.property
+
+namespace Maglev
+
+/--
+  Build a table of `size` slots from backends and their weights. A backend receives a share
+  of the slots proportional to its weight, and backends of weight `0` receive none. `size`
+  must be a prime no smaller than the number of backends. Keys are spread more evenly with
+  a larger table, e.g. 100 slots per backend.
+-/
+@[extern "lean_maglev_mk"]
+opaque mk (backends : @& Array (SockAddr × UInt32)) (size : UInt32 := 65537) : IO Maglev
+
+/-- The backend for `key`, `none` when no backend has a weight. -/
+@[extern "lean_maglev_lookup"] opaque lookup (m : @& Maglev) (key : UInt64) : Option SockAddr
+
+/-- Index into the array the table was built from of the backend for `key`. -/
+@[extern "lean_maglev_lookup_index"] opaque lookupIndex (m : @& Maglev) (key : UInt64) : Option Nat
+
+/-- Number of backends, `0` when none has a weight. -/
+@[extern "lean_maglev_backend_count"] opaque backendCount (m : @& Maglev) : Nat
+
+end Maglev
+
+end Socket
@@ -0,0 +1,92 @@
+import Socket.SockAddr
+
+namespace Socket
+
+/-!
+  # Prefix Trie
+
+  Longest-prefix-match table over IPv4 and IPv6 prefixes, looked up directly with
+  a `SockAddr`, e.g. the peer address returned by `Socket.accept`. A lookup walks
+  at most one node per address bit, and IPv4-mapped IPv6 addresses match IPv4 prefixes.
+
+  A `PrefixTrie` is immutable once built. To reload an access list atomically,
+  build a new trie and swap it into an `IO.Ref`:
+
+  ```lean
+  let acl ← IO.mkRef (← PrefixTrie.build #[← .parse "10.0.0.0/8" 1])
+  -- on reload
+  acl.set (← PrefixTrie.build newEntries)
+  -- at accept time
+  let allowed := (← acl.get).lookupD peer 0 == 1
+  ```
+-/
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `PrefixTrie`.
+-/
+opaque PrefixTrie.Nonempty : NonemptyType
+
+/--
+  Immutable longest-prefix-match table mapping address prefixes to `UInt32` values.
+-/
+def PrefixTrie : Type := PrefixTrie.Nonempty.type
+
+instance : Nonempty PrefixTrie := PrefixTrie.Nonempty.property
+
+namespace PrefixTrie
+
+/-- A prefix `addr/len` with the value it maps to. The port of `addr` is ignored. -/
+structure Entry where
+  addr : SockAddr
+  len : UInt8
+  value : UInt32
+
+/-- Whether `ip` is an IPv4-mapped IPv6 address, `::ffff:a.b.c.d`. -/
+private def isMapped (ip : ByteArray) : Bool :=
+  ip.size == 16 && (List.range 10).all (ip.get! · == 0) && ip.get! 10 == 0xff && ip.get! 11 == 0xff
+
+/--
+  Parse a prefix in CIDR notation such as `"192.168.0.0/16"` or `"2001:db8::/32"`.
+  A missing length means a single address. An IPv4-mapped IPv6 prefix such as
+  `"::ffff:10.0.0.0/104"` is the IPv4 prefix it maps, and must be at least 96 bits long.
+-/
+def Entry.parse (cidr : String) (value : UInt32) : IO Entry := do
+  let (host, len?) := match cidr.splitOn "/" with
+    | [host, len] => (host, len.toNat?)
+    | _ => (cidr, none)
+  let addr ← SockAddr.mk host "0"
+  let mapped := match SockAddr.parseIP host with
+    | some ip => isMapped ip
+    | none => false
+  let bits := if mapped then 32 else if addr.family matches some AddressFamily.inet6 then 128 else 32
+  match len? with
+  | some len =>
+    if mapped && (len < 96 || len > 128) then
+      throw <| IO.userError s!"invalid prefix length in {cidr}: an IPv4-mapped prefix needs 96 to 128 bits"
+    let len := if mapped then len - 96 else len
+    if len > bits then
+      throw <| IO.userError s!"invalid prefix length in {cidr}"
+    return { addr, len := len.toUInt8, value }
+  | none =>
+    if cidr.contains '/' then
+      throw <| IO.userError s!"invalid prefix {cidr}"
+    return { addr, len := bits.toUInt8, value }
+
+@[extern "lean_prefix_trie_build"]
+private opaque build' (entries : @& Array (SockAddr × UInt8 × UInt32)) : IO PrefixTrie
+
+/--
+  Build a trie from prefixes. When the same prefix occurs more than once the last entry wins.
+-/
+def build (entries : Array Entry) : IO PrefixTrie :=
+  build' <| entries.map fun e => (e.addr, e.len, e.value)
+
+/-- Value of the longest prefix containing the address, `none` if no prefix matches. -/
+@[extern "lean_prefix_trie_lookup"] opaque lookup? (t : @& PrefixTrie) (a : @& SockAddr) : Option UInt32
+
+/-- Value of the longest prefix containing the address, `default` if no prefix matches. Never allocates. -/
+@[extern "lean_prefix_trie_lookup_d"] opaque lookupD (t : @& PrefixTrie) (a : @& SockAddr) (default : UInt32) : UInt32
+
+end PrefixTrie
+
+end Socket
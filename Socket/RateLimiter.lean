@@ -0,0 +1,50 @@
+import Socket.Basic
+
+namespace Socket
+
+/-!
+  # Rate Limiter
+
+  Per-address token buckets for throttling peers right after `Socket.accept` or
+  `Socket.recvfrom`. The table has a fixed size chosen at creation: addresses are
+  hashed into 4-way sets, and a new address replaces the least recently seen one
+  of its set. The port is ignored and IPv4-mapped IPv6 addresses share the bucket
+  of the IPv4 address. The table is split into independently locked shards, so it
+  can be shared by all workers of a server.
+-/
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `RateLimiter`.
+-/
+opaque RateLimiter.Nonempty : NonemptyType
+
+/--
+  Thread-safe, fixed-memory table of per-address token buckets.
+-/
+def RateLimiter : Type := RateLimiter.Nonempty.type
+
+instance : Nonempty RateLimiter := RateLimiter.Nonempty.property
+
+namespace RateLimiter
+
+/--
+  Create a rate limiter tracking about `capacity` addresses over `shards` locks
+  (both rounded up to powers of two). Each address may spend up to `burst` tokens
+  at once, refilled at `rate` tokens per second.
+-/
+@[extern "lean_rate_limiter_mk"]
+opaque mk (rate : Float) (burst : Float) (shards : UInt32 := 64) (capacity : UInt32 := 65536) : IO RateLimiter
+
+/--
+  Take `tokens` from the bucket of the address, returns whether there were enough.
+  Addresses other than inet and inet6 are always allowed.
+-/
+@[extern "lean_rate_limiter_consume"]
+opaque consume (l : @& RateLimiter) (a : @& SockAddr) (tokens : Float) : IO Bool
+
+/-- Take a single token from the bucket of the address, returns whether the peer is allowed. -/
+def allow (l : RateLimiter) (a : SockAddr) : IO Bool := l.consume a 1
+
+end RateLimiter
+
+end Socket
@@ -0,0 +1,398 @@
+import Socket.Socket
+import Socket.Transport
+import Socket.ByteSlice
+
+namespace Socket
+
+/-!
+  # Redis Client
+
+  A RESP2/RESP3 client for Redis-compatible servers.
+
+  Replies are parsed in place: bulk strings are [`ByteSlice`](##Socket.ByteSlice)s of
+  the receive buffer rather than copies.
+
+  Commands are pipelined automatically. Every command is appended to an outbox and
+  whichever caller finds no write in progress sends everything queued so far in one
+  `send`, so commands issued concurrently from many tasks share writes. A reader task
+  matches replies to commands in order.
+
+  ```lean
+  let client ← Redis.Client.connect (← SockAddr.mk "localhost" "6379")
+  let tasks ← (List.range 100).mapM fun i => client.command #["INCR", s!"key{i % 10}"]
+  for t in tasks do
+    IO.println (← IO.ofExcept (← IO.wait t))
+  ```
+-/
+
+namespace Redis
+
+/-- A RESP2 or RESP3 reply. -/
+inductive Reply where
+  /-- Simple string, `+OK`. -/
+  | simple (s : String)
+  /-- Error, `-ERR ...`. -/
+  | error (s : String)
+  /-- Integer, `:1`. -/
+  | integer (i : Int)
+  /-- Bulk string, `$3\r\nfoo`. -/
+  | bulk (b : ByteSlice)
+  /-- Null bulk string or array (RESP2) and null (RESP3). -/
+  | nil
+  /-- Array, `*2\r\n...`. -/
+  | array (xs : Array Reply)
+  /-- RESP3 boolean, `#t`. -/
+  | bool (b : Bool)
+  /-- RESP3 double, `,1.5`. -/
+  | double (f : Float)
+  /-- RESP3 big number, `(123...`, kept as its decimal digits. -/
+  | bigNumber (s : String)
+  /-- RESP3 bulk error, `!21\r\n...`. -/
+  | bulkError (s : ByteSlice)
+  /-- RESP3 verbatim string, `=15\r\ntxt:...`. -/
+  | verbatim (format : String) (text : ByteSlice)
+  /-- RESP3 map, `%2\r\n...`. -/
+  | map (kvs : Array (Reply × Reply))
+  /-- RESP3 set, `~2\r\n...`. -/
+  | set (xs : Array Reply)
+  /-- RESP3 out-of-band push, `>2\r\n...`. -/
+  | push (xs : Array Reply)
+  deriving Inhabited
+
+namespace Reply
+
+/-- Render a reply for debugging. -/
+partial def render : Reply → String
+  | simple s => s
+  | error s => s!"(error) {s}"
+  | integer i => s!"(integer) {i}"
+  | bulk b => s!"\"{b}\""
+  | nil => "(nil)"
+  | array xs => s!"{xs.toList.map render}"
+  | bool b => s!"{b}"
+  | double f => s!"{f}"
+  | bigNumber s => s
+  | bulkError s => s!"(error) {s}"
+  | verbatim _ t => t.toString
+  | map kvs => s!"{kvs.toList.map fun (k, v) => (render k, render v)}"
+  | set xs => s!"(set) {xs.toList.map render}"
+  | push xs => s!"(push) {xs.toList.map render}"
+
+instance : ToString Reply := ⟨Reply.render⟩
+
+end Reply
+
+/-- Outcome of parsing a reply from a buffer. -/
+inductive ParseResult where
+  /-- A complete reply, followed by the offset just past it. -/
+  | done (r : Reply) (next : Nat)
+  /-- The buffer ends before the reply does. -/
+  | incomplete
+  /-- The bytes are not valid RESP. -/
+  | invalid (msg : String)
+  deriving Inhabited
+
+/-- Index of the `\r` of the first `\r\n` at or after `pos`. -/
+private partial def findCrlf (buf : ByteArray) (pos : Nat) : Option Nat :=
+  if pos + 1 >= buf.size then none
+  else if buf.get! pos == 13 && buf.get! (pos + 1) == 10 then some pos
+  else findCrlf buf (pos + 1)
+
+/-- Parse a decimal integer from `buf[start, stop)`. -/
+private def parseInt (buf : ByteArray) (start stop : Nat) : Option Int := Id.run do
+  if start >= stop then return none
+  let neg := buf.get! start == 45
+  let first := if neg || buf.get! start == 43 then start + 1 else start
+  if first >= stop then return none
+  let mut n : Nat := 0
+  for i in [first:stop] do
+    let c := buf.get! i
+    if c < 48 || c > 57 then return none
+    n := n * 10 + (c - 48).toNat
+  return some (if neg then -(n : Int) else n)
+
+/-- Parse a RESP3 double such as `1.5`, `-2e10`, `inf` or `nan`. -/
+private def parseDouble (buf : ByteArray) (start stop : Nat) : Option Float := Id.run do
+  let text := String.fromUTF8Unchecked (buf.extract start stop)
+  match text with
+  | "inf" => return some (1.0 / 0.0)
+  | "-inf" => return some (-1.0 / 0.0)
+  | "nan" => return some (0.0 / 0.0)
+  | _ => pure ()
+  let neg := text.startsWith "-"
+  let body := if neg || text.startsWith "+" then text.drop 1 else text
+  let (num, exp) := match body.splitOn "e" with
+    | [num, exp] => (num, exp)
+    | _ => match body.splitOn "E" with
+      | [num, exp] => (num, exp)
+      | _ => (body, "0")
+  let (int, frac) := match num.splitOn "." with
+    | [int, frac] => (int, frac)
+    | _ => (num, "")
+  let some mantissa := (int ++ frac).toNat? | return none
+  let some e := exp.toInt? | return none
+  let e := e - frac.length
+  let f := if e < 0 then Float.ofScientific mantissa true e.natAbs else Float.ofScientific mantissa false e.natAbs
+  return some (if neg then -f else f)
+
+/-- Parse the reply starting at `pos`. Bulk strings reference `buf` without copying. -/
+partial def parse (buf : ByteArray) (pos : Nat) : ParseResult :=
+  if pos >= buf.size then .incomplete else
+  match findCrlf buf (pos + 1) with
+  | none => .incomplete
+  | some eol =>
+    let next := eol + 2
+    let line := fun _ : Unit => String.fromUTF8Unchecked (buf.extract (pos + 1) eol)
+    let length := parseInt buf (pos + 1) eol
+    -- `$`, `!` and `=` are followed by a payload of the given length
+    let blob (k : ByteSlice → ParseResult) : ParseResult :=
+      match length with
+      | none => .invalid "invalid length"
+      | some len =>
+        if len < 0 then .done .nil next
+        else if next + len.toNat + 2 > buf.size then .incomplete
+        else k ⟨buf, next, next + len.toNat⟩
+    let aggregate (per : Nat) (k : Array Reply → Reply) : ParseResult :=
+      match length with
+      | none => .invalid "invalid length"
+      | some len =>
+        if len < 0 then .done .nil next
+        else match parseMany buf next (len.toNat * per) #[] with
+          | (.done _ after, xs) => .done (k xs) after
+          | (r, _) => r
+    match (buf.get! pos).toNat with
+    | 43 => .done (.simple (line ())) next -- '+'
+    | 45 => .done (.error (line ())) next -- '-'
+    | 58 => -- ':'
+      (match length with
+        | some i => .done (.integer i) next
+        | none => .invalid "invalid integer")
+    | 36 => blob fun b => .done (.bulk b) (b.stop + 2) -- '$'
+    | 33 => blob fun b => .done (.bulkError b) (b.stop + 2) -- '!'
+    | 61 => blob fun b => -- '='
+      .done (.verbatim (b.slice 0 3).toString (b.slice 4 b.size)) (b.stop + 2)
+    | 42 => aggregate 1 .array -- '*'
+    | 126 => aggregate 1 .set -- '~'
+    | 62 => aggregate 1 .push -- '>'
+    | 37 => aggregate 2 fun xs => .map (pairs xs) -- '%'
+    | 124 => -- '|', attributes are skipped
+      (match aggregate 2 fun xs => .map (pairs xs) with
+        | .done _ after => parse buf after
+        | r => r)
+    | 95 => .done .nil next -- '_'
+    | 35 => .done (.bool (buf.get! (pos + 1) == 116)) next -- '#'
+    | 44 => -- ','
+      (match parseDouble buf (pos + 1) eol with
+        | some f => .done (.double f) next
+        | none => .invalid "invalid double")
+    | 40 => .done (.bigNumber (line ())) next -- '('
+    | c => .invalid s!"unknown reply type {c}"
+where
+  parseMany (buf : ByteArray) (pos : Nat) (n : Nat) (acc : Array Reply) : ParseResult × Array Reply :=
+    if acc.size == n then (.done .nil pos, acc) else
+    match parse buf pos with
+    | .done r next => parseMany buf next n (acc.push r)
+    | r => (r, acc)
+  pairs (xs : Array Reply) : Array (Reply × Reply) := Id.run do
+    let mut kvs := Array.mkEmpty (xs.size / 2)
+    for i in [0:xs.size / 2] do
+      kvs := kvs.push (xs[2 * i]!, xs[2 * i + 1]!)
+    return kvs
+
+/--
+  Buffer size at which the reply at `pos`, found `incomplete` by `parse`, may be complete.
+  Without a payload length to go by, that is one byte more than `buf` holds.
+-/
+partial def needed (buf : ByteArray) (pos : Nat) : Nat :=
+  match findCrlf buf (pos + 1) with
+  | none => buf.size + 1
+  | some eol =>
+    let next := eol + 2
+    let length := (parseInt buf (pos + 1) eol).getD 0
+    let elements (n : Nat) : Nat := Id.run do
+      let mut p := next
+      for _ in [0:n] do
+        match parse buf p with
+        | .done _ after => p := after
+        | _ => return needed buf p
+      -- only an attribute is followed by another reply
+      return needed buf p
+    match (buf.get! pos).toNat with
+    | 36 | 33 | 61 => max (next + length.toNat + 2) (buf.size + 1) -- '$', '!', '='
+    | 42 | 126 | 62 => elements length.toNat -- '*', '~', '>'
+    | 37 | 124 => elements (2 * length.toNat) -- '%', '|'
+    | _ => buf.size + 1
+
+/-- Encode a command as a RESP array of bulk strings. -/
+def encodeCommand (args : Array ByteArray) : ByteArray := Id.run do
+  let mut out := s!"*{args.size}\r\n".toUTF8
+  for arg in args do
+    out := out ++ s!"${arg.size}\r\n".toUTF8 ++ arg ++ "\r\n".toUTF8
+  return out
+
+/-- FIFO queue of promises waiting for replies. -/
+structure Fifo (α : Type) where
+  front : List α := []
+  back : List α := []
+
+def Fifo.push (q : Fifo α) (a : α) : Fifo α := { q with back := a :: q.back }
+
+def Fifo.pop (q : Fifo α) : Option α × Fifo α :=
+  match q.front with
+  | a :: front => (some a, { q with front := front })
+  | [] => match q.back.reverse with
+    | a :: front => (some a, { front := front, back := [] })
+    | [] => (none, q)
+
+def Fifo.toList (q : Fifo α) : List α := q.front ++ q.back.reverse
+
+/-- Result of a command: the reply, or why no reply will arrive. -/
+abbrev Response := Except String Reply
+
+/-- A pipelining connection to a Redis-compatible server. -/
+structure Client where
+  conn : Transport.Handle
+  /-- Encoded commands not sent yet. -/
+  outbox : IO.Ref (Array (ByteArray × IO.Promise Response))
+  /-- Whether some caller is currently writing the outbox. -/
+  flushing : IO.Ref Bool
+  /-- Promises of sent commands, in the order of their replies. -/
+  inflight : IO.Ref (Fifo (IO.Promise Response))
+  /-- Set once the connection failed or was closed. -/
+  closed : IO.Ref (Option String)
+  /-- Handler of RESP3 out-of-band pushes. -/
+  onPush : Reply → IO Unit
+
+namespace Client
+
+/-- Fail every command waiting for a reply, and any command issued later. -/
+private def failAll (c : Client) (msg : String) : IO Unit := do
+  c.closed.set (some msg)
+  let queued ← c.outbox.modifyGet fun b => (b, #[])
+  for (_, p) in queued do
+    p.resolve (.error msg)
+  let pending ← c.inflight.modifyGet fun q => (q.toList, {})
+  for p in pending do
+    p.resolve (.error msg)
+
+/-- Write the outbox until it is empty, while holding the `flushing` flag. -/
+private partial def flushLoop (c : Client) : IO Unit := do
+  let batch ← c.outbox.modifyGet fun b => (b, #[])
+  if batch.isEmpty then
+    c.flushing.set false
+    -- a command queued after the swap but before the release would be stranded
+    if !(← c.outbox.get).isEmpty then
+      if (← c.flushing.modifyGet fun busy => (!busy, true)) then
+        flushLoop c
+    return
+  let mut bytes := ByteArray.empty
+  for (cmd, p) in batch do
+    bytes := bytes ++ cmd
+    c.inflight.modify (·.push p)
+  try
+    Transport.sendAll c.conn bytes
+  catch e =>
+    c.flushing.set false
+    c.failAll (toString e)
+    return
+  flushLoop c
+
+/--
+  Parse and dispatch replies from `buf` at `pos`, receiving more bytes once `parse` finds the
+  reply at `pos` incomplete. It is only parsed again once `buf` reaches the size `needed`
+  reports, so a large bulk string arriving in many chunks is not re-parsed for each of them.
+-/
+private partial def readLoop (c : Client) (buf : ByteArray) (pos : Nat) (need : Nat := 0) : IO Unit := do
+  match if buf.size >= need then parse buf pos else .incomplete with
+  | .done r next =>
+    if let .push _ := r then
+      c.onPush r
+    else
+      match ← c.inflight.modifyGet Fifo.pop with
+      | some p => p.resolve (.ok r)
+      | none => pure ()
+    readLoop c buf next
+  | .invalid msg => c.failAll s!"protocol error: {msg}"
+  | .incomplete =>
+    let need := if buf.size >= need then needed buf pos else need
+    match ← c.conn.recv 65536 with
+    | some chunk =>
+      if chunk.size == 0 then
+        c.failAll "connection closed"
+      else if pos == buf.size then
+        readLoop c chunk 0
+      else if pos == 0 then
+        -- nothing was parsed from `buf`, so no reply shares it and it grows in place
+        readLoop c (buf ++ chunk) 0 need
+      else
+        -- earlier replies keep the old buffer, the unparsed tail moves to one sized for its reply
+        let tail := buf.size - pos
+        let fresh := buf.copySlice pos (ByteArray.mkEmpty (max (need - pos) (tail + chunk.size))) 0 tail
+        readLoop c (fresh ++ chunk) 0 (need - pos)
+    | none =>
+      discard <| c.conn.readable 100
+      readLoop c buf pos need
+
+/-- Start a client on a connected transport, such as a `Socket` or a `MemPipe`. -/
+def ofTransport [Transport τ] (t : τ) (onPush : Reply → IO Unit := fun _ => pure ()) : IO Client := do
+  let c : Client := {
+    conn := Transport.handle t
+    outbox := (← IO.mkRef #[])
+    flushing := (← IO.mkRef false)
+    inflight := (← IO.mkRef {})
+    closed := (← IO.mkRef none)
+    onPush := onPush
+  }
+  let reader : IO Unit := do
+    try readLoop c ByteArray.empty 0
+    catch e => c.failAll (toString e)
+  discard <| IO.asTask reader Task.Priority.dedicated
+  return c
+
+/-- Start a client on a connected socket. -/
+def ofSocket (sock : Socket) (onPush : Reply → IO Unit := fun _ => pure ()) : IO Client :=
+  ofTransport sock onPush
+
+/-- Connect to a server. -/
+def connect (addr : SockAddr) (onPush : Reply → IO Unit := fun _ => pure ()) : IO Client := do
+  let family := addr.family.getD AddressFamily.inet
+  let sock ← Socket.mk family SockType.stream
+  sock.connect addr
+  ofSocket sock onPush
+
+/--
+  Issue a command without waiting for its reply. Commands issued before the
+  previous batch was written are sent together.
+-/
+def commandBytes (c : Client) (args : Array ByteArray) : IO (Task Response) := do
+  let p : IO.Promise Response ← IO.Promise.new
+  if let some msg := (← c.closed.get) then
+    p.resolve (.error msg)
+    return p.result
+  c.outbox.modify (·.push (encodeCommand args, p))
+  if (← c.flushing.modifyGet fun busy => (!busy, true)) then
+    flushLoop c
+  return p.result
+
+/-- Issue a command with string arguments without waiting for its reply. -/
+def command (c : Client) (args : Array String) : IO (Task Response) :=
+  c.commandBytes (args.map String.toUTF8)
+
+/-- Issue a command and wait for its reply. Error replies are returned, not thrown. -/
+def exec (c : Client) (args : Array String) : IO Reply := do
+  match ← IO.wait (← c.command args) with
+  | .ok r => return r
+  | .error msg => throw <| IO.userError msg
+
+/-- Close the connection, failing commands still waiting for replies. -/
+def close (c : Client) : IO Unit := do
+  c.failAll "client closed"
+  -- wakes up the reader task blocked in `recv`
+  try c.conn.shutdown ShutdownHow.readwrite catch _ => pure ()
+  c.conn.close
+
+end Client
+
+end Redis
+
+end Socket
@@ -0,0 +1,173 @@
+import Socket.ByteSlice
+
+namespace Socket
+
+/-!
+  # Router
+
+  Request path router backed by a native compressed radix tree. Patterns are made of
+  static text, `:name` parameters matching up to the next `/`, and a final `*name`
+  wildcard matching the rest of the path:
+
+  ```lean
+  let router ← Router.build #[
+    ("/users/:id", showUser),
+    ("/users/:id/posts/:post", showPost),
+    ("/static/*path", serveStatic)
+  ]
+  match router.lookup buf pathStart pathStop with
+  | some (handler, params) => handler (params.find? "id")
+  | none => notFound
+  ```
+
+  Lookups run directly on the bytes of the receive buffer, and captured parameters are
+  returned as offsets into it. Static segments win over parameters, which win over
+  wildcards. The tree backtracks when a more specific branch fails further down.
+
+  On a hot path, [`find`](##Socket.Router.find) returns just the route index and leaves
+  the captures in a reusable [`Captures`](##Socket.Router.Captures) buffer:
+
+  ```lean
+  let caps ← Router.Captures.mk
+  match ← router.find buf caps pathStart pathStop with
+  | 0 => notFound
+  | route => handlers[route.toNat - 1]! (← caps.get buf 0)
+  ```
+-/
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `Router.Table`.
+-/
+opaque Router.Table.Nonempty : NonemptyType
+
+/--
+  Native radix tree of route patterns, immutable once built.
+-/
+def Router.Table : Type := Router.Table.Nonempty.type
+
+instance : Nonempty Router.Table := Router.Table.Nonempty.property
+
+/--
+  Build a table from patterns. Duplicate patterns, including ones differing only in
+  parameter names, are an error.
+-/
+@[extern "lean_router_build"]
+opaque Router.Table.build (patterns : @& Array String) : IO Router.Table
+
+/--
+  Match `path[start, stop)`. The result is written into `scratch` when it is not shared,
+  so a caller that passes back the previous result performs no allocation. It holds
+  little-endian `UInt32`s: the route index plus one (`0` when nothing matched), the number
+  of captures, then the start and stop offset of each capture.
+-/
+@[extern "lean_router_lookup"]
+opaque Router.Table.lookup (t : @& Router.Table) (path : @& ByteArray) (start stop : USize) (scratch : ByteArray) : ByteArray
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `Router.Captures`.
+-/
+opaque Router.Captures.Nonempty : NonemptyType
+
+/--
+  Native buffer of the offsets captured by a lookup, overwritten by every
+  [`Table.find`](##Socket.Router.Table.find) into it. Not to be shared between tasks.
+-/
+def Router.Captures : Type := Router.Captures.Nonempty.type
+
+instance : Nonempty Router.Captures := Router.Captures.Nonempty.property
+
+@[extern "lean_router_captures_mk"]
+opaque Router.Captures.mk : IO Router.Captures
+
+/-- Number of parameters captured by the last lookup. -/
+@[extern "lean_router_captures_size"]
+opaque Router.Captures.size (c : @& Router.Captures) : IO UInt32
+
+/-- Offset `i` of the last lookup: the start of capture `i / 2` when `i` is even, else its stop. -/
+@[extern "lean_router_captures_offset"]
+opaque Router.Captures.offset (c : @& Router.Captures) (i : UInt32) : IO UInt32
+
+/--
+  Match `path[start, stop)` like [`lookup`](##Socket.Router.Table.lookup), returning the
+  route index plus one (`0` when nothing matched) and leaving the captures in `caps`.
+  Nothing is allocated.
+-/
+@[extern "lean_router_find"]
+opaque Router.Table.find (t : @& Router.Table) (path : @& ByteArray) (start stop : USize) (caps : @& Router.Captures) : IO UInt32
+
+/-- Capture `i` of the last lookup into `caps`, as a slice of the `path` it matched. -/
+def Router.Captures.get (caps : Router.Captures) (path : ByteArray) (i : Nat) : IO ByteSlice := do
+  let i := i.toUInt32
+  return ⟨path, (← caps.offset (2 * i)).toNat, (← caps.offset (2 * i + 1)).toNat⟩
+
+/-- Routes with their handlers. -/
+structure Router (α : Type) where
+  table : Router.Table
+  handlers : Array α
+  /-- Parameter names of each route, in pattern order. -/
+  names : Array (Array String)
+
+namespace Router
+
+private def readU32 (b : ByteArray) (i : Nat) : Nat :=
+  (b.get! i).toNat ||| (b.get! (i + 1)).toNat <<< 8 ||| (b.get! (i + 2)).toNat <<< 16 ||| (b.get! (i + 3)).toNat <<< 24
+
+/-- Parameters captured by a match, as offsets into the matched buffer. -/
+structure Params where
+  path : ByteArray
+  names : Array String
+  /-- Result of [`Table.lookup`](##Socket.Router.Table.lookup), reusable as the next scratch buffer. -/
+  raw : ByteArray
+
+/-- Number of captured parameters. -/
+def Params.size (p : Params) : Nat := readU32 p.raw 4
+
+/-- The `i`th captured parameter. -/
+def Params.get (p : Params) (i : Nat) : ByteSlice :=
+  ⟨p.path, readU32 p.raw (8 + 8 * i), readU32 p.raw (12 + 8 * i)⟩
+
+/-- The parameter called `name`, without its `:` or `*`. -/
+def Params.find? (p : Params) (name : String) : Option ByteSlice :=
+  (p.names.findIdx? (· == name)).map p.get
+
+private def paramNames (pattern : String) : Array String :=
+  (pattern.splitOn "/").foldl (init := #[]) fun names seg =>
+    match seg.toList.dropWhile (fun c => c != ':' && c != '*') with
+    | _ :: name => names.push (String.mk name)
+    | [] => names
+
+/-- Build a router from patterns and their handlers. -/
+def build (routes : Array (String × α)) : IO (Router α) := do
+  let patterns := routes.map (·.1)
+  return {
+    table := (← Table.build patterns)
+    handlers := routes.map (·.2)
+    names := patterns.map paramNames
+  }
+
+/--
+  Find the handler for `path[start, stop)`, e.g. the request target of a request line up
+  to any `?`. Pass the `raw` buffer of the previous result's `Params` as `scratch` to
+  avoid allocating it again.
+-/
+def lookup [Inhabited α] (r : Router α) (path : ByteArray) (start : Nat := 0) (stop : Nat := path.size) (scratch : ByteArray := ByteArray.empty) : Option (α × Params) :=
+  let raw := r.table.lookup path start.toUSize stop.toUSize scratch
+  match readU32 raw 0 with
+  | 0 => none
+  | route => some (r.handlers[route - 1]!, { path, names := r.names[route - 1]!, raw })
+
+/--
+  Route index plus one for `path[start, stop)`, `0` when nothing matched, with the captured
+  parameters left in `caps`. Unlike [`lookup`](##Socket.Router.lookup) this allocates
+  no result, so a server can dispatch on the index itself.
+-/
+def find (r : Router α) (path : ByteArray) (caps : Captures) (start : Nat := 0) (stop : Nat := path.size) : IO UInt32 :=
+  r.table.find path start.toUSize stop.toUSize caps
+
+/-- Index into `names` of the parameter called `name`, for use with `Captures.get`. -/
+def paramIndex? (r : Router α) (route : Nat) (name : String) : Option Nat :=
+  (r.names.get? route).bind (·.findIdx? (· == name))
+
+end Router
+
+end Socket
@@ -27,6 +27,25 @@ Supports only inet and inet6 address families, always returns false for others.
 -/
 @[extern "lean_sockaddr_beq"] opaque beq (a1 a2 : @& SockAddr) : Bool
 
+/--
+  Socket address of a raw IP address, 4 bytes for IPv4 or 16 bytes for IPv6, and a port.
+  `none` for other sizes.
+-/
+@[extern "lean_sockaddr_of_bytes"] opaque ofBytes (ip : @& ByteArray) (port : UInt16 := 0) : Option SockAddr
+
+/--
+  Raw bytes of a numeric IPv4 or IPv6 address such as `"10.0.0.1"` or `"::1"`, without
+  any name lookup. `none` for anything else.
+-/
+@[extern "lean_sockaddr_parse_ip"] opaque parseIP (s : @& String) : Option ByteArray
+
+/--
+  Hash of the IP address, ignoring the port, for keying per-client state such as a
+  [`Maglev`](##Socket.Maglev) pick. IPv4 addresses hash like their IPv4-mapped IPv6 form.
+  `0` for families other than inet and inet6.
+-/
+@[extern "lean_sockaddr_host_hash"] opaque hostHash (a : @& SockAddr) : UInt64
+
 end SockAddr
 
 /-- Convert [`SockAddr`](##Socket.SockAddr) to `String`. -/
@@ -13,9 +13,32 @@ namespace Socket
 
   *NOTE:* Although Socket is designed to be automatically closed when garbage collected,
   it's a good practice to manually close it beforehand.
+
+  Closing an already closed `Socket` does nothing. When deferred close is enabled
+  (see [`setDeferredClose`](##Socket.Socket.setDeferredClose)) the descriptor is handed
+  to the background closer thread and errors from `close()` are not reported.
 -/
 @[extern "lean_socket_close"] opaque close (s : @& Socket) : IO Unit
 
+/--
+  Close all the sockets with a single call, enqueueing them together when deferred close is enabled.
+-/
+@[extern "lean_socket_close_many"] opaque closeMany (ss : @& Array Socket) : IO Unit
+
+/--
+  Enable or disable the background closer thread.
+
+  While enabled, `close`, `closeMany` and the finalizer of an unreachable `Socket` enqueue
+  the descriptor instead of calling `close()` on the current thread, which can block with
+  `SO_LINGER` or a large unsent queue. Not available on Windows.
+-/
+@[extern "lean_socket_set_deferred_close"] opaque setDeferredClose (enabled : Bool) : IO Unit
+
+/--
+  Wait until every descriptor enqueued for deferred close has been closed.
+-/
+@[extern "lean_socket_flush_deferred_close"] opaque flushDeferredClose : IO Unit
+
 /--
   Initiate a connection on a socket.
 -/
@@ -36,11 +59,22 @@ namespace Socket
 -/
 @[extern "lean_socket_accept"] opaque accept (s : @& Socket) : IO (SockAddr × Socket)
 
+/--
+  Accept a connection on a non-blocking socket, `none` when no connection is pending.
+-/
+@[extern "lean_socket_try_accept"] opaque tryAccept (s : @& Socket) : IO (Option (SockAddr × Socket))
+
 /--
   Send a message from a socket.
 -/
 @[extern "lean_socket_send"] opaque send (s : @& Socket) (b : @& ByteArray) : IO USize
 
+/--
+  Send several buffers with a single call (`writev`). Returns the number of bytes sent,
+  which may end inside any of the buffers.
+-/
+@[extern "lean_socket_sendv"] opaque sendv (s : @& Socket) (bufs : @& Array ByteArray) : IO USize
+
 /--
   Receive a message from a socket.
 -/
@@ -56,10 +90,60 @@ namespace Socket
 -/
 @[extern "lean_socket_recvfrom"] opaque recvfrom (s : @& Socket) (n : @& USize) : IO (Option (SockAddr × ByteArray))
 
+/--
+  Ask the kernel to attach control messages of the given kind to received messages.
+  The IPv4 or IPv6 option is picked from the socket's family.
+-/
+@[extern "lean_socket_set_recv_control"] opaque setRecvControl (s : @& Socket) (kind : ControlKind) (enabled : Bool := true) : IO Unit
+
+/--
+  Receive a message together with its sender and control messages (`recvmsg`).
+  `controlLen` is the size of the buffer for control messages. Returns `none` if a
+  non-blocking socket has nothing to read.
+-/
+@[extern "lean_socket_recvmsg"] opaque recvMsg (s : @& Socket) (n : @& USize) (controlLen : @& USize := 256) : IO (Option Message)
+
+/--
+  Send a message with control messages (`sendmsg`), e.g. a `pktInfo` received with the
+  request so that a wildcard-bound socket replies from the address the request was sent to.
+  `addr` is required for unconnected sockets.
+-/
+@[extern "lean_socket_sendmsg"] opaque sendMsg (s : @& Socket) (b : @& ByteArray) (addr : @& Option SockAddr) (control : @& Array ControlMessage := #[]) : IO USize
+
 /--
   Shut down part of a full-duplex connection.
 -/
-@[extern "lean_socket_shutdown"] opaque shutdown (s : @& Socket) (h : ShutdownHow) : IO Unit 
+@[extern "lean_socket_shutdown"] opaque shutdown (s : @& Socket) (h : ShutdownHow) : IO Unit
+
+/--
+  Configure `SO_LINGER`: when enabled, `close` blocks for up to `secs` seconds
+  until unsent data is delivered.
+-/
+@[extern "lean_socket_set_linger"] opaque setLinger (s : @& Socket) (enabled : Bool) (secs : UInt16) : IO Unit
+
+/--
+  Abort the connection: close the `Socket` with a zero `SO_LINGER` timeout, so the peer
+  receives RST and no `TIME_WAIT` state is kept on this side. Unsent data is discarded.
+-/
+@[extern "lean_socket_abort"] opaque abort (s : @& Socket) : IO Unit
+
+private partial def discardUntilEof (s : Socket) (chunk : USize) : IO Unit := do
+  match ← s.recv chunk with
+  | some bytes => if bytes.size != 0 then discardUntilEof s chunk
+  | none => pure ()
+
+/--
+  Gracefully close a connection: shut down the write side, discard whatever the peer
+  still sends until it closes its side, then close the `Socket`.
+
+  Meant for blocking sockets; on a non-blocking socket it stops at the first empty read.
+-/
+def drain (s : Socket) (chunk : USize := 4096) : IO Unit := do
+  try
+    s.shutdown ShutdownHow.write
+    discardUntilEof s chunk
+  finally
+    s.close
 
 /--
   Get address of connected peer.
@@ -76,6 +160,114 @@ namespace Socket
 -/
 @[extern "lean_socket_getblocking"] opaque blocking (s : @& Socket) : IO Bool
 
+/--
+  Get the CPU on which packets for this socket are being processed (`SO_INCOMING_CPU`).
+  Returns `none` if the kernel has not recorded a CPU yet. Linux only.
+
+  A server can use it on accepted connections to hand each connection to the worker
+  pinned to that CPU (see [`setThreadAffinity`](##Socket.setThreadAffinity)).
+-/
+@[extern "lean_socket_get_incoming_cpu"] opaque incomingCpu (s : @& Socket) : IO (Option UInt32)
+
+/--
+  Set `SO_INCOMING_CPU`. On a `SO_REUSEPORT` listener group this steers new connections
+  to the listener whose CPU matches the one handling the packet. Linux only.
+-/
+@[extern "lean_socket_set_incoming_cpu"] opaque setIncomingCpu (s : @& Socket) (cpu : UInt32) : IO Unit
+
+/--
+  Join the multicast group `group` on the interface with index `iface`,
+  `0` lets the kernel choose. Works for both IPv4 and IPv6 groups.
+-/
+@[extern "lean_socket_join_group"] opaque joinGroup (s : @& Socket) (group : @& SockAddr) (iface : UInt32 := 0) : IO Unit
+
+/--
+  Leave a multicast group joined with [`joinGroup`](##Socket.Socket.joinGroup).
+-/
+@[extern "lean_socket_leave_group"] opaque leaveGroup (s : @& Socket) (group : @& SockAddr) (iface : UInt32 := 0) : IO Unit
+
+/--
+  Join a source-specific multicast group: only datagrams sent by `source` to `group` are received.
+-/
+@[extern "lean_socket_join_source_group"] opaque joinSourceGroup (s : @& Socket) (group source : @& SockAddr) (iface : UInt32 := 0) : IO Unit
+
+/--
+  Leave a source-specific multicast group joined with [`joinSourceGroup`](##Socket.Socket.joinSourceGroup).
+-/
+@[extern "lean_socket_leave_source_group"] opaque leaveSourceGroup (s : @& Socket) (group source : @& SockAddr) (iface : UInt32 := 0) : IO Unit
+
+/--
+  Set the TTL (IPv4) or hop limit (IPv6) of outgoing multicast datagrams.
+  Defaults to 1, which keeps them on the local network.
+-/
+@[extern "lean_socket_set_multicast_ttl"] opaque setMulticastTtl (s : @& Socket) (ttl : UInt8) : IO Unit
+
+/--
+  Whether outgoing multicast datagrams are looped back to local listeners. Enabled by default.
+-/
+@[extern "lean_socket_set_multicast_loop"] opaque setMulticastLoop (s : @& Socket) (loop : Bool) : IO Unit
+
+/--
+  Set the interface for outgoing multicast datagrams by index (see [`interfaceIndex`](##Socket.interfaceIndex)).
+-/
+@[extern "lean_socket_set_multicast_interface"] opaque setMulticastInterface (s : @& Socket) (iface : UInt32) : IO Unit
+
+/--
+  Attach a classic BPF program to the socket (`SO_ATTACH_FILTER`); packets it rejects are
+  dropped by the kernel before they are queued. `prog` holds 8 bytes per instruction
+  (`code : UInt16`, `jt jf : UInt8`, `k : UInt32`, little endian), as produced by
+  [`Bpf.encode`](##Socket.Bpf.encode). Linux only.
+-/
+@[extern "lean_socket_attach_filter"] opaque attachFilter (s : @& Socket) (prog : @& ByteArray) : IO Unit
+
+/--
+  Remove the filter attached with [`attachFilter`](##Socket.Socket.attachFilter). Linux only.
+-/
+@[extern "lean_socket_detach_filter"] opaque detachFilter (s : @& Socket) : IO Unit
+
+/--
+  Allow binding an address still in `TIME_WAIT` (`SO_REUSEADDR`).
+-/
+@[extern "lean_socket_set_reuse_addr"] opaque setReuseAddr (s : @& Socket) (enabled : Bool) : IO Unit
+
+/--
+  Allow several sockets to bind the same address and port (`SO_REUSEPORT`). On Linux the
+  kernel spreads incoming connections over all listening sockets bound this way, so each
+  can be accepted from by its own thread without contending on one accept queue.
+-/
+@[extern "lean_socket_set_reuse_port"] opaque setReusePort (s : @& Socket) (enabled : Bool) : IO Unit
+
+/--
+  Only complete `accept` once the client has sent data, or after `secs` seconds
+  (`TCP_DEFER_ACCEPT`); `0` disables it. Set on a listening socket, connections that
+  open and send nothing then cost no wake-up. On BSD the `dataready` accept filter is used
+  and `secs` only switches it on or off.
+-/
+@[extern "lean_socket_set_defer_accept"] opaque setDeferAccept (s : @& Socket) (secs : UInt32) : IO Unit
+
+/--
+  Get the `TCP_DEFER_ACCEPT` timeout in seconds. Linux only.
+-/
+@[extern "lean_socket_get_defer_accept"] opaque deferAccept (s : @& Socket) : IO UInt32
+
+/--
+  Busy poll the device queue for up to `usecs` microseconds on blocking receives (`SO_BUSY_POLL`).
+  Raising the value above the system default requires `CAP_NET_ADMIN`. Linux only.
+-/
+@[extern "lean_socket_set_busy_poll"] opaque setBusyPoll (s : @& Socket) (usecs : UInt32) : IO Unit
+
+/--
+  Prefer busy polling over interrupt driven processing (`SO_PREFER_BUSY_POLL`). Linux only.
+-/
+@[extern "lean_socket_set_prefer_busy_poll"] opaque setPreferBusyPoll (s : @& Socket) (prefer : Bool) : IO Unit
+
+/--
+  Receive a message, spinning on non-blocking `recv` for up to `spinNanos` nanoseconds
+  before falling back to a regular `recv`. Trades CPU time for wake-up latency;
+  see `examples/busy-poll` for a comparison against plain [`recv`](##Socket.Socket.recv).
+-/
+@[extern "lean_socket_recv_spin"] opaque recvSpin (s : @& Socket) (n : @& USize) (spinNanos : UInt64) : IO (Option ByteArray)
+
 end Socket
 
 structure Poll where
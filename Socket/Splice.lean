@@ -0,0 +1,56 @@
+import Socket.Socket
+
+namespace Socket
+
+/-!
+  # Splice
+
+  Forwarding bytes from one socket to another without copying them through Lean.
+  On Linux the data moves through a kernel pipe with `splice`, and never enters user
+  space. Elsewhere it is copied through a native buffer.
+
+  ```lean
+  let pipe ← SplicePipe.mk
+  repeat
+    if (← pipe.forward client upstream) == 0 then break
+  ```
+-/
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `SplicePipe`.
+-/
+opaque SplicePipe.Nonempty : NonemptyType
+
+/--
+  A pipe to splice one direction of a connection through. Not to be shared between tasks.
+  Closed when garbage collected.
+-/
+def SplicePipe : Type := SplicePipe.Nonempty.type
+
+instance : Nonempty SplicePipe := SplicePipe.Nonempty.property
+
+namespace SplicePipe
+
+/-- Create a pipe. -/
+@[extern "lean_splice_pipe_mk"] opaque mk : IO SplicePipe
+
+/--
+  Receive up to `max` bytes from `src` and send all of them to `dst`. Blocks like `recv`
+  and `send` do. Returns the number of bytes forwarded, `0` at the end of the stream.
+-/
+@[extern "lean_splice_pipe_forward"]
+opaque forward (p : @& SplicePipe) (src dst : @& Socket) (max : USize := 65536) : IO USize
+
+/--
+  Forward from `src` to `dst` until the end of the stream, which is passed on by shutting
+  down the write side of `dst`.
+-/
+partial def forwardAll (p : SplicePipe) (src dst : Socket) (max : USize := 65536) : IO Unit := do
+  if (← p.forward src dst max) == 0 then
+    dst.shutdown ShutdownHow.write
+  else
+    p.forwardAll src dst max
+
+end SplicePipe
+
+end Socket
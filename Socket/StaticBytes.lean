@@ -0,0 +1,52 @@
+namespace Socket
+
+/-!
+  # Static Bytes
+
+  Immortal byte arrays for canned responses, such as `200`, `404` or `503` pages and
+  health check replies, which are built once and then sent from any thread.
+
+  A `StaticBytes` is marked persistent (`lean_mark_persistent`): it is never freed, and
+  taking or dropping references to it from any thread updates no reference count.
+  Top-level constant `ByteArray`s are already persistent once their module is initialized;
+  `StaticBytes` extends that to buffers built at run time, e.g. from configuration:
+
+  ```lean
+  let ok ← StaticBytes.response 200 "OK" "text/plain" "Hello".toUTF8
+  -- in every connection task
+  sock.sendvAll #[ok.bytes]
+  ```
+-/
+
+/-- A persistent byte array. -/
+structure StaticBytes where
+  private ofBytes ::
+  bytes : ByteArray
+
+namespace StaticBytes
+
+@[extern "lean_static_bytes_persist"]
+private opaque persist (s : StaticBytes) : IO StaticBytes
+
+/-- Make a persistent copy of `b`. Persistent objects are never freed, so create them once. -/
+def mk (b : ByteArray) : IO StaticBytes :=
+  persist (ofBytes (b.extract 0 b.size))
+
+/-- Persistent UTF-8 encoding of `s`. -/
+def ofString (s : String) : IO StaticBytes :=
+  persist (ofBytes s.toUTF8)
+
+/-- Number of bytes. -/
+def size (s : StaticBytes) : Nat := s.bytes.size
+
+/--
+  A complete HTTP/1.1 response with a `Content-Length` body. `headers` are extra header
+  lines, each ending in CRLF.
+-/
+def response (status : Nat) (reason : String) (contentType : String) (body : ByteArray) (headers : String := "") : IO StaticBytes :=
+  let head := s!"HTTP/1.1 {status} {reason}\r\nContent-Length: {body.size}\r\nContent-Type: {contentType}\r\n{headers}\r\n"
+  persist (ofBytes (head.toUTF8 ++ body))
+
+end StaticBytes
+
+end Socket
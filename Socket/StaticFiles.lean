@@ -0,0 +1,242 @@
+import Socket.Socket
+import Socket.Transport
+
+namespace Socket
+
+/-!
+  # Static Files
+
+  Serving files from a directory over HTTP/1.1.
+
+  Files up to `maxCached` bytes are mapped into memory and kept in a set-associative LRU
+  cache together with their precomputed response heads (`Content-Length`, `Content-Type`
+  and an `ETag` derived from size and modification time). A cached file is sent with one
+  vectored send of head and mapping. Larger files are opened per request and sent with
+  `sendfile` after their head. Entries are keyed on the raw request target, so a hit does
+  not resolve the target to a path; targets differing only in their query are cached apart.
+
+  Cached entries are revalidated by comparing the file's modification time at most every
+  `revalidateMs` milliseconds. Replace served files by renaming a new file over them:
+  truncating a mapped file in place makes readers of the mapping fault.
+
+  ```lean
+  let files ← StaticFiles.create "public"
+  unless (← files.serve sock path) do
+    sock.sendvAll #[notFound]
+  ```
+-/
+
+/--
+  Use `NonemptyType` to implement `Inhabited` for `StaticFile`.
+-/
+opaque StaticFile.Nonempty : NonemptyType
+
+/--
+  An open regular file, mapped into memory or sent with `sendfile`. Closed when garbage collected.
+-/
+def StaticFile : Type := StaticFile.Nonempty.type
+
+instance : Nonempty StaticFile := StaticFile.Nonempty.property
+
+namespace StaticFile
+
+/--
+  Open a regular file, mapping it into memory when it is not empty and at most `mapLimit` bytes.
+-/
+@[extern "lean_static_file_open"] opaque mk (path : @& String) (mapLimit : UInt64 := 0) : IO StaticFile
+
+/-- Size in bytes when opened. -/
+@[extern "lean_static_file_size"] opaque size (f : @& StaticFile) : UInt64
+
+/-- Modification time in nanoseconds since the epoch when opened. -/
+@[extern "lean_static_file_mtime"] opaque mtime (f : @& StaticFile) : UInt64
+
+/-- Whether the contents are mapped into memory. -/
+@[extern "lean_static_file_mapped"] opaque mapped (f : @& StaticFile) : Bool
+
+/-- Current modification time of the regular file at `path`, `none` if there is none. -/
+@[extern "lean_static_file_stat_mtime"] opaque statMtime (path : @& String) : IO (Option UInt64)
+
+end StaticFile
+
+namespace Socket
+
+/--
+  Send `header` followed by the file, starting `offset` bytes into both together.
+  Returns the number of bytes sent, like `Socket.send`.
+-/
+@[extern "lean_socket_send_static"] opaque sendStatic (s : @& Socket) (header : @& ByteArray) (f : @& StaticFile) (offset : UInt64 := 0) : IO UInt64
+
+/--
+  Send `header` followed by the whole file, continuing after short writes. Meant for blocking sockets.
+-/
+partial def sendStaticAll (s : Socket) (header : ByteArray) (f : StaticFile) (offset : UInt64 := 0) : IO Unit := do
+  if offset < header.size.toUInt64 + f.size then
+    let sent ← s.sendStatic header f offset
+    s.sendStaticAll header f (offset + sent)
+
+end Socket
+
+/-- A cached file with its precomputed responses. -/
+structure StaticFiles.Entry where
+  /-- Request target the entry is cached under, so hits skip `resolve`. -/
+  target : String
+  path : String
+  file : StaticFile
+  etag : String
+  /-- Head of the `200` response, sent before the contents. -/
+  ok : ByteArray
+  /-- Whole `304` response for a matching `If-None-Match`. -/
+  notModified : ByteArray
+  checkedAt : Nat
+
+/--
+  One set of the cache. Each set has its own clock, so hits on different sets do not
+  contend, and last uses are kept apart from the entries so that a hit updates them in place.
+-/
+structure StaticFiles.CacheSet where
+  entries : Array StaticFiles.Entry := #[]
+  lastUse : Array Nat := #[]
+  tick : Nat := 0
+
+/-- A directory served over HTTP, with its cache. -/
+structure StaticFiles where
+  root : System.FilePath
+  maxCached : UInt64
+  revalidateMs : Nat
+  /-- Header lines added to every response, each ending in CRLF. -/
+  extraHeaders : String
+  ways : Nat
+  sets : Array (IO.Ref StaticFiles.CacheSet)
+
+namespace StaticFiles
+
+/-- `Content-Type` for a file name. -/
+def contentType (path : System.FilePath) : String :=
+  match path.extension with
+  | some "html" | some "htm" => "text/html; charset=utf-8"
+  | some "css" => "text/css; charset=utf-8"
+  | some "js" | some "mjs" => "text/javascript; charset=utf-8"
+  | some "json" => "application/json"
+  | some "txt" => "text/plain; charset=utf-8"
+  | some "svg" => "image/svg+xml"
+  | some "png" => "image/png"
+  | some "jpg" | some "jpeg" => "image/jpeg"
+  | some "gif" => "image/gif"
+  | some "webp" => "image/webp"
+  | some "ico" => "image/x-icon"
+  | some "wasm" => "application/wasm"
+  | some "woff2" => "font/woff2"
+  | _ => "application/octet-stream"
+
+/--
+  Create a server for the files below `root`, caching up to `capacity` files of at
+  most `maxCached` bytes each.
+-/
+def create (root : System.FilePath) (capacity : Nat := 1024) (maxCached : UInt64 := 65536)
+    (revalidateMs : Nat := 1000) (extraHeaders : String := "") : IO StaticFiles := do
+  let ways := 4
+  let mut sets : Array (IO.Ref CacheSet) := #[]
+  for _ in [0:max 1 (capacity / ways)] do
+    sets := sets.push (← IO.mkRef {})
+  return { root, maxCached, revalidateMs, extraHeaders, ways, sets }
+
+/--
+  File for a request target, `none` for targets escaping `root`. The query is ignored and
+  a trailing `/` maps to `index.html`. No percent-decoding is done.
+-/
+def resolve (root : System.FilePath) (target : String) : Option System.FilePath :=
+  let path := (target.splitOn "?").head!
+  let segs := (path.splitOn "/").filter (· != "")
+  if segs.any (fun s => s == ".." || s == "." || s.contains '\\') then
+    none
+  else
+    let file := segs.foldl (· / ·) root
+    some (if path.endsWith "/" then file / "index.html" else file)
+
+private def hex (n : UInt64) : String := String.mk (Nat.toDigits 16 n.toNat)
+
+private def entry (sf : StaticFiles) (target path : String) (file : StaticFile) (now : Nat) : Entry :=
+  let etag := s!"\"{hex file.mtime}-{hex file.size}\""
+  {
+    target, path, file, etag
+    ok := s!"HTTP/1.1 200 OK\r\nContent-Length: {file.size}\r\nContent-Type: {contentType path}\r\nETag: {etag}\r\n{sf.extraHeaders}\r\n".toUTF8
+    notModified := s!"HTTP/1.1 304 Not Modified\r\nETag: {etag}\r\n{sf.extraHeaders}\r\n".toUTF8
+    checkedAt := now
+  }
+
+private def setOf (sf : StaticFiles) (target : String) : Option (IO.Ref CacheSet) :=
+  sf.sets.get? ((hash target).toNat % sf.sets.size)
+
+/--
+  The cached entry for `target`, revalidated when due; changed or deleted files are dropped.
+  A hit that is not due only takes its set's lock and bumps that set's clock.
+-/
+private def lookup (sf : StaticFiles) (target : String) (now : Nat) : IO (Option Entry) := do
+  let some set := sf.setOf target | return none
+  let hit ← set.modifyGet fun s =>
+    match s.entries.findIdx? (·.target == target) with
+    | some i => (s.entries.get? i, { s with lastUse := s.lastUse.set! i (s.tick + 1), tick := s.tick + 1 })
+    | none => (none, s)
+  let some e := hit | return none
+  if now - e.checkedAt < sf.revalidateMs then
+    return some e
+  let current := (← StaticFile.statMtime e.path) == some e.file.mtime
+  set.modify fun s =>
+    match s.entries.findIdx? (·.target == target) with
+    | some i =>
+      if current then
+        { s with entries := s.entries.modify i ({ · with checkedAt := now }) }
+      else
+        { s with entries := s.entries.eraseIdx i, lastUse := s.lastUse.eraseIdx i }
+    | none => s
+  return if current then some { e with checkedAt := now } else none
+
+/-- Cache an entry, evicting the least recently used entry of its set when it is full. -/
+private def insert (sf : StaticFiles) (e : Entry) : IO Unit := do
+  let some set := sf.setOf e.target | return
+  set.modify fun s =>
+    let tick := s.tick + 1
+    match s.entries.findIdx? (·.target == e.target) with
+    | some i => { entries := s.entries.set! i e, lastUse := s.lastUse.set! i tick, tick }
+    | none =>
+      if s.entries.size < sf.ways then
+        { entries := s.entries.push e, lastUse := s.lastUse.push tick, tick }
+      else
+        let oldest := (List.range s.lastUse.size).foldl
+          (fun m i => if s.lastUse[i]! < s.lastUse[m]! then i else m) 0
+        { entries := s.entries.set! oldest e, lastUse := s.lastUse.set! oldest tick, tick }
+
+private def open? (path : String) (mapLimit : UInt64) : IO (Option StaticFile) := do
+  try
+    return some (← StaticFile.mk path mapLimit)
+  catch _ =>
+    return none
+
+/-- The entry for `target`, from the cache or opened afresh; mapped files are cached. -/
+private def find? (sf : StaticFiles) (target : String) (now : Nat) : IO (Option Entry) := do
+  if let some e := (← sf.lookup target now) then
+    return some e
+  let some path := resolve sf.root target | return none
+  let path := path.toString
+  let some file ← open? path sf.maxCached | return none
+  let e := sf.entry target path file now
+  if file.mapped then
+    sf.insert e
+  return some e
+
+/--
+  Respond to a `GET` of `target` on `s`, with `304 Not Modified` when `ifNoneMatch` is the
+  file's current `ETag`. Returns `false` without sending anything when there is no such file.
+-/
+def serve (sf : StaticFiles) (s : Socket) (target : String) (ifNoneMatch : Option String := none) : IO Bool := do
+  let some e ← sf.find? target (← IO.monoMsNow) | return false
+  if ifNoneMatch == some e.etag then
+    s.sendvAll #[e.notModified]
+  else
+    s.sendStaticAll e.ok e.file
+  return true
+
+end StaticFiles
+
+end Socket
@@ -0,0 +1,251 @@
+import Socket.Socket
+
+namespace Socket
+
+/-!
+  # Transport
+
+  Byte streams that protocol code can run over without depending on `Socket`. Functions
+  taking `[Transport τ] (t : τ)` work with sockets of any family and with
+  [`MemPipe`](##Socket.MemPipe), an in-memory pipe that never enters the kernel. This makes
+  it possible to benchmark a parser or a pipelined client without kernel noise:
+
+  ```lean
+  let (client, server) ← MemPipe.pair
+  discard <| IO.asTask (serve server) Task.Priority.dedicated
+  let c ← Redis.Client.ofTransport client
+  ```
+
+  [`Transport.Handle`](##Socket.Transport.Handle) holds the operations of any transport
+  value, for structures storing connections of different transports alike.
+-/
+
+/-- A connected, reliable byte stream. -/
+class Transport (τ : Type) where
+  /-- Send bytes, returning how many were accepted. -/
+  send : τ → ByteArray → IO USize
+  /-- Send several buffers with one call, returning how many bytes were accepted. -/
+  sendv : τ → Array ByteArray → IO USize
+  /--
+    Receive up to `n` bytes. An empty array is the end of the stream and `none` means that
+    nothing can be received without blocking.
+  -/
+  recv : τ → USize → IO (Option ByteArray)
+  /--
+    Wait up to `timeoutMs` milliseconds, or forever when it is negative as an `Int32`,
+    until `recv` will not block.
+  -/
+  readable : τ → UInt32 → IO Bool
+  shutdown : τ → ShutdownHow → IO Unit
+  close : τ → IO Unit
+
+instance : Transport Socket where
+  send := Socket.send
+  sendv := Socket.sendv
+  recv := Socket.recv
+  readable s timeoutMs := do
+    let ready ← Socket.poll #[{ sock := s, events := Poll.in, revents := 0, ignore := false }] timeoutMs
+    return ready.val.any (·.revents != 0)
+  shutdown := Socket.shutdown
+  close := Socket.close
+
+namespace Transport
+
+/-- Send all of `b`, continuing after short writes. -/
+partial def sendAll [Transport τ] (t : τ) (b : ByteArray) : IO Unit := do
+  let n := (← send t b).toNat
+  if n < b.size then
+    sendAll t (b.extract n b.size)
+
+/-- Send all of `bufs`, continuing after short writes. -/
+partial def sendvAll [Transport τ] (t : τ) (bufs : Array ByteArray) : IO Unit := do
+  let total := bufs.foldl (· + ·.size) 0
+  if total == 0 then return
+  let sent := (← sendv t bufs).toNat
+  if sent == total then return
+  let mut rest : Array ByteArray := #[]
+  let mut skip := sent
+  for b in bufs do
+    if skip >= b.size then
+      skip := skip - b.size
+    else
+      rest := rest.push (if skip == 0 then b else b.extract skip b.size)
+      skip := 0
+  sendvAll t rest
+
+/-- Receive exactly `n` bytes. The end of the stream before that is an error. -/
+partial def recvExactly [Transport τ] (t : τ) (n : Nat) (acc : ByteArray := ByteArray.empty) : IO ByteArray := do
+  if acc.size >= n then
+    return acc
+  match ← recv t (n - acc.size).toUSize with
+  | some bytes =>
+    if bytes.size == 0 then
+      throw <| IO.userError s!"Transport.recvExactly: end of stream after {acc.size} of {n} bytes"
+    recvExactly t n (if acc.size == 0 then bytes else acc ++ bytes)
+  | none => recvExactly t n acc
+
+/-- The operations of one transport value. -/
+structure Handle where
+  send : ByteArray → IO USize
+  sendv : Array ByteArray → IO USize
+  recv : USize → IO (Option ByteArray)
+  readable : UInt32 → IO Bool
+  shutdown : ShutdownHow → IO Unit
+  close : IO Unit
+
+/-- Capture the operations of `t`. -/
+def handle [Transport τ] (t : τ) : Handle where
+  send := send t
+  sendv := sendv t
+  recv := recv t
+  readable := readable t
+  shutdown := shutdown t
+  close := close t
+
+instance : Transport Handle where
+  send h := h.send
+  sendv h := h.sendv
+  recv h := h.recv
+  readable h := h.readable
+  shutdown h := h.shutdown
+  close h := h.close
+
+end Transport
+
+/-- Send all of `bufs`, continuing after short writes. Meant for blocking sockets. -/
+def Socket.sendvAll (s : Socket) (bufs : Array ByteArray) : IO Unit :=
+  Transport.sendvAll s bufs
+
+/-- Bytes written to one end of a [`MemPipe`](##Socket.MemPipe) and not read yet. -/
+structure MemPipe.Queue where
+  /-- Written buffers, shared with the writer rather than copied. -/
+  chunks : Array ByteArray := #[]
+  /-- Index of the first unread chunk. -/
+  head : Nat := 0
+  /-- Bytes already read of the first unread chunk. -/
+  offset : Nat := 0
+  /-- No more bytes will be written. -/
+  eof : Bool := false
+  /-- Resolved when bytes arrive or the queue ends, to wake up a blocked reader. -/
+  waiter : Option (IO.Promise Unit) := none
+
+namespace MemPipe.Queue
+
+def ready (q : Queue) : Bool :=
+  q.head < q.chunks.size || q.eof
+
+/--
+  Take up to `n` bytes, `none` when the queue is empty but not ended. Whole chunks are
+  returned without copying when they fit, and following chunks are appended while they fit.
+-/
+def take (q : Queue) (n : Nat) : Option ByteArray × Queue := Id.run do
+  let some first := q.chunks.get? q.head
+    | return (if q.eof then some ByteArray.empty else none, q)
+  if q.offset + n < first.size then
+    return (some (first.extract q.offset (q.offset + n)), { q with offset := q.offset + n })
+  let mut out := if q.offset == 0 then first else first.extract q.offset first.size
+  let mut i := q.head + 1
+  while i < q.chunks.size do
+    let c := q.chunks[i]!
+    if out.size + c.size > n then
+      break
+    out := out ++ c
+    i := i + 1
+  -- drop read chunks once they make up most of the array
+  let q :=
+    if i == q.chunks.size then { q with chunks := #[], head := 0 }
+    else if i * 2 > q.chunks.size then { q with chunks := q.chunks.extract i q.chunks.size, head := 0 }
+    else { q with head := i }
+  return (some out, { q with offset := 0 })
+
+/-- End the queue, dropping unread bytes when `discard` is set, and wake up its reader. -/
+def finish (q : Queue) (discard : Bool) : Option (IO.Promise Unit) × Queue :=
+  (q.waiter, { q with eof := true, waiter := none, chunks := if discard then #[] else q.chunks, head := if discard then 0 else q.head })
+
+end MemPipe.Queue
+
+/--
+  One end of an in-memory byte stream between two tasks of a process. Sends append the
+  buffers to the other end's queue without copying or system calls, and are never short:
+  the queue is unbounded. `recv` blocks until bytes arrive or the stream ends.
+-/
+structure MemPipe where
+  incoming : IO.Ref MemPipe.Queue
+  outgoing : IO.Ref MemPipe.Queue
+
+namespace MemPipe
+
+/-- Create both ends of a pipe. -/
+def pair : IO (MemPipe × MemPipe) := do
+  let a ← IO.mkRef ({} : Queue)
+  let b ← IO.mkRef ({} : Queue)
+  return ({ incoming := a, outgoing := b }, { incoming := b, outgoing := a })
+
+private def wake (w : Option (IO.Promise Unit)) : IO Unit := do
+  if let some w := w then
+    w.resolve ()
+
+/-- Append buffers to the other end, failing when it was shut down for reading or closed. -/
+def sendv (p : MemPipe) (bufs : Array ByteArray) : IO USize := do
+  let bufs := bufs.filter (·.size != 0)
+  if bufs.isEmpty then
+    return 0
+  let accepted ← p.outgoing.modifyGet fun q =>
+    if q.eof then (none, q) else (some q.waiter, { q with chunks := q.chunks ++ bufs, waiter := none })
+  let some w := accepted | throw <| IO.userError "MemPipe.send: broken pipe"
+  wake w
+  return (bufs.foldl (· + ·.size) 0).toUSize
+
+def send (p : MemPipe) (b : ByteArray) : IO USize :=
+  p.sendv #[b]
+
+/-- Register `w` to be resolved when the incoming queue becomes ready, unless it already is. -/
+private def waitReady (p : MemPipe) (w : IO.Promise Unit) : IO Bool :=
+  p.incoming.modifyGet fun q => if q.ready then (true, q) else (false, { q with waiter := some w })
+
+/-- Receive up to `n` bytes, waiting for them while the stream has not ended. -/
+partial def recv (p : MemPipe) (n : USize) : IO (Option ByteArray) := do
+  if let some b := (← p.incoming.modifyGet (·.take n.toNat)) then
+    return some b
+  let w ← IO.Promise.new
+  unless (← p.waitReady w) do
+    IO.wait w.result
+  p.recv n
+
+/-- Wait until `recv` will not block. Finite timeouts are polled every millisecond. -/
+partial def readable (p : MemPipe) (timeoutMs : UInt32) : IO Bool := do
+  if (← p.incoming.get).ready then
+    return true
+  if timeoutMs == 0 then
+    return false
+  if timeoutMs.toNat >= 0x80000000 then
+    let w ← IO.Promise.new
+    unless (← p.waitReady w) do
+      IO.wait w.result
+    return true
+  IO.sleep 1
+  p.readable (timeoutMs - 1)
+
+/-- Shutting down reading makes the other end's sends fail, shutting down writing ends its stream. -/
+def shutdown (p : MemPipe) (how : ShutdownHow) : IO Unit := do
+  match how with
+  | .read => wake (← p.incoming.modifyGet (·.finish true))
+  | .write => wake (← p.outgoing.modifyGet (·.finish false))
+  | .readwrite =>
+    wake (← p.incoming.modifyGet (·.finish true))
+    wake (← p.outgoing.modifyGet (·.finish false))
+
+def close (p : MemPipe) : IO Unit :=
+  p.shutdown .readwrite
+
+instance : Transport MemPipe where
+  send := MemPipe.send
+  sendv := MemPipe.sendv
+  recv := MemPipe.recv
+  readable := MemPipe.readable
+  shutdown := MemPipe.shutdown
+  close := MemPipe.close
+
+end MemPipe
+
+end Socket
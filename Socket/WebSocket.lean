@@ -0,0 +1,227 @@
+import Socket.ByteSlice
+
+namespace Socket
+
+/-!
+  # WebSocket
+
+  WebSocket framing (RFC 6455) over the `ByteArray`s returned by `Socket.recv`.
+  The opening handshake is plain HTTP and is left to the caller.
+
+  A [`Decoder`](##Socket.WebSocket.Decoder) unmasks every complete frame of a
+  receive buffer in place with one native call per frame, then hands out the
+  payloads as slices of that buffer. Only fragmented messages are copied, to
+  join their fragments.
+-/
+
+namespace WebSocket
+
+/-- Frame opcodes. -/
+inductive Opcode where
+  | continuation
+  | text
+  | binary
+  | close
+  | ping
+  | pong
+  deriving Inhabited, BEq
+
+/-- Wire value of an opcode. -/
+def Opcode.toUInt8 : Opcode → UInt8
+  | .continuation => 0x0
+  | .text => 0x1
+  | .binary => 0x2
+  | .close => 0x8
+  | .ping => 0x9
+  | .pong => 0xA
+
+/--
+  XOR the bytes of `buf` in `[start, stop)` with the 4-byte masking key, whose first
+  byte on the wire is the most significant byte of `key`. Masking is its own inverse.
+  Works in place when `buf` is not shared, 16 bytes at a time with SSE2.
+-/
+@[extern "lean_websocket_mask"]
+opaque mask (buf : ByteArray) (start stop : USize) (key : UInt32) : ByteArray
+
+/-- Frame header as read off the wire. -/
+structure Header where
+  fin : Bool
+  /-- The RSV1-3 bits, which must be zero without negotiated extensions. -/
+  rsv : UInt8
+  opcode : UInt8
+  maskKey : Option UInt32
+  payloadStart : Nat
+  payloadStop : Nat
+
+private def readBE (buf : ByteArray) (pos n : Nat) : Nat :=
+  (List.range n).foldl (fun acc i => acc * 256 + (buf.get! (pos + i)).toNat) 0
+
+/--
+  Parse the frame header starting at `pos`, `none` if the header is incomplete.
+  The payload itself may still be incomplete.
+-/
+def parseHeader (buf : ByteArray) (pos : Nat) : Option Header := do
+  if buf.size < pos + 2 then none
+  let b0 := buf.get! pos
+  let b1 := buf.get! (pos + 1)
+  let (len, off) ← match (b1 &&& 0x7F).toNat with
+    | 126 => if buf.size < pos + 4 then none else some (readBE buf (pos + 2) 2, pos + 4)
+    | 127 => if buf.size < pos + 10 then none else some (readBE buf (pos + 2) 8, pos + 10)
+    | n => some (n, pos + 2)
+  let (maskKey, start) ←
+    if b1 &&& 0x80 == 0 then
+      some (none, off)
+    else if buf.size < off + 4 then
+      none
+    else
+      some (some (readBE buf off 4).toUInt32, off + 4)
+  return {
+    fin := b0 &&& 0x80 != 0
+    rsv := (b0 >>> 4) &&& 0x7
+    opcode := b0 &&& 0x0F
+    maskKey
+    payloadStart := start
+    payloadStop := start + len
+  }
+
+/-- A complete message. Data messages are reassembled from their fragments. -/
+inductive Message where
+  | text (data : ByteSlice)
+  | binary (data : ByteSlice)
+  | ping (data : ByteSlice)
+  | pong (data : ByteSlice)
+  | close (code : Option UInt16) (reason : ByteSlice)
+  deriving Inhabited
+
+/--
+  Incremental frame decoder for one connection.
+  Servers keep `requireMask`, since clients must mask every frame.
+-/
+structure Decoder where
+  /-- Upper bound on the size of a message, across all of its fragments. -/
+  maxMessage : Nat := 0x1000000
+  requireMask : Bool := true
+  pending : ByteArray := ByteArray.empty
+  /-- Opcode and payload so far of a fragmented message. -/
+  fragment : Option (UInt8 × ByteArray) := none
+  deriving Inhabited
+
+private def dataMessage (opcode : UInt8) (data : ByteSlice) : Message :=
+  if opcode == 0x1 then .text data else .binary data
+
+private def closeMessage (payload : ByteSlice) : Except String Message :=
+  if payload.size == 0 then
+    return .close none payload
+  else if payload.size == 1 then
+    throw "WebSocket: invalid close payload"
+  else
+    let code := (payload.get! 0).toUInt16 <<< 8 ||| (payload.get! 1).toUInt16
+    return .close (some code) (payload.slice 2 (payload.size - 2))
+
+/--
+  Append received bytes and return the messages completed by them.
+  Protocol violations and messages over `maxMessage` are errors, after which the
+  connection should be failed.
+-/
+def Decoder.feed (d : Decoder) (chunk : ByteArray) : Except String (Array Message × Decoder) := do
+  let mut buf := if d.pending.size == 0 then chunk else d.pending ++ chunk
+  -- unmask every complete frame before slicing, so `buf` is still unshared and unmasked in place
+  let mut frames : Array Header := #[]
+  let mut pos := 0
+  repeat
+    match parseHeader buf pos with
+    | none => break
+    | some h =>
+      let len := h.payloadStop - h.payloadStart
+      if h.rsv != 0 then
+        throw "WebSocket: reserved bits set"
+      if h.opcode >= 0x8 && (!h.fin || len > 125) then
+        throw "WebSocket: invalid control frame"
+      if len > d.maxMessage then
+        throw "WebSocket: message too large"
+      if h.payloadStop > buf.size then
+        break
+      match h.maskKey with
+      | some key => buf := mask buf h.payloadStart.toUSize h.payloadStop.toUSize key
+      | none =>
+        if d.requireMask then
+          throw "WebSocket: unmasked frame"
+      frames := frames.push h
+      pos := h.payloadStop
+  let mut messages : Array Message := #[]
+  let mut fragment := d.fragment
+  for h in frames do
+    let payload : ByteSlice := ⟨buf, h.payloadStart, h.payloadStop⟩
+    match h.opcode.toNat with
+    | 0x0 =>
+      match fragment with
+      | none => throw "WebSocket: unexpected continuation frame"
+      | some (opcode, data) =>
+        if data.size + payload.size > d.maxMessage then
+          throw "WebSocket: message too large"
+        let data := buf.copySlice h.payloadStart data data.size payload.size
+        if h.fin then
+          messages := messages.push (dataMessage opcode (.ofByteArray data))
+          fragment := none
+        else
+          fragment := some (opcode, data)
+    | 0x1 | 0x2 =>
+      if fragment.isSome then
+        throw "WebSocket: expected continuation frame"
+      if h.fin then
+        messages := messages.push (dataMessage h.opcode payload)
+      else
+        fragment := some (h.opcode, payload.toByteArray)
+    | 0x8 => messages := messages.push (← closeMessage payload)
+    | 0x9 => messages := messages.push (.ping payload)
+    | 0xA => messages := messages.push (.pong payload)
+    | _ => throw "WebSocket: unknown opcode"
+  let pending := if pos == 0 then buf else buf.extract pos buf.size
+  return (messages, { d with pending := pending, fragment := fragment })
+
+/--
+  Header of a frame carrying `len` payload bytes.
+-/
+def encodeHeader (opcode : Opcode) (len : Nat) (fin := true) (maskKey : Option UInt32 := none) : ByteArray := Id.run do
+  let maskBit : UInt8 := if maskKey.isSome then 0x80 else 0
+  let mut out := ByteArray.mkEmpty 14
+  out := out.push ((if fin then 0x80 else 0) ||| opcode.toUInt8)
+  if len < 126 then
+    out := out.push (maskBit ||| len.toUInt8)
+  else if len < 0x10000 then
+    out := out.push (maskBit ||| 126)
+    for i in [0:2] do
+      out := out.push (len >>> (8 * (1 - i))).toUInt8
+  else
+    out := out.push (maskBit ||| 127)
+    for i in [0:8] do
+      out := out.push (len >>> (8 * (7 - i))).toUInt8
+  if let some key := maskKey then
+    for i in [0:4] do
+      out := out.push (key >>> (8 * (3 - i)).toUInt32).toUInt8
+  return out
+
+/--
+  Encode a frame. Clients must pass a fresh random `maskKey` for every frame.
+-/
+def encode (opcode : Opcode) (payload : ByteArray) (fin := true) (maskKey : Option UInt32 := none) : ByteArray :=
+  let out := encodeHeader opcode payload.size fin maskKey ++ payload
+  match maskKey with
+  | some key => mask out (out.size - payload.size).toUSize out.size.toUSize key
+  | none => out
+
+/-- Encode a message as a single frame. -/
+def Message.encode (m : Message) (maskKey : Option UInt32 := none) : ByteArray :=
+  match m with
+  | .text data => WebSocket.encode .text data.toByteArray true maskKey
+  | .binary data => WebSocket.encode .binary data.toByteArray true maskKey
+  | .ping data => WebSocket.encode .ping data.toByteArray true maskKey
+  | .pong data => WebSocket.encode .pong data.toByteArray true maskKey
+  | .close none _ => WebSocket.encode .close ByteArray.empty true maskKey
+  | .close (some code) reason =>
+    let payload := (ByteArray.mkEmpty (2 + reason.size)).push (code >>> 8).toUInt8 |>.push code.toUInt8
+    WebSocket.encode .close (payload ++ reason.toByteArray) true maskKey
+
+end WebSocket
+
+end Socket
@@ -0,0 +1,66 @@
+import Socket
+
+open Socket
+
+/-- Round trips measured per receive mode. -/
+def iterations : Nat := 20000
+
+/--
+  Echo datagrams back to their sender until an empty datagram arrives.
+-/
+partial def echo (s : Socket) : IO Unit := do
+  match ← s.recvfrom 64 with
+  | some (addr, bytes) =>
+    if bytes.size == 0 then return
+    discard <| s.sendto bytes addr
+    echo s
+  | none => echo s
+
+/--
+  Measure ping-pong round trip times in nanoseconds, sorted ascending.
+-/
+def measure (client : Socket) (recv : Socket → IO (Option ByteArray)) : IO (Array Nat) := do
+  let payload := "ping".toUTF8
+  let mut samples := Array.mkEmpty iterations
+  for _ in [0:iterations] do
+    let t0 ← IO.monoNanosNow
+    discard <| client.send payload
+    discard <| recv client
+    let t1 ← IO.monoNanosNow
+    samples := samples.push (t1 - t0)
+  return samples.qsort (· < ·)
+
+def percentile (xs : Array Nat) (p : Float) : Nat :=
+  if xs.isEmpty then 0 else xs[(p * (xs.size - 1).toFloat).toUInt64.toNat]!
+
+def report (name : String) (xs : Array Nat) : IO Unit :=
+  IO.println s!"{name}: p50 {percentile xs 0.5}ns, p90 {percentile xs 0.9}ns, p99 {percentile xs 0.99}ns, p99.9 {percentile xs 0.999}ns, max {percentile xs 1.0}ns"
+
+/--
+  Entry. The optional argument is the spin duration in nanoseconds.
+-/
+def main (args : List String) : IO Unit := do
+  let spinNanos := (args.head? >>= String.toNat?).getD 50000 |>.toUInt64
+
+  let addr ← SockAddr.mk "127.0.0.1" "9001" AddressFamily.inet SockType.dgram
+  let server ← Socket.mk AddressFamily.inet SockType.dgram
+  server.bind addr
+  let serverTask ← IO.asTask (echo server) Task.Priority.dedicated
+
+  let client ← Socket.mk AddressFamily.inet SockType.dgram
+  client.connect addr
+  try
+    client.setBusyPoll 50
+  catch e =>
+    IO.println s!"SO_BUSY_POLL unavailable ({e}), measuring the userspace spin only."
+
+  -- warm up both ends before measuring
+  discard <| measure client (·.recv 64)
+
+  report "recv" (← measure client (·.recv 64))
+  report s!"recvSpin {spinNanos}ns" (← measure client (·.recvSpin 64 spinNanos))
+
+  discard <| client.send ByteArray.empty
+  discard <| IO.wait serverTask
+  client.close
+  server.close
@@ -0,0 +1,84 @@
+import Socket
+
+open Socket
+
+/-- Connections which never send anything. -/
+def idleClients : Nat := 150
+
+/-- Connections which send a request right away. -/
+def activeClients : Nat := 50
+
+structure Stats where
+  wakeups : Nat := 0
+  accepts : Nat := 0
+  emptyAccepts : Nat := 0
+
+/--
+  Check whether an accepted connection has request bytes waiting.
+-/
+def hasData (s : Socket) : IO Bool := do
+  let ps ← Socket.poll #[{ sock := s, events := Poll.in, revents := 0, ignore := false }] 0
+  return ps.val.any (·.revents &&& Poll.in != 0)
+
+/--
+  Accept for `windowMs` milliseconds, counting wake-ups and accepted connections.
+  Every wake-up accepts until the non-blocking listener has no connection left.
+-/
+def serve (listener : Socket) (windowMs : Nat) : IO Stats := do
+  let deadline := (← IO.monoMsNow) + windowMs
+  let mut stats : Stats := {}
+  let mut accepted := #[]
+  while (← IO.monoMsNow) < deadline do
+    let ps ← Socket.poll #[{ sock := listener, events := Poll.in, revents := 0, ignore := false }] 50
+    if ps.val.any (·.revents &&& Poll.in != 0) then
+      stats := { stats with wakeups := stats.wakeups + 1 }
+      let mut draining := true
+      while draining do
+        match ← listener.tryAccept with
+        | some (_, conn) =>
+          stats := { stats with accepts := stats.accepts + 1 }
+          unless (← hasData conn) do
+            stats := { stats with emptyAccepts := stats.emptyAccepts + 1 }
+          accepted := accepted.push conn
+        | none => draining := false
+  Socket.closeMany accepted
+  return stats
+
+/-- Connect all clients a few milliseconds apart, idle and active ones interleaved. -/
+def connectClients (addr : SockAddr) : IO (Array Socket) := do
+  let mut clients := #[]
+  for i in [0:idleClients + activeClients] do
+    let c ← Socket.mk AddressFamily.inet SockType.stream
+    c.connect addr
+    if i % ((idleClients + activeClients) / activeClients) == 0 then
+      discard <| c.send "GET / HTTP/1.1\r\n\r\n".toUTF8
+    clients := clients.push c
+    IO.sleep 2
+  return clients
+
+def run (port : String) (deferSecs : UInt32) : IO Stats := do
+  let addr ← SockAddr.mk "127.0.0.1" port AddressFamily.inet SockType.stream
+  let listener ← Socket.mk AddressFamily.inet SockType.stream
+  listener.bind addr
+  if deferSecs != 0 then
+    listener.setDeferAccept deferSecs
+  listener.listen 255
+  listener.setBlocking false
+
+  let connecting ← IO.asTask (connectClients addr) Task.Priority.dedicated
+  let stats ← serve listener 1000
+  Socket.closeMany (← IO.ofExcept (← IO.wait connecting))
+  listener.close
+  return stats
+
+def report (name : String) (s : Stats) : IO Unit :=
+  let useful := s.accepts - s.emptyAccepts
+  IO.println s!"{name}: {s.wakeups} wake-ups, {s.accepts} accepts, {s.emptyAccepts} without data, {s.wakeups * 100 / max useful 1} wake-ups per 100 requests"
+
+/--
+  Entry
+-/
+def main : IO Unit := do
+  IO.println s!"{idleClients} idle and {activeClients} active connections, 1s accept window"
+  report "plain accept" (← run "9101" 0)
+  report "TCP_DEFER_ACCEPT" (← run "9102" 5)
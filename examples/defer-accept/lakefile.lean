@@ -0,0 +1,9 @@
+import Lake
+open System Platform Lake DSL
+
+package defer_accept
+
+require Socket from ".."/".."
+
+@[default_target]
+lean_exe Main
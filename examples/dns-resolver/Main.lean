@@ -0,0 +1,115 @@
+import Socket
+
+open Socket
+
+/-!
+  Resolves names against a stub DNS server running in the same process, so the whole
+  example stays on loopback.
+-/
+
+def serverPort : UInt16 := 5354
+
+def names : Nat := 1000
+
+/-- Queries in flight at once, kept below what the server's receive buffer holds. -/
+def window : Nat := 100
+
+-- Stub server
+
+def push16 (b : ByteArray) (v : Nat) : ByteArray := (b.push (v >>> 8).toUInt8).push v.toUInt8
+
+def push32 (b : ByteArray) (v : Nat) : ByteArray := push16 (push16 b (v >>> 16)) (v &&& 0xFFFF)
+
+/-- A response with one question and uncompressed records of the question's name. -/
+def reply (id : UInt16) (qname : ByteArray) (qtype rcode : Nat) (answers authority : Array (Nat × Nat × ByteArray)) : ByteArray := Id.run do
+  let mut out := push16 (push16 .empty id.toNat) (0x8180 ||| rcode)
+  out := push16 (push16 (push16 (push16 out 1) answers.size) authority.size) 0
+  out := push16 (push16 (out ++ qname) qtype) 1
+  for (type, ttl, data) in answers ++ authority do
+    out := push16 (push32 (push16 (push16 (out ++ qname) type) 1) ttl) data.size ++ data
+  return out
+
+/-- `SOA` data with empty names and a `minimum` of 30 seconds. -/
+def soa : ByteArray := (List.range 5).foldl (fun b i => push32 b (if i == 4 then 30 else 1)) (ByteArray.mk #[0, 0])
+
+/--
+  The zone: `host<i>.test` has an IPv4 address, `v6.test` both kinds, `lossy.test` answers
+  only retransmitted queries, and anything else does not exist.
+-/
+def lookup (name : String) (qtype : Nat) (retransmit : Bool) : Option (Array (Nat × Nat × ByteArray)) :=
+  if name.startsWith "host" && name.endsWith ".test" then
+    let i := ((name.drop 4).dropRight 5).toNat?.getD 0
+    some (if qtype == 1 then #[(1, 60, ByteArray.mk #[10, 0, (i / 256).toUInt8, (i % 256).toUInt8])] else #[])
+  else if name == "v6.test" then
+    some (if qtype == 28 then #[(28, 60, (SockAddr.parseIP "fd00::1").get!)] else #[(1, 60, ByteArray.mk #[10, 1, 0, 1])])
+  else if name == "lossy.test" && retransmit then
+    some (if qtype == 1 then #[(1, 60, ByteArray.mk #[10, 2, 0, 1])] else #[])
+  else if name == "lossy.test" then
+    some #[]
+  else
+    none
+
+partial def serve (s : Socket) (seen : Array UInt16) : IO Unit := do
+  let some (peer, query) ← s.recvfrom 512 | serve s seen
+  let .ok m := Dns.parse query | serve s seen
+  let some (name, qtype) := m.questions.get? 0 | serve s seen
+  let .ok qname := Dns.encodeName name | serve s seen
+  -- drop the first transmission of every `lossy.test` query
+  if name == "lossy.test" && !seen.contains m.id then
+    serve s (seen.push m.id)
+  else
+    let response :=
+      match lookup name qtype.toNat (seen.contains m.id) with
+      | some answers => reply m.id qname qtype.toNat 0 answers #[]
+      | none => reply m.id qname qtype.toNat 3 #[] #[(Dns.typeSOA.toNat, 300, soa)]
+    discard <| s.sendto response peer
+    serve s seen
+
+-- Client
+
+def show (addrs : Array SockAddr) : String :=
+  ", ".intercalate (addrs.toList.map fun a => a.host.getD "?")
+
+def timed (label : String) (r : Dns.Resolver) (name : String) : IO Unit := do
+  let t0 ← IO.monoMsNow
+  match ← IO.wait (← r.resolveAsync name) with
+  | .ok addrs => IO.println s!"{label}: {name} -> [{show addrs}] in {(← IO.monoMsNow) - t0} ms"
+  | .error e => IO.println s!"{label}: {name} -> {e} in {(← IO.monoMsNow) - t0} ms"
+
+/-- Resolve `host0.test` to `host<names - 1>.test`, `window` at a time. Returns the number resolved. -/
+def resolveAll (r : Dns.Resolver) : IO Nat := do
+  let mut resolved := 0
+  for start in [0:names:window] do
+    let mut tasks : Array (Task (Except String (Array SockAddr))) := #[]
+    for i in [start:start + window] do
+      tasks := tasks.push (← r.resolveAsync s!"host{i}.test" (family := AddressFamily.inet))
+    for t in tasks do
+      if let .ok addrs := (← IO.wait t) then
+        resolved := resolved + addrs.size
+  return resolved
+
+/--
+  Entry
+-/
+def main : IO Unit := do
+  let server ← Socket.mk AddressFamily.inet SockType.dgram
+  let some addr := (SockAddr.parseIP "127.0.0.1").bind (SockAddr.ofBytes · serverPort) | return
+  server.bind addr
+  discard <| IO.asTask (serve server #[]) Task.Priority.dedicated
+
+  let config : Dns.Config := { nameservers := #[addr], timeoutMs := 200, attempts := 2 }
+  let r ← Dns.Resolver.create config (hosts := Dns.parseHosts "10.9.9.9 pinned.test\n")
+
+  for pass in ["cold", "cached"] do
+    let t0 ← IO.monoNanosNow
+    let resolved ← resolveAll r
+    let elapsed := (← IO.monoNanosNow) - t0
+    IO.println s!"{pass}: {resolved} of {names} names in {elapsed / 1000000} ms, {names * 1000000000 / elapsed} names/s"
+
+  timed "both families" r "v6.test"
+  timed "retransmitted" r "lossy.test"
+  timed "missing" r "missing.test"
+  timed "negative cache" r "missing.test"
+  timed "hosts file" r "pinned.test"
+  r.close
+  IO.Process.exit 0
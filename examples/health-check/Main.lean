@@ -0,0 +1,71 @@
+import Socket
+
+open Socket
+
+/-- Ports with a listener behind them. -/
+def upPorts : Array Nat := (List.range 250).toArray.map (30000 + ·)
+
+/-- Ports nobody listens on, refusing every probe. -/
+def downPorts : Array Nat := (List.range 750).toArray.map (31000 + ·)
+
+/-- Listeners closed halfway through, to show state changes. -/
+def stopped : Nat := 10
+
+def rounds : Nat := 10
+
+def intervalMs : Nat := 1000
+
+/-- Accept and drop the probe connections of all listeners, from one task. -/
+partial def acceptAll (listeners : Array Socket) : IO Unit := do
+  let ready ← Socket.poll (listeners.map fun l => { sock := l, events := Poll.in, revents := 0, ignore := false }) 1000
+  for p in ready.val do
+    if p.revents &&& Poll.in != 0 then
+      try (← p.sock.accept).2.close catch _ => pure ()
+  acceptAll listeners
+
+/-- User plus system CPU time of this process in milliseconds, from `/proc/self/stat`. -/
+def cpuMs : IO Nat := do
+  let stat ← IO.FS.readFile "/proc/self/stat"
+  let fields := ((stat.splitOn ") ").getD 1 "").splitOn " "
+  let ticks := (fields.getD 11 "0").toNat! + (fields.getD 12 "0").toNat!
+  return ticks * 10
+
+/--
+  Entry
+-/
+def main : IO Unit := do
+  let mut listeners : Array Socket := #[]
+  for port in upPorts do
+    let l ← Socket.mk AddressFamily.inet SockType.stream
+    l.setReuseAddr true
+    l.bind (← SockAddr.mk "127.0.0.1" (toString port) AddressFamily.inet SockType.stream)
+    l.listen 128
+    listeners := listeners.push l
+  discard <| IO.asTask (acceptAll listeners) Task.Priority.dedicated
+
+  let mut targets : Array HealthCheck.Target := #[]
+  for port in upPorts ++ downPorts do
+    let addr ← SockAddr.mk "127.0.0.1" (toString port) AddressFamily.inet SockType.stream
+    targets := targets.push { addr, timeoutMs := 500 }
+  let changes ← IO.mkRef 0
+  let checker ← HealthChecker.create targets (intervalMs := intervalMs)
+    (onChange := fun _ _ _ => changes.modify (· + 1))
+
+  IO.println s!"{targets.size} targets, {upPorts.size} listening, one round every {intervalMs} ms"
+  let cpu0 ← cpuMs
+  let t0 ← IO.monoMsNow
+  let runner ← IO.asTask checker.run Task.Priority.dedicated
+  IO.sleep (rounds / 2 * intervalMs).toUInt32
+  for l in listeners[0:stopped] do
+    l.close
+  IO.sleep (rounds / 2 * intervalMs).toUInt32
+  checker.stop
+  discard <| IO.wait runner
+  let cpu := (← cpuMs) - cpu0
+  let wall := (← IO.monoMsNow) - t0
+
+  let status ← checker.status
+  let up := status.foldl (fun n s => if s.up then n + 1 else n) 0
+  IO.println s!"{up} up, {status.size - up} down, {← changes.get} state changes"
+  IO.println s!"CPU {cpu} ms over {wall} ms, {cpu * 1000 / wall / 10}.{cpu * 1000 / wall % 10}%"
+  IO.Process.exit 0
@@ -1,26 +1,141 @@
 import Socket
 
-open Socket
-
-def main : IO Unit := do
-  -- configure remote SockAddr
-  let remoteAddr ← SockAddr.mk "www.example.com" "80" AddressFamily.inet SockType.stream
-  IO.println s!"Remote Addr: {remoteAddr}"
-
-  -- connect to remote
-  let socket ← Socket.mk AddressFamily.inet SockType.stream
-  socket.connect remoteAddr
-  IO.println "Connected!"
-
-  -- send HTTP request
-  let strSend := 
-    "GET / HTTP/1.1\r\n" ++
-    "Host: www.example.com\r\n" ++
-    "\r\n\r\n"
-  let bytesSend ← socket.send strSend.toUTF8
-  IO.println s!"Send {bytesSend} bytes!\n"
-
-  -- get HTTP response and print it out
-  let bytesRecv ← socket.recv 5000
-  IO.println "-- Responses --\n"
-  IO.println <| String.fromUTF8Unchecked bytesRecv
\ No newline at end of file
+open Socket Http
+
+/-- Requests measured per mode. -/
+def iterations : Nat := 10000
+
+/-- Requests sent together when pipelining. -/
+def depth : Nat := 16
+
+/-- Chunks of the streamed `/big` response. -/
+def bigChunks : Nat := 1024
+
+def okResponse : ByteArray :=
+  "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nContent-Type: text/plain\r\n\r\nHello".toUTF8
+
+def bigHead : ByteArray :=
+  "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n".toUTF8
+
+def bigChunk : ByteArray := ByteArray.mk (Array.mkArray 65536 120)
+
+/--
+  Paths of the complete request heads in `buf`, and the bytes after the last one.
+  The benchmark sends no request bodies.
+-/
+def splitRequests (buf : ByteArray) : Array String × ByteArray := Id.run do
+  let mut paths := #[]
+  let mut start := 0
+  for i in [3:buf.size] do
+    if buf.get! i == 10 && buf.get! (i - 1) == 13 && buf.get! (i - 2) == 10 && buf.get! (i - 3) == 13 then
+      let line := (String.fromUTF8Unchecked (buf.extract start i)).splitOn "\r\n" |>.head!
+      paths := paths.push ((line.splitOn " ").getD 1 "/")
+      start := i + 1
+  return (paths, buf.extract start buf.size)
+
+/--
+  Local keep-alive server: `/big` streams a chunked body, anything else gets a
+  5-byte response. Responses to pipelined requests go out in one send.
+-/
+partial def serve (s : Socket) (buf : ByteArray) : IO Unit := do
+  match ← s.recv 65536 with
+  | some chunk =>
+    if chunk.size == 0 then
+      s.close
+      return
+    let (paths, rest) := splitRequests (buf ++ chunk)
+    let mut batch : Array ByteArray := #[]
+    for path in paths do
+      if path == "/big" then
+        s.sendvAll batch
+        batch := #[]
+        s.sendvAll #[bigHead]
+        for _ in [0:bigChunks] do
+          Chunked.sendChunk s bigChunk
+        Chunked.sendLast s
+      else
+        batch := batch.push okResponse
+    s.sendvAll batch
+    serve s rest
+  | none => s.close
+
+partial def acceptLoop (listener : Socket) : IO Unit := do
+  let (_, conn) ← listener.accept
+  discard <| IO.asTask (serve conn ByteArray.empty) Task.Priority.dedicated
+  acceptLoop listener
+
+def percentile (xs : Array Nat) (p : Float) : Nat :=
+  if xs.isEmpty then 0 else xs[(p * (xs.size - 1).toFloat).toUInt64.toNat]!
+
+/--
+  Print throughput and the latency distribution of `samples`, which are nanoseconds
+  per request measured over `elapsed` nanoseconds.
+-/
+def report (name : String) (samples : Array Nat) (elapsed : Nat) : IO Unit := do
+  let xs := samples.qsort (· < ·)
+  let rps := iterations * 1000000000 / max elapsed 1
+  IO.println s!"{name}: {rps} req/s, p50 {percentile xs 0.5 / 1000}us, p99 {percentile xs 0.99 / 1000}us, max {percentile xs 1.0 / 1000}us"
+
+/-- Measure `iterations` requests issued `batch` at a time by `f`. -/
+def measure (name : String) (batch : Nat) (f : IO Unit) : IO Unit := do
+  let mut samples := Array.mkEmpty (iterations / batch)
+  let start ← IO.monoNanosNow
+  for _ in [0:iterations / batch] do
+    let t0 ← IO.monoNanosNow
+    f
+    let t1 ← IO.monoNanosNow
+    samples := samples.push (t1 - t0)
+  report name samples ((← IO.monoNanosNow) - start)
+
+def bench : IO Unit := do
+  let addr ← SockAddr.mk "127.0.0.1" "8081" AddressFamily.inet SockType.stream
+  let listener ← Socket.mk AddressFamily.inet SockType.stream
+  listener.bind addr
+  listener.listen 128
+  discard <| IO.asTask (acceptLoop listener) Task.Priority.dedicated
+
+  let host := "127.0.0.1:8081"
+  measure "new connection per request" 1 do
+    let c ← Connection.connect addr host
+    discard <| c.fetch {}
+    c.close
+
+  let pool ← Pool.create addr host
+  measure "keep-alive pool" 1 do
+    discard <| pool.fetch {}
+
+  let c ← Connection.connect addr host
+  measure s!"pipelined, depth {depth}" depth do
+    discard <| c.pipeline (Array.mkArray depth {})
+
+  -- stream a chunked body without keeping it
+  let received ← IO.mkRef 0
+  let t0 ← IO.monoNanosNow
+  let head ← c.request { path := "/big" } fun s => received.modify (· + s.size)
+  let t1 ← IO.monoNanosNow
+  let mb := (← received.get) / 1000000
+  IO.println s!"chunked stream: status {head.status}, {mb}MB in {(t1 - t0) / 1000000}ms, {mb * 1000000000 / max (t1 - t0) 1}MB/s"
+  c.close
+
+/--
+  Entry. With a host argument, fetch `http://host/path` and print the response;
+  without arguments, benchmark the client against a local server.
+-/
+def main (args : List String) : IO Unit := do
+  match args with
+  | host :: rest =>
+    let path := rest.head?.getD "/"
+    let addr ← SockAddr.mk host "80" AddressFamily.inet SockType.stream
+    IO.println s!"Remote Addr: {addr}"
+    let c ← Connection.connect addr host
+    let resp ← c.fetch { path }
+    IO.println s!"HTTP/1.{resp.head.minor} {resp.head.status} {resp.head.reason}"
+    for h in resp.head.headers do
+      IO.println s!"{h.name}: {h.value}"
+    IO.println ""
+    IO.println <| String.fromUTF8Unchecked resp.body
+    c.close
+  | [] =>
+    bench
+    -- the server tasks block in `accept` and `recv`
+    IO.Process.exit 0
@@ -2,6 +2,31 @@ import Socket
 
 open Socket
 
+/--
+  Canned responses, built once and shared by every connection task.
+-/
+structure Responses where
+  hello : StaticBytes
+  health : StaticBytes
+  notFound : StaticBytes
+
+/--
+  Answer one request, then close the connection.
+-/
+def handle (r : Responses) (s : Socket) : IO Unit := do
+  try
+    -- only the request line matters here
+    let target := match ← s.recv 4096 with
+      | some bytes => ((String.fromUTF8Unchecked bytes).splitOn " ").getD 1 "/"
+      | none => "/"
+    let response := match target with
+      | "/" => r.hello
+      | "/health" => r.health
+      | _ => r.notFound
+    s.sendvAll #[response.bytes]
+  finally
+    s.close
+
 /--
   Entry
 -/
@@ -19,16 +44,14 @@ def main : IO Unit := do
   socket.listen 5
   IO.println s!"Listening at http://localhost:8080."
 
+  let responses : Responses := {
+    hello := (← StaticBytes.response 200 "OK" "text/plain" "Hello".toUTF8 "Connection: close\r\n")
+    health := (← StaticBytes.response 200 "OK" "text/plain" "ok".toUTF8 "Connection: close\r\n")
+    notFound := (← StaticBytes.response 404 "Not Found" "text/plain" "Not Found".toUTF8 "Connection: close\r\n")
+  }
+
   -- serving
   repeat do
     let (remoteAddr, socket') ← socket.accept
-    let t ← IO.asTask do
-      let strSend := 
-        "HTTP/1.1 200 OK" ++
-        "Content-Length:5" ++
-        "\r\n\r\n" ++
-        "Hello" ++
-        "\r\n\r\n"
-      let bytesSend ← socket'.send strSend.toUTF8
-      socket'.close
-    IO.println s!"Incoming: {remoteAddr}"
\ No newline at end of file
+    discard <| IO.asTask (handle responses socket')
+    IO.println s!"Incoming: {remoteAddr}"
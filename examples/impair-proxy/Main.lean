@@ -0,0 +1,190 @@
+import Socket
+
+open Socket
+
+/-!
+  A proxy adding latency, jitter, a bandwidth cap, loss and reordering between a client and
+  a server. With arguments it runs as a standalone tool, without it demonstrates itself on
+  local echo servers.
+-/
+
+def usage : String :=
+  "usage: Main (tcp | udp) <listen-port> <target-host> <target-port> [key=value ...]
+keys: latency=<ms> jitter=<ms> rate=<kbit/s> loss=<%> reorder=<%> reorder-delay=<ms>
+each applies to both directions"
+
+/-- A decimal like `0.5`. -/
+def parseDecimal (s : String) : Option Float :=
+  match s.splitOn "." with
+  | [whole] => whole.toNat?.map Float.ofNat
+  | [whole, frac] => do
+    let w ← if whole.isEmpty then pure 0 else whole.toNat?
+    let f ← frac.toNat?
+    return Float.ofNat w + Float.ofScientific f true frac.length
+  | _ => none
+
+def parseSetting (p : Impair.Profile) (arg : String) : Except String Impair.Profile := do
+  let [key, value] := arg.splitOn "=" | throw s!"expected key=value: {arg}"
+  let some n := parseDecimal value | throw s!"not a number: {arg}"
+  match key with
+  | "latency" => return { p with latencyMs := n.toUInt64.toNat }
+  | "jitter" => return { p with jitterMs := n.toUInt64.toNat }
+  | "rate" => return { p with bytesPerSec := (n * 125).toUInt64.toNat }
+  | "loss" => return { p with lossPercent := n }
+  | "reorder" => return { p with reorderPercent := n }
+  | "reorder-delay" => return { p with reorderMs := n.toUInt64.toNat }
+  | _ => throw s!"unknown key: {key}"
+
+def runTool (args : List String) : IO Unit := do
+  let proto :: listenPort :: host :: port :: settings := args
+    | do
+      IO.eprintln usage
+      IO.Process.exit 2
+  let profile ← match settings.foldlM parseSetting {} with
+    | .ok p => pure p
+    | .error e => do
+      IO.eprintln s!"{e}\n{usage}"
+      IO.Process.exit 2
+  match proto with
+  | "tcp" =>
+    let listen ← SockAddr.mk "0.0.0.0" listenPort AddressFamily.inet SockType.stream
+    let target ← SockAddr.mk host port AddressFamily.inet SockType.stream
+    IO.println s!"tcp {listen} -> {target}"
+    Impair.tcpProxy profile listen target
+  | "udp" =>
+    let listen ← SockAddr.mk "0.0.0.0" listenPort AddressFamily.inet SockType.dgram
+    let target ← SockAddr.mk host port AddressFamily.inet SockType.dgram
+    IO.println s!"udp {listen} -> {target}"
+    Impair.udpProxy profile listen target
+  | _ =>
+    IO.eprintln usage
+    IO.Process.exit 2
+
+-- Demonstration
+
+def tcpEcho : String := "9201"
+def tcpProxy : String := "9200"
+def udpEcho : String := "9203"
+def udpProxy : String := "9202"
+
+/-- 20 ms each way over a 10 Mbit/s link. -/
+def wan : Impair.Profile := { latencyMs := 20, jitterMs := 2, bytesPerSec := 1250000 }
+
+/-- A lossy path where some datagrams are overtaken by later ones. -/
+def lossy : Impair.Profile := { latencyMs := 10, lossPercent := 5, reorderPercent := 10, reorderMs := 30 }
+
+def message : ByteArray := ByteArray.mk (Array.mkArray 64 42)
+
+def trips : Nat := 50
+
+def bulkBytes : Nat := 1048576
+
+def datagrams : Nat := 1000
+
+def addr (port : String) (t : SockType) : IO SockAddr :=
+  SockAddr.mk "127.0.0.1" port AddressFamily.inet t
+
+partial def echo (s : Socket) : IO Unit := do
+  match ← s.recv 65536 with
+  | some bytes =>
+    if bytes.size == 0 then
+      s.close
+    else
+      s.sendvAll #[bytes]
+      echo s
+  | none => s.close
+
+partial def echoServer (l : Socket) : IO Unit := do
+  let (_, c) ← l.accept
+  discard <| IO.asTask (echo c) Task.Priority.dedicated
+  echoServer l
+
+partial def udpEchoServer (s : Socket) : IO Unit := do
+  if let some (peer, bytes) ← s.recvfrom 65536 then
+    discard <| s.sendto bytes peer
+  udpEchoServer s
+
+partial def recvExactly (s : Socket) (n : Nat) (got : Nat := 0) : IO Unit := do
+  if got < n then
+    match ← s.recv (min (n - got) 65536).toUSize with
+    | some bytes =>
+      if bytes.size == 0 then
+        throw (IO.userError "connection closed early")
+      recvExactly s n (got + bytes.size)
+    | none => throw (IO.userError "connection closed early")
+
+def timed (label : String) (action : IO Unit) : IO Nat := do
+  let t0 ← IO.monoMsNow
+  action
+  let elapsed := (← IO.monoMsNow) - t0
+  IO.println s!"  {label}: {elapsed} ms"
+  return elapsed
+
+def tcpDemo : IO Unit := do
+  let l ← Socket.mk AddressFamily.inet SockType.stream
+  l.setReuseAddr true
+  l.bind (← addr tcpEcho SockType.stream)
+  l.listen 128
+  discard <| IO.asTask (echoServer l) Task.Priority.dedicated
+  let listen ← addr tcpProxy SockType.stream
+  discard <| IO.asTask (Impair.tcpProxy wan listen (← addr tcpEcho SockType.stream)) Task.Priority.dedicated
+  IO.sleep 50
+
+  IO.println s!"tcp: {wan.latencyMs} ms each way, {wan.bytesPerSec * 8 / 1000} kbit/s"
+  let s ← Socket.mk AddressFamily.inet SockType.stream
+  s.connect listen
+  let one ← timed s!"{trips} round trips one at a time" do
+    for _ in [0:trips] do
+      s.sendvAll #[message]
+      recvExactly s message.size
+  let piped ← timed s!"{trips} round trips pipelined" do
+    s.sendvAll (Array.mkArray trips message)
+    recvExactly s (trips * message.size)
+  IO.println s!"  pipelining is {one / max piped 1}x faster"
+  let chunk := ByteArray.mk (Array.mkArray bulkBytes 0)
+  let elapsed ← timed s!"{bulkBytes / 1024} KiB echoed" do
+    let writer ← IO.asTask (s.sendvAll #[chunk]) Task.Priority.dedicated
+    recvExactly s bulkBytes
+    discard <| IO.wait writer
+  IO.println s!"  {bulkBytes * 8 / max elapsed 1} kbit/s"
+  s.close
+
+def udpDemo : IO Unit := do
+  let server ← Socket.mk AddressFamily.inet SockType.dgram
+  server.bind (← addr udpEcho SockType.dgram)
+  discard <| IO.asTask (udpEchoServer server) Task.Priority.dedicated
+  let listen ← addr udpProxy SockType.dgram
+  discard <| IO.asTask (Impair.udpProxy lossy listen (← addr udpEcho SockType.dgram)) Task.Priority.dedicated
+  IO.sleep 50
+
+  IO.println s!"udp: {lossy.latencyMs} ms each way, {lossy.lossPercent}% loss and {lossy.reorderPercent}% delayed by {lossy.reorderMs} ms"
+  let s ← Socket.mk AddressFamily.inet SockType.dgram
+  s.connect listen
+  let received ← IO.mkRef (0 : Nat)
+  let reordered ← IO.mkRef (0 : Nat)
+  let highest ← IO.mkRef (0 : Nat)
+  discard <| IO.asTask (do
+    for _ in [0:datagrams] do
+      let some bytes ← s.recv 64 | return
+      let n := (String.fromUTF8Unchecked bytes).toNat!
+      received.modify (· + 1)
+      if n < (← highest.get) then
+        reordered.modify (· + 1)
+      highest.modify (max n)) Task.Priority.dedicated
+  for i in [1:datagrams + 1] do
+    discard <| s.send (toString i).toUTF8
+    if i % 100 == 0 then
+      IO.sleep 1
+  IO.sleep 500
+  IO.println s!"  {datagrams} sent, {← received.get} echoed back, {← reordered.get} of them out of order"
+
+/--
+  Entry
+-/
+def main (args : List String) : IO Unit := do
+  if !args.isEmpty then
+    runTool args
+    return
+  tcpDemo
+  udpDemo
+  IO.Process.exit 0
@@ -0,0 +1,256 @@
+import Socket
+
+open Socket
+
+/-!
+  A layer-4 TCP load balancer in front of local echo backends, benchmarked on loopback.
+  Listeners share the proxy port with `SO_REUSEPORT`, backends are picked by a Maglev
+  table keyed on the client address, and bytes are forwarded with `splice`.
+-/
+
+def proxyPort : String := "9000"
+
+def backendPorts : Array String := #["9101", "9102", "9103"]
+
+/-- Share of the clients each backend receives, relative to the others. -/
+def backendWeights : Array UInt32 := #[1, 1, 2]
+
+/-- Listening sockets on the proxy port, each with its own accept task. -/
+def shards : Nat := 4
+
+def healthIntervalMs : Nat := 100
+
+/-- Failed probes in a row that take a backend out of rotation. -/
+def healthFall : Nat := 2
+
+/-- Benchmark clients, each connecting from its own loopback address. -/
+def clients : Nat := 16
+
+def connsPerClient : Nat := 4
+
+def tripsPerConn : Nat := 500
+
+def message : ByteArray := ByteArray.mk (Array.mkArray 64 42)
+
+def bulkMiB : Nat := 256
+
+def listenOn (port : String) (reusePort : Bool) : IO Socket := do
+  let s ← Socket.mk AddressFamily.inet SockType.stream
+  s.setReuseAddr true
+  if reusePort then
+    s.setReusePort true
+  s.bind (← SockAddr.mk "127.0.0.1" port AddressFamily.inet SockType.stream)
+  s.listen 128
+  return s
+
+-- Backend stubs
+
+partial def echo (s : Socket) : IO Unit := do
+  match ← s.recv 65536 with
+  | some bytes =>
+    if bytes.size == 0 then
+      s.close
+    else
+      s.sendvAll #[bytes]
+      echo s
+  | none => s.close
+
+/-- Accept until the listener is shut down. -/
+partial def stubLoop (l : Socket) : IO Unit := do
+  let (_, c) ← l.accept
+  discard <| IO.asTask (echo c) Task.Priority.dedicated
+  stubLoop l
+
+-- Proxy
+
+structure Backend where
+  addr : SockAddr
+  weight : UInt32
+  healthy : IO.Ref Bool
+  /-- Draining backends get no new connections but keep their open ones. -/
+  draining : IO.Ref Bool
+  /-- Proxied connections currently open. -/
+  active : IO.Ref Nat
+  /-- Proxied connections in total. -/
+  served : IO.Ref Nat
+
+/-- Backends with a Maglev table over the available ones. -/
+structure Pool where
+  backends : Array Backend
+  /-- The table, the index into `backends` of each of its backends, and its generation. -/
+  table : IO.Ref (Maglev × Array Nat × Nat)
+  generation : IO.Ref Nat
+
+/--
+  Rebuild the table after backends went up, down or started draining. Maglev moves few
+  clients of the other backends. Of concurrent rebuilds the last one started wins.
+-/
+def Pool.rebuild (p : Pool) : IO Unit := do
+  let generation ← p.generation.modifyGet fun n => (n + 1, n + 1)
+  let mut members : Array (SockAddr × UInt32) := #[]
+  let mut indices : Array Nat := #[]
+  for i in [0:p.backends.size] do
+    if let some b := p.backends.get? i then
+      if (← b.healthy.get) && !(← b.draining.get) then
+        members := members.push (b.addr, b.weight)
+        indices := indices.push i
+  let table ← Maglev.mk members 1021
+  p.table.modify fun current => if current.2.2 < generation then (table, indices, generation) else current
+
+def Pool.create (backends : Array Backend) : IO Pool := do
+  let p : Pool := { backends, table := (← IO.mkRef ((← Maglev.mk #[] 1021), #[], 0)), generation := (← IO.mkRef 0) }
+  p.rebuild
+  return p
+
+def Pool.pick (p : Pool) (key : UInt64) : IO (Option Backend) := do
+  let (table, indices, _) ← p.table.get
+  return table.lookupIndex key >>= indices.get? >>= p.backends.get?
+
+/-- Forward one direction. On failure both sockets are shut down, to wake the other direction. -/
+def pump (src dst : Socket) : IO Unit := do
+  try
+    (← SplicePipe.mk).forwardAll src dst
+  catch _ =>
+    try src.shutdown ShutdownHow.readwrite catch _ => pure ()
+    try dst.shutdown ShutdownHow.readwrite catch _ => pure ()
+
+def proxy (pool : Pool) (client : Socket) (peer : SockAddr) : IO Unit := do
+  let some b ← pool.pick peer.hostHash | client.close
+  let upstream ← Socket.mk AddressFamily.inet SockType.stream
+  try
+    upstream.connect b.addr
+  catch _ =>
+    upstream.close
+    client.close
+    return
+  b.active.modify (· + 1)
+  b.served.modify (· + 1)
+  let up ← IO.asTask (pump client upstream) Task.Priority.dedicated
+  pump upstream client
+  discard <| IO.wait up
+  b.active.modify (· - 1)
+  client.close
+  upstream.close
+
+partial def acceptLoop (pool : Pool) (l : Socket) : IO Unit := do
+  let (peer, c) ← l.accept
+  discard <| IO.asTask (proxy pool c peer) Task.Priority.dedicated
+  acceptLoop pool l
+
+/-- Probe every backend from one loop, updating the pool when one goes up or down. -/
+def startHealthChecks (pool : Pool) : IO Unit := do
+  let targets := pool.backends.map fun b => { addr := b.addr, timeoutMs := 50 : HealthCheck.Target }
+  let checker ← HealthChecker.create targets (rise := 2) (fall := healthFall) (intervalMs := healthIntervalMs) (initiallyUp := true)
+    (onChange := fun i up outcome => do
+      if let some b := pool.backends.get? i then
+        IO.println s!"  health: {b.addr} is {outcome}"
+        b.healthy.set up
+        pool.rebuild)
+  discard <| IO.asTask checker.run Task.Priority.dedicated
+
+partial def waitIdle (b : Backend) : IO Unit := do
+  if (← b.active.get) > 0 then
+    IO.sleep 1
+    waitIdle b
+
+-- Benchmark clients
+
+partial def recvExactly (s : Socket) (n : Nat) (got : Nat := 0) : IO Unit := do
+  if got < n then
+    match ← s.recv (min (n - got) 262144).toUSize with
+    | some bytes =>
+      if bytes.size == 0 then
+        throw (IO.userError "connection closed early")
+      recvExactly s n (got + bytes.size)
+    | none => throw (IO.userError "connection closed early")
+
+/-- Connect to the proxy from `127.0.0.{i + 2}`, so every client has its own address. -/
+def connectFrom (i : Nat) : IO Socket := do
+  let s ← Socket.mk AddressFamily.inet SockType.stream
+  s.bind (← SockAddr.mk s!"127.0.0.{i + 2}" "0" AddressFamily.inet SockType.stream)
+  s.connect (← SockAddr.mk "127.0.0.1" proxyPort AddressFamily.inet SockType.stream)
+  return s
+
+def client (i : Nat) : IO Unit := do
+  for _ in [0:connsPerClient] do
+    let s ← connectFrom i
+    for _ in [0:tripsPerConn] do
+      s.sendvAll #[message]
+      recvExactly s message.size
+    s.close
+
+/-- Run all clients at once and report round trips per second and connections per backend. -/
+def roundTrips (label : String) (pool : Pool) : IO Unit := do
+  let before ← pool.backends.mapM (·.served.get)
+  let t0 ← IO.monoNanosNow
+  let mut tasks : Array (Task (Except IO.Error Unit)) := #[]
+  for i in [0:clients] do
+    tasks := tasks.push (← IO.asTask (client i) Task.Priority.dedicated)
+  for t in tasks do
+    if let .error e := (← IO.wait t) then
+      IO.eprintln s!"  client: {e}"
+  let elapsed := (← IO.monoNanosNow) - t0
+  let after ← pool.backends.mapM (·.served.get)
+  let total := clients * connsPerClient * tripsPerConn
+  IO.println s!"{label}: {total * 1000000000 / elapsed} round trips/s, connections per backend {Array.zipWith after before (· - ·)}"
+
+def bulk : IO Unit := do
+  let s ← connectFrom 0
+  let chunk := ByteArray.mk (Array.mkArray 1048576 0)
+  let t0 ← IO.monoNanosNow
+  let writer ← IO.asTask (do for _ in [0:bulkMiB] do s.sendvAll #[chunk]) Task.Priority.dedicated
+  recvExactly s (bulkMiB * 1048576)
+  let elapsed := (← IO.monoNanosNow) - t0
+  discard <| IO.wait writer
+  s.close
+  IO.println s!"bulk: {bulkMiB} MiB echoed through the proxy at {bulkMiB * 1000000000 / elapsed} MiB/s"
+
+/--
+  Entry
+-/
+def main : IO Unit := do
+  let mut stubs : Array Socket := #[]
+  for port in backendPorts do
+    let l ← listenOn port false
+    discard <| IO.asTask (stubLoop l) Task.Priority.dedicated
+    stubs := stubs.push l
+
+  let mut backends : Array Backend := #[]
+  for (port, weight) in backendPorts.zip backendWeights do
+    backends := backends.push {
+      addr := (← SockAddr.mk "127.0.0.1" port AddressFamily.inet SockType.stream)
+      weight
+      healthy := (← IO.mkRef true)
+      draining := (← IO.mkRef false)
+      active := (← IO.mkRef 0)
+      served := (← IO.mkRef 0)
+    }
+  let pool ← Pool.create backends
+  for _ in [0:shards] do
+    let l ← listenOn proxyPort true
+    discard <| IO.asTask (acceptLoop pool l) Task.Priority.dedicated
+  startHealthChecks pool
+  IO.println s!"proxy on 127.0.0.1:{proxyPort} with {shards} listeners, backends on {backendPorts}"
+  IO.println s!"{clients} clients x {connsPerClient} connections x {tripsPerConn} round trips of {message.size} bytes"
+
+  roundTrips "all backends" pool
+  bulk
+
+  let some first := backends.get? 0 | return
+  let running ← IO.asTask (roundTrips s!"draining {first.addr} midway" pool) Task.Priority.dedicated
+  IO.sleep 20
+  let t0 ← IO.monoMsNow
+  first.draining.set true
+  pool.rebuild
+  waitIdle first
+  IO.println s!"  {first.addr} drained in {(← IO.monoMsNow) - t0} ms"
+  discard <| IO.wait running
+  first.draining.set false
+  pool.rebuild
+
+  let some last := stubs.get? (stubs.size - 1) | return
+  last.shutdown ShutdownHow.readwrite
+  last.close
+  IO.sleep ((healthFall + 1) * healthIntervalMs).toUInt32
+  roundTrips "last backend down" pool
+  IO.Process.exit 0
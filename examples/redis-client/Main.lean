@@ -0,0 +1,85 @@
+import Socket
+
+open Socket Redis
+
+/-- Tasks issuing commands concurrently. -/
+def workers : Nat := 50
+
+/-- Commands issued by every task. -/
+def commandsPerWorker : Nat := 200
+
+/--
+  Answer a mock command: enough of PING, ECHO, SET, GET and INCR for this example.
+-/
+def handle (store : IO.Ref (List (String × String))) (args : Array String) : IO ByteArray := do
+  let bulk (s : String) := s!"${s.utf8ByteSize}\r\n{s}\r\n".toUTF8
+  match args.toList with
+  | ["PING"] => return "+PONG\r\n".toUTF8
+  | ["ECHO", msg] => return bulk msg
+  | ["SET", k, v] => do
+    store.modify fun kvs => (k, v) :: kvs.filter (·.1 != k)
+    return "+OK\r\n".toUTF8
+  | ["GET", k] => do
+    match (← store.get).lookup k with
+    | some v => return bulk v
+    | none => return "$-1\r\n".toUTF8
+  | ["INCR", k] => do
+    let n ← store.modifyGet fun kvs =>
+      let n := ((kvs.lookup k).bind String.toInt?).getD 0 + 1
+      (n, (k, toString n) :: kvs.filter (·.1 != k))
+    return s!":{n}\r\n".toUTF8
+  | _ => return "-ERR unknown command\r\n".toUTF8
+
+/--
+  Mock RESP server connection: replies to everything parsed from one read with one write.
+-/
+partial def serve (store : IO.Ref (List (String × String))) (s : Socket) (buf : ByteArray) (pos : Nat) (out : ByteArray) : IO Unit := do
+  match Redis.parse buf pos with
+  | .done (.array args) next =>
+    let args := args.map fun | .bulk b => b.toString | _ => ""
+    serve store s buf next (out ++ (← handle store args))
+  | .done _ next => serve store s buf next out
+  | .invalid _ => s.close
+  | .incomplete =>
+    if out.size > 0 then
+      discard <| s.send out
+    match ← s.recv 65536 with
+    | some chunk =>
+      if chunk.size == 0 then
+        s.close
+      else
+        serve store s (buf.extract pos buf.size ++ chunk) 0 ByteArray.empty
+    | none => s.close
+
+/--
+  Entry
+-/
+def main : IO Unit := do
+  let addr ← SockAddr.mk "127.0.0.1" "6390" AddressFamily.inet SockType.stream
+  let listener ← Socket.mk AddressFamily.inet SockType.stream
+  listener.bind addr
+  listener.listen 1
+  let store ← IO.mkRef []
+  let server ← IO.asTask (prio := Task.Priority.dedicated) do
+    let (_, conn) ← listener.accept
+    serve store conn ByteArray.empty 0 ByteArray.empty
+
+  let client ← Client.connect addr
+  IO.println s!"PING: {← client.exec #["PING"]}"
+  IO.println s!"ECHO: {← client.exec #["ECHO", "hello"]}"
+
+  -- concurrent commands from many tasks share writes on the single connection
+  let t0 ← IO.monoMsNow
+  let tasks ← (List.range workers).mapM fun _ => IO.asTask do
+    for _ in [0:commandsPerWorker] do
+      discard <| client.command #["INCR", "counter"]
+    client.exec #["GET", "counter"]
+  for t in tasks do
+    discard <| IO.ofExcept (← IO.wait t)
+  let final ← client.exec #["GET", "counter"]
+  let t1 ← IO.monoMsNow
+  IO.println s!"{workers * commandsPerWorker} INCRs in {t1 - t0}ms, counter = {final}"
+
+  client.close
+  discard <| IO.wait server
+  listener.close
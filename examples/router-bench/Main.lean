@@ -0,0 +1,92 @@
+import Socket
+
+open Socket
+
+/-- Route groups; each contributes four patterns. -/
+def groups : Nat := 250
+
+/-- Passes over the request paths. -/
+def rounds : Nat := 1000
+
+def patterns : Array String := Id.run do
+  let mut ps := #[]
+  for i in [0:groups] do
+    ps := ps.push s!"/api/v1/res{i}"
+    ps := ps.push s!"/api/v1/res{i}/:id"
+    ps := ps.push s!"/api/v1/res{i}/:id/items/:item"
+    ps := ps.push s!"/static{i}/*path"
+  return ps
+
+/-- Request paths hitting every kind of route, and some misses. -/
+def paths : Array String := Id.run do
+  let mut ps := #[]
+  for i in [0:groups] do
+    ps := ps.push s!"/api/v1/res{i}"
+    ps := ps.push s!"/api/v1/res{i}/{i * 7}"
+    ps := ps.push s!"/api/v1/res{i}/{i}/items/{i * 3}"
+    ps := ps.push s!"/static{i}/css/site.css"
+    if i % 10 == 0 then
+      ps := ps.push s!"/api/v2/res{i}"
+  return ps
+
+/-- The chain of comparisons being replaced: try each pattern in turn, segment by segment. -/
+def matchSegments : List String → List String → Bool
+  | [], [] => true
+  | p :: ps, s :: ss =>
+    if p.startsWith "*" then true
+    else if p.startsWith ":" then s != "" && matchSegments ps ss
+    else p == s && matchSegments ps ss
+  | p :: _, [] => p.startsWith "*"
+  | [], _ :: _ => false
+
+def naiveLookup (pats : Array (List String)) (path : String) : Option Nat :=
+  let segs := path.splitOn "/"
+  pats.findIdx? (matchSegments · segs)
+
+/--
+  Entry
+-/
+def main : IO Unit := do
+  let router ← Router.build (patterns.mapIdx fun i p => (p, i.val))
+  let requests := paths.map String.toUTF8
+  IO.println s!"{patterns.size} routes, {requests.size} paths, {rounds} rounds"
+
+  let mut matched := 0
+  let mut scratch := ByteArray.empty
+  let t0 ← IO.monoNanosNow
+  for _ in [0:rounds] do
+    for path in requests do
+      match router.lookup path 0 path.size scratch with
+      | some (_, params) =>
+        matched := matched + 1
+        scratch := params.raw
+      | none => pure ()
+  let t1 ← IO.monoNanosNow
+  let lookups := rounds * requests.size
+  IO.println s!"radix router: {(t1 - t0) / lookups}ns per lookup, {matched / rounds} matched per round"
+
+  -- the index-only entry point allocates no result per lookup
+  let caps ← Router.Captures.mk
+  let mut found := 0
+  let t0 ← IO.monoNanosNow
+  for _ in [0:rounds] do
+    for path in requests do
+      if (← router.find path caps) != 0 then
+        found := found + 1
+  let t1 ← IO.monoNanosNow
+  IO.println s!"radix router, index only: {(t1 - t0) / lookups}ns per lookup, {found / rounds} matched per round"
+
+  let pats := patterns.map (·.splitOn "/")
+  let mut naiveMatched := 0
+  let t2 ← IO.monoNanosNow
+  for _ in [0:rounds / 10] do
+    for path in paths do
+      if (naiveLookup pats path).isSome then
+        naiveMatched := naiveMatched + 1
+  let t3 ← IO.monoNanosNow
+  IO.println s!"linear comparisons: {(t3 - t2) / (lookups / 10)}ns per lookup, {naiveMatched / (rounds / 10)} matched per round"
+
+  -- captured parameters are offsets into the request bytes
+  match router.lookup "/api/v1/res42/7/items/9".toUTF8 with
+  | some (route, params) => IO.println s!"{patterns[route]!}: id = {params.find? "id"}, item = {params.find? "item"}"
+  | none => IO.println "no match"
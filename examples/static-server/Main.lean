@@ -0,0 +1,53 @@
+import Socket
+
+open Socket
+
+def notFound : ByteArray :=
+  "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nNot Found".toUTF8
+
+/--
+  Request target and `If-None-Match` value of a request head.
+-/
+def parseRequest (head : String) : Option (String × Option String) := do
+  let lines := head.splitOn "\r\n"
+  let target ← (lines.head!.splitOn " ").get? 1
+  let etag := lines.findSome? fun line =>
+    match line.splitOn ":" with
+    | name :: value => if name.toLower == "if-none-match" then some (":".intercalate value).trim else none
+    | [] => none
+  return (target, etag)
+
+/--
+  Answer the requests of one keep-alive connection, which must not have bodies.
+-/
+partial def serve (files : StaticFiles) (s : Socket) (pending : String) : IO Unit := do
+  match pending.splitOn "\r\n\r\n" with
+  | head :: rest@(_ :: _) =>
+    match parseRequest head with
+    | some (target, etag) =>
+      unless (← files.serve s target etag) do
+        s.sendvAll #[notFound]
+      serve files s ("\r\n\r\n".intercalate rest)
+    | none => s.close
+  | _ =>
+    match ← s.recv 4096 with
+    | some bytes =>
+      if bytes.size == 0 then
+        s.close
+      else
+        serve files s (pending ++ String.fromUTF8Unchecked bytes)
+    | none => s.close
+
+/--
+  Entry. The argument is the directory to serve, the current one by default.
+-/
+def main (args : List String) : IO Unit := do
+  let files ← StaticFiles.create (args.head?.getD ".") (extraHeaders := "Cache-Control: max-age=60\r\n")
+  let addr ← SockAddr.mk "localhost" "8080" AddressFamily.inet SockType.stream
+  let listener ← Socket.mk AddressFamily.inet SockType.stream
+  listener.bind addr
+  listener.listen 128
+  IO.println s!"Listening at http://localhost:8080."
+  repeat do
+    let (_, conn) ← listener.accept
+    discard <| IO.asTask (serve files conn "") Task.Priority.dedicated
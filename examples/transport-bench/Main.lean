@@ -0,0 +1,80 @@
+import Socket
+
+open Socket
+
+/-!
+  The same Redis client and mock server, run over a loopback TCP connection and over an
+  in-memory `MemPipe`. Over the pipe no system calls are made, so what remains is the cost
+  of encoding, parsing and matching replies.
+-/
+
+def port : String := "9300"
+
+/-- Commands issued one at a time, each waiting for its reply. -/
+def sequential : Nat := 10000
+
+/-- Commands issued in batches before waiting for their replies. -/
+def batches : Nat := 200
+
+def batchSize : Nat := 500
+
+def pong : ByteArray := "+PONG\r\n".toUTF8
+
+/--
+  Mock server connection over any transport: answers every command parsed from one read
+  with `+PONG`, all in one write.
+-/
+partial def serve [Transport τ] (t : τ) (buf : ByteArray) (pos : Nat) (out : ByteArray) : IO Unit := do
+  match Redis.parse buf pos with
+  | .done _ next => serve t buf next (out ++ pong)
+  | .invalid _ => Transport.close t
+  | .incomplete =>
+    if out.size != 0 then
+      Transport.sendAll t out
+    match ← Transport.recv t 65536 with
+    | some chunk =>
+      if chunk.size == 0 then
+        Transport.close t
+      else
+        serve t (buf.extract pos buf.size ++ chunk) 0 ByteArray.empty
+    | none => serve t buf pos ByteArray.empty
+
+def measure (label : String) (c : Redis.Client) : IO Unit := do
+  let t0 ← IO.monoNanosNow
+  for _ in [0:sequential] do
+    discard <| IO.wait (← c.command #["PING"])
+  let elapsed := (← IO.monoNanosNow) - t0
+  IO.println s!"{label}: {elapsed / sequential / 1000} µs per round trip"
+
+  let t0 ← IO.monoNanosNow
+  for _ in [0:batches] do
+    let mut tasks : Array (Task Redis.Response) := #[]
+    for _ in [0:batchSize] do
+      tasks := tasks.push (← c.command #["PING"])
+    for t in tasks do
+      discard <| IO.wait t
+  let elapsed := (← IO.monoNanosNow) - t0
+  IO.println s!"{label}: {batches * batchSize * 1000000000 / elapsed} pipelined commands/s"
+
+/--
+  Entry
+-/
+def main : IO Unit := do
+  let (client, server) ← MemPipe.pair
+  discard <| IO.asTask (serve server ByteArray.empty 0 ByteArray.empty) Task.Priority.dedicated
+  let c ← Redis.Client.ofTransport client
+  measure "MemPipe" c
+  c.close
+
+  let l ← Socket.mk AddressFamily.inet SockType.stream
+  l.setReuseAddr true
+  let addr ← SockAddr.mk "127.0.0.1" port AddressFamily.inet SockType.stream
+  l.bind addr
+  l.listen 1
+  discard <| IO.asTask (do
+    let (_, s) ← l.accept
+    serve s ByteArray.empty 0 ByteArray.empty) Task.Priority.dedicated
+  let c ← Redis.Client.connect addr
+  measure "TCP loopback" c
+  c.close
+  IO.Process.exit 0
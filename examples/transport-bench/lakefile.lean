@@ -0,0 +1,9 @@
+import Lake
+open System Platform Lake DSL
+
+package transport_bench
+
+require Socket from ".."/".."
+
+@[default_target]
+lean_exe Main
@@ -2,11 +2,20 @@
 // # Includes
 // ==============================================================================
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <lean/lean.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 
@@ -30,6 +39,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <linux/filter.h>
+#include <sys/sendfile.h>
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#endif
 
 #endif
 
@@ -66,6 +92,290 @@ static lean_external_class *g_socket_external_class = NULL;
  */
 static lean_external_class *g_sockaddr_external_class = NULL;
 
+/**
+ * External class for HandleTable.
+ *
+ * This class register `handle_table *` as a lean external class.
+ */
+static lean_external_class *g_handle_table_external_class = NULL;
+
+/**
+ * External class for PrefixTrie.
+ *
+ * This class register `prefix_trie *` as a lean external class.
+ */
+static lean_external_class *g_prefix_trie_external_class = NULL;
+
+/**
+ * External class for Router.
+ *
+ * This class register `router *` as a lean external class.
+ */
+static lean_external_class *g_router_external_class = NULL;
+
+/**
+ * External class for Router.Captures.
+ *
+ * This class register `router_captures *` as a lean external class.
+ */
+static lean_external_class *g_router_captures_external_class = NULL;
+
+/**
+ * External class for StaticFile.
+ *
+ * This class register `static_file *` as a lean external class.
+ */
+static lean_external_class *g_static_file_external_class = NULL;
+
+/**
+ * External class for SplicePipe.
+ *
+ * This class register `splice_pipe *` as a lean external class.
+ */
+static lean_external_class *g_splice_pipe_external_class = NULL;
+
+/**
+ * External class for Maglev.
+ *
+ * This class register `maglev *` as a lean external class.
+ */
+static lean_external_class *g_maglev_external_class = NULL;
+
+/**
+ * External class for RateLimiter.
+ *
+ * This class register `rate_limiter *` as a lean external class.
+ */
+static lean_external_class *g_rate_limiter_external_class = NULL;
+
+/**
+ * Platform mutex used by the native data structures.
+ */
+#ifdef _WIN32
+
+#define native_mutex SRWLOCK
+#define MUTEX_INIT(m) InitializeSRWLock(m)
+#define MUTEX_LOCK(m) AcquireSRWLockExclusive(m)
+#define MUTEX_UNLOCK(m) ReleaseSRWLockExclusive(m)
+#define MUTEX_DESTROY(m)
+
+#else
+
+#define native_mutex pthread_mutex_t
+#define MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+#define MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#define MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+
+#endif
+
+/**
+ * Slot of a handle table, indexed by the socket descriptor.
+ */
+typedef struct handle_slot
+{
+    lean_object *socket;
+    uint32_t generation;
+} handle_slot;
+
+/**
+ * Socket table mapping `UInt64` tokens (generation in the high half, descriptor
+ * in the low half) to owned `Socket` references.
+ */
+typedef struct handle_table
+{
+    native_mutex lock;
+    handle_slot *slots;
+    size_t capacity;
+    size_t size;
+} handle_table;
+
+/**
+ * Binary trie node, children and values are indices into `prefix_trie.nodes`, `0` meaning none.
+ */
+typedef struct prefix_node
+{
+    uint32_t child[2];
+    uint32_t value;
+    uint8_t has_value;
+} prefix_node;
+
+/**
+ * Immutable longest-prefix-match table with one trie per address family.
+ */
+typedef struct prefix_trie
+{
+    prefix_node *nodes;
+    size_t size;
+    size_t capacity;
+} prefix_trie;
+
+#define PREFIX_TRIE_ROOT4 1
+#define PREFIX_TRIE_ROOT6 2
+
+/**
+ * Token bucket of one peer address (IPv4 stored as IPv4-mapped IPv6).
+ */
+typedef struct rate_bucket
+{
+    uint64_t key[2];
+    uint64_t last_ns;
+    double tokens;
+} rate_bucket;
+
+#define RATE_LIMITER_WAYS 4
+
+#define CACHE_LINE 64
+
+/**
+ * Independently locked part of a rate limiter, holding `RATE_LIMITER_WAYS`-way sets of buckets.
+ * Aligned so that the locks of neighbouring shards don't share a cache line; arrays of shards
+ * are allocated with `cache_aligned_calloc`.
+ */
+typedef struct rate_shard
+{
+    _Alignas(CACHE_LINE) native_mutex lock;
+    rate_bucket *buckets;
+} rate_shard;
+
+/**
+ * Zeroed memory for `count` elements of `size` bytes starting on a cache line, released with
+ * `cache_aligned_free`.
+ */
+static void *cache_aligned_calloc(size_t count, size_t size)
+{
+    void *p;
+#ifdef _WIN32
+    p = _aligned_malloc(count * size, CACHE_LINE);
+#else
+    if (posix_memalign(&p, CACHE_LINE, count * size) != 0)
+    {
+        p = NULL;
+    }
+#endif
+    if (p != NULL)
+    {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
+static void cache_aligned_free(void *p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/**
+ * Fixed-memory per-address token bucket table.
+ */
+typedef struct rate_limiter
+{
+    rate_shard *shards;
+    uint64_t shard_mask;
+    uint64_t set_mask;
+    double rate_per_ns;
+    double burst;
+} rate_limiter;
+
+/**
+ * Radix tree node of a router. Children are indices into `router.nodes`, `0` meaning none.
+ */
+typedef struct router_node
+{
+    /** Static bytes matched on entering the node. */
+    uint8_t *label;
+    uint32_t label_len;
+    uint32_t child_count;
+    /** Static children, with the first byte of each child's label in `first`. */
+    uint32_t *children;
+    uint8_t *first;
+    /** `:name` child, matching up to the next `/`. */
+    uint32_t param;
+    /** `*name` child, matching the rest of the path. */
+    uint32_t wildcard;
+    /** Route index plus one, `0` if no route ends here. */
+    uint32_t route;
+} router_node;
+
+/**
+ * Immutable compressed radix tree of route patterns.
+ */
+typedef struct router
+{
+    router_node *nodes;
+    size_t size;
+    size_t capacity;
+} router;
+
+#define ROUTER_ROOT 1
+#define ROUTER_MAX_PARAMS 32
+
+/**
+ * Captures of the last `Router.Table.find` into it, overwritten by every call.
+ */
+typedef struct router_captures
+{
+    uint32_t count;
+    /** Start and stop offset of each capture. */
+    uint32_t offsets[2 * ROUTER_MAX_PARAMS];
+} router_captures;
+
+/**
+ * An open regular file, either mapped into memory (`data`, with `fd` closed) or sent with `sendfile`.
+ */
+typedef struct static_file
+{
+    int fd;
+    uint8_t *data;
+    uint64_t size;
+    uint64_t mtime_ns;
+} static_file;
+
+/**
+ * Maglev consistent hashing table. `entries` maps each of `size` slots (a prime) to an index
+ * into `backends` and `indices`, which hold the owned `some addr` and `some i` results of
+ * lookups, built once so that lookups allocate nothing.
+ */
+typedef struct maglev
+{
+    lean_object **backends;
+    lean_object **indices;
+    uint32_t count;
+    uint32_t size;
+    uint32_t *entries;
+} maglev;
+
+/**
+ * Progress of one health probe within `lean_health_probe`.
+ */
+typedef struct health_probe
+{
+    int fd;
+    uint8_t phase;
+    /** Bytes of the request sent, then bytes of the expected response received. */
+    size_t progress;
+    uint64_t started_ns;
+    uint64_t deadline_ns;
+} health_probe;
+
+#define HEALTH_PENDING 0
+#define HEALTH_CONNECTING 1
+#define HEALTH_SENDING 2
+#define HEALTH_READING 3
+#define HEALTH_DONE 4
+
+/**
+ * Kernel pipe that socket data is spliced through on Linux, unused (`-1`) elsewhere.
+ */
+typedef struct splice_pipe
+{
+    int fds[2];
+} splice_pipe;
+
 // ==============================================================================
 // # Utilities
 // ==============================================================================
@@ -76,6 +386,7 @@ static lean_external_class *g_sockaddr_external_class = NULL;
 
 #define ISVALIDSOCKET(s) ((s) != INVALID_SOCKET)
 #define CLOSESOCKET(s) closesocket(s)
+#define INVALIDSOCKET INVALID_SOCKET
 
 #ifndef IPV6_V6ONLY
 #define IPV6_V6ONLY 27
@@ -90,6 +401,7 @@ static void cleanup()
 
 #define ISVALIDSOCKET(s) ((s) >= 0)
 #define CLOSESOCKET(s) close(s)
+#define INVALIDSOCKET (-1)
 #define SOCKET int
 
 #endif
@@ -108,6 +420,41 @@ lean_object *lean_option_mk_none()
     return lean_alloc_ctor(0, 0, 0);
 }
 
+lean_object *lean_except_mk_error(const char *msg)
+{
+    lean_object *except = lean_alloc_ctor(0, 1, 0);
+    lean_ctor_set(except, 0, lean_mk_string(msg));
+    return except;
+}
+
+lean_object *lean_except_mk_ok(lean_object *v)
+{
+    lean_object *except = lean_alloc_ctor(1, 1, 0);
+    lean_ctor_set(except, 0, v);
+    return except;
+}
+
+/**
+ * Box a `ByteSlice` of `arr` in `[start, stop)`, taking a reference to `arr`.
+ */
+static lean_object *byte_slice_box(b_lean_obj_arg arr, size_t start, size_t stop)
+{
+    lean_inc(arr);
+    lean_object *o = lean_alloc_ctor(0, 3, 0);
+    lean_ctor_set(o, 0, arr);
+    lean_ctor_set(o, 1, lean_usize_to_nat(start));
+    lean_ctor_set(o, 2, lean_usize_to_nat(stop));
+    return o;
+}
+
+/**
+ * Offset given as a `Nat`, `SIZE_MAX` when it does not fit in a `size_t`.
+ */
+static size_t nat_offset_unbox(b_lean_obj_arg n)
+{
+    return lean_is_scalar(n) ? lean_unbox(n) : SIZE_MAX;
+}
+
 static int address_family_unbox(uint8_t af)
 {
     switch (af)
@@ -153,6 +500,31 @@ static int sock_type_unbox(uint8_t type)
     }
 }
 
+static int shutdown_how_unbox(uint8_t how)
+{
+#ifdef _WIN32
+    switch (how)
+    {
+    case 0:
+        return SD_RECEIVE;
+    case 1:
+        return SD_SEND;
+    default:
+        return SD_BOTH;
+    }
+#else
+    switch (how)
+    {
+    case 0:
+        return SHUT_RD;
+    case 1:
+        return SHUT_WR;
+    default:
+        return SHUT_RDWR;
+    }
+#endif
+}
+
 /**
  * `SOCKET *` -> `lean_object *`(`Socket`) conversion
  * use macro instead of function to avoid foward declaration
@@ -210,332 +582,483 @@ static lean_obj_res get_socket_error()
     return lean_mk_io_user_error(details);
 }
 
-// ==============================================================================
-// # Initialization
-// ==============================================================================
-
-// ## Finalizers
-
 /**
- * `Socket` destructor, which ensures that the socket is closed when garbage collected.
+ * Error for functionality which is not available on the current platform.
  */
-inline static void socket_finalizer(void *socket_ptr)
+static lean_obj_res get_unsupported_error(const char *what)
 {
-    SOCKET *converted = (SOCKET *)socket_ptr;
-    CLOSESOCKET(*converted);
-    free(converted);
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%s is not supported on this platform", what);
+    return lean_mk_io_user_error(lean_mk_string(buffer));
 }
 
+// ## Deferred Close
+
+#ifndef _WIN32
+
 /**
- * `SockAddr` destructor, which ensures that the socket is closed when garbage collected.
+ * Queue of descriptors waiting to be closed by the background closer thread.
+ *
+ * `g_close_pending` counts both queued descriptors and the batch the closer
+ * thread is currently working on, so `flushDeferredClose` can wait for it to drop to zero.
  */
-inline static void sockaddr_finalizer(void *sal)
+static pthread_mutex_t g_close_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_close_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_close_idle_cond = PTHREAD_COND_INITIALIZER;
+static SOCKET *g_close_queue = NULL;
+static size_t g_close_queue_size = 0;
+static size_t g_close_queue_capacity = 0;
+static size_t g_close_pending = 0;
+static int g_close_enabled = 0;
+static int g_close_started = 0;
+
+static void *close_worker(void *arg)
 {
-    free((sockaddr_len *)sal);
+    SOCKET *batch = NULL;
+    size_t batch_capacity = 0;
+    pthread_mutex_lock(&g_close_mutex);
+    for (;;)
+    {
+        while (g_close_queue_size == 0)
+        {
+            pthread_cond_wait(&g_close_cond, &g_close_mutex);
+        }
+        // swap buffers so producers never wait for the closes themselves
+        SOCKET *queue = g_close_queue;
+        size_t size = g_close_queue_size;
+        size_t capacity = g_close_queue_capacity;
+        g_close_queue = batch;
+        g_close_queue_capacity = batch_capacity;
+        g_close_queue_size = 0;
+        batch = queue;
+        batch_capacity = capacity;
+        pthread_mutex_unlock(&g_close_mutex);
+        for (size_t i = 0; i < size; ++i)
+        {
+            CLOSESOCKET(batch[i]);
+        }
+        pthread_mutex_lock(&g_close_mutex);
+        g_close_pending -= size;
+        if (g_close_pending == 0)
+        {
+            pthread_cond_broadcast(&g_close_idle_cond);
+        }
+    }
+    return NULL;
 }
 
-// ## Foreach iterators
-
 /**
- * A do nothing iterator.
+ * Append to the close queue, `g_close_mutex` must be held.
+ * Returns 0 if deferred close is disabled or the queue can't grow.
  */
-inline static void noop_foreach(void *mod, b_lean_obj_arg fn) {}
+static int close_enqueue_locked(SOCKET fd)
+{
+    if (!g_close_enabled)
+    {
+        return 0;
+    }
+    if (g_close_queue_size == g_close_queue_capacity)
+    {
+        size_t capacity = g_close_queue_capacity ? g_close_queue_capacity * 2 : 64;
+        SOCKET *queue = realloc(g_close_queue, capacity * sizeof(SOCKET));
+        if (queue == NULL)
+        {
+            return 0;
+        }
+        g_close_queue = queue;
+        g_close_queue_capacity = capacity;
+    }
+    g_close_queue[g_close_queue_size++] = fd;
+    g_close_pending++;
+    return 1;
+}
 
-// ## Initialization Entry
+#endif
 
 /**
- * Initialize socket environment.
- * 
- * This function does the following things:
- * 1. register `Socket` and `SockAddr` class
- * 2. WSAStartup on windows
- * 3. register WSACleanup on windows
- * 
- * This function should always be called with `initialize`.
+ * Close `fd` on the background closer thread if enabled, otherwise synchronously.
  */
-lean_obj_res lean_socket_initialize()
+static int close_deferred(SOCKET fd)
 {
-    g_socket_external_class = lean_register_external_class(socket_finalizer, noop_foreach);
-    g_sockaddr_external_class = lean_register_external_class(sockaddr_finalizer, noop_foreach);
-#ifdef _WIN32
-    WSADATA d;
-    if (WSAStartup(MAKEWORD(2, 2), &d))
+#ifndef _WIN32
+    pthread_mutex_lock(&g_close_mutex);
+    int queued = close_enqueue_locked(fd);
+    if (queued)
     {
-        return lean_io_result_mk_error(get_socket_error());
+        pthread_cond_signal(&g_close_cond);
     }
-    if (atexit(cleanup))
+    pthread_mutex_unlock(&g_close_mutex);
+    if (queued)
     {
-        int errnum = errno;
-        lean_object *details = lean_mk_string(strerror(errnum));
-        return lean_io_result_mk_error(lean_mk_io_user_error(details));
+        return 0;
     }
 #endif
-    return lean_io_result_mk_ok(lean_box(0));
+    return CLOSESOCKET(fd);
 }
 
 // ==============================================================================
-// # External Implementation
+// # Initialization
 // ==============================================================================
 
-// ## Socket
+// ## Finalizers
 
 /**
- * opaque Socket.mk (d : AddressFamily) (t : SockType) : IO Socket
+ * `Socket` destructor, which ensures that the socket is closed when garbage collected.
  */
-lean_obj_res lean_socket_mk(uint8_t af_obj, uint8_t type_obj, lean_obj_arg w)
+inline static void socket_finalizer(void *socket_ptr)
 {
-    int family = address_family_unbox(af_obj);
-    int type = sock_type_unbox(type_obj);
-    SOCKET *socket_fd = malloc(sizeof(SOCKET));
-    *socket_fd = socket(family, type, 0);
-    if (ISVALIDSOCKET(*socket_fd))
-    {
-        return lean_io_result_mk_ok(socket_box(socket_fd));
-    }
-    else
+    SOCKET *converted = (SOCKET *)socket_ptr;
+    if (ISVALIDSOCKET(*converted))
     {
-        return lean_io_result_mk_error(get_socket_error());
+        close_deferred(*converted);
     }
+    free(converted);
 }
 
 /**
- * opaque Socket.close (s : @& Socket) : IO Unit
+ * `SockAddr` destructor, which ensures that the socket is closed when garbage collected.
  */
-lean_obj_res lean_socket_close(b_lean_obj_arg s, lean_obj_arg w)
+inline static void sockaddr_finalizer(void *sal)
 {
-    if (CLOSESOCKET(*socket_unbox(s)) == 0)
-    {
-        return lean_io_result_mk_ok(lean_box(0));
-    }
-    else
-    {
-        return lean_io_result_mk_error(get_socket_error());
-    }
+    free((sockaddr_len *)sal);
 }
 
 /**
- * opaque Socket.connect (s : @& Socket) (a : @& SockAddr) : IO Unit
+ * `HandleTable` destructor, which releases every socket still in the table.
  */
-lean_obj_res lean_socket_connect(b_lean_obj_arg s, b_lean_obj_arg a, lean_obj_arg w)
+static void handle_table_finalizer(void *ptr)
 {
-    sockaddr_len *sa = sockaddr_len_unbox(a);
-    if (connect(*socket_unbox(s), (sockaddr *)&(sa->address), sa->address_len) == 0)
+    handle_table *t = (handle_table *)ptr;
+    for (size_t i = 0; i < t->capacity; ++i)
     {
-        return lean_io_result_mk_ok(lean_box(0));
-    }
-    else
-    {
-        return lean_io_result_mk_error(get_socket_error());
+        if (t->slots[i].socket != NULL)
+        {
+            lean_dec(t->slots[i].socket);
+        }
     }
+    MUTEX_DESTROY(&t->lock);
+    free(t->slots);
+    free(t);
 }
 
 /**
- * opaque Socket.bind (s : @& Socket) (a : @& SockAddr) : IO Unit
+ * `PrefixTrie` destructor.
  */
-lean_obj_res lean_socket_bind(b_lean_obj_arg s, b_lean_obj_arg a, lean_obj_arg w)
+static void prefix_trie_finalizer(void *ptr)
 {
-    sockaddr_len *sa = sockaddr_len_unbox(a);
-    if (bind(*socket_unbox(s), (sockaddr *)&(sa->address), sa->address_len) == 0)
+    prefix_trie *t = (prefix_trie *)ptr;
+    free(t->nodes);
+    free(t);
+}
+
+/**
+ * `RateLimiter` destructor.
+ */
+static void rate_limiter_finalizer(void *ptr)
+{
+    rate_limiter *l = (rate_limiter *)ptr;
+    for (uint64_t i = 0; i <= l->shard_mask; ++i)
     {
-        return lean_io_result_mk_ok(lean_box(0));
+        MUTEX_DESTROY(&l->shards[i].lock);
+        free(l->shards[i].buckets);
     }
-    else
+    cache_aligned_free(l->shards);
+    free(l);
+}
+
+/**
+ * `Router.Captures` destructor.
+ */
+static void router_captures_finalizer(void *ptr)
+{
+    free(ptr);
+}
+
+/**
+ * `Router` destructor.
+ */
+static void router_finalizer(void *ptr)
+{
+    router *r = (router *)ptr;
+    for (size_t i = 0; i < r->size; ++i)
     {
-        return lean_io_result_mk_error(get_socket_error());
+        free(r->nodes[i].label);
+        free(r->nodes[i].children);
+        free(r->nodes[i].first);
     }
+    free(r->nodes);
+    free(r);
 }
 
 /**
- * opaque Socket.listen (s : @& Socket) (n : @& UInt8) : IO Unit
+ * `StaticFile` destructor, which unmaps or closes the file.
  */
-lean_obj_res lean_socket_listen(b_lean_obj_arg s, uint8_t n, lean_obj_arg w)
+static void static_file_finalizer(void *ptr)
 {
-    if (listen(*socket_unbox(s), (int)n) == 0)
+    static_file *f = (static_file *)ptr;
+#ifndef _WIN32
+    if (f->data != NULL)
     {
-        return lean_io_result_mk_ok(lean_box(0));
+        munmap(f->data, f->size);
     }
-    else
+    if (f->fd >= 0)
     {
-        return lean_io_result_mk_error(get_socket_error());
+        close(f->fd);
     }
+#endif
+    free(f);
 }
 
 /**
- * opaque Socket.accept (s : @& Socket) : IO (SockAddr × Socket)
+ * `SplicePipe` destructor.
  */
-lean_obj_res lean_socket_accept(b_lean_obj_arg s, lean_obj_arg w)
+static void splice_pipe_finalizer(void *ptr)
 {
-    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
-    SOCKET *new_fd = malloc(sizeof(SOCKET));
-    sal->address_len = sizeof(sockaddr);
-    *new_fd = accept(*socket_unbox(s), (sockaddr *)(&(sal->address)), &(sal->address_len));
-    if (ISVALIDSOCKET(*new_fd))
-    {
-        // printf("%d\n", sal->address_len);
-        lean_object *o = lean_alloc_ctor(0, 2, 0);
-        lean_ctor_set(o, 0, sockaddr_len_box(sal));
-        lean_ctor_set(o, 1, socket_box(new_fd));
-        return lean_io_result_mk_ok(o);
-    }
-    else
+    splice_pipe *p = (splice_pipe *)ptr;
+#ifdef __linux__
+    close(p->fds[0]);
+    close(p->fds[1]);
+#endif
+    free(p);
+}
+
+/**
+ * `Maglev` destructor, which releases its backends.
+ */
+static void maglev_finalizer(void *ptr)
+{
+    maglev *m = (maglev *)ptr;
+    for (uint32_t i = 0; i < m->count; ++i)
     {
-        printf("fail\n");
-        return lean_io_result_mk_error(get_socket_error());
+        lean_dec(m->backends[i]);
+        lean_dec(m->indices[i]);
     }
+    free(m->backends);
+    free(m->indices);
+    free(m->entries);
+    free(m);
 }
 
+// ## Foreach iterators
+
 /**
- * opaque Socket.shutdown (s : @& Socket) (h : ShutdownHow) : IO Unit 
+ * A do nothing iterator.
  */
-lean_obj_res lean_socket_shutdown(b_lean_obj_arg s, uint8_t h, lean_obj_arg w)
+inline static void noop_foreach(void *mod, b_lean_obj_arg fn) {}
+
+/**
+ * Visit every socket owned by a `HandleTable`.
+ */
+static void handle_table_foreach(void *ptr, b_lean_obj_arg fn)
 {
-    if (listen(*socket_unbox(s), h))
+    handle_table *t = (handle_table *)ptr;
+    for (size_t i = 0; i < t->capacity; ++i)
     {
-        return lean_io_result_mk_ok(lean_box(0));
+        if (t->slots[i].socket != NULL)
+        {
+            lean_inc(fn);
+            lean_inc(t->slots[i].socket);
+            lean_dec(lean_apply_1(fn, t->slots[i].socket));
+        }
     }
-    else
+}
+
+/**
+ * Visit every lookup result of a `Maglev` table.
+ */
+static void maglev_foreach(void *ptr, b_lean_obj_arg fn)
+{
+    maglev *m = (maglev *)ptr;
+    for (uint32_t i = 0; i < m->count; ++i)
     {
-        return lean_io_result_mk_error(get_socket_error());
+        lean_inc(fn);
+        lean_inc(m->backends[i]);
+        lean_dec(lean_apply_1(fn, m->backends[i]));
+        lean_inc(fn);
+        lean_inc(m->indices[i]);
+        lean_dec(lean_apply_1(fn, m->indices[i]));
     }
 }
 
+// ## Initialization Entry
+
 /**
- * opaque Socket.send (s : @& Socket) (b : @& ByteArray) : IO USize
+ * Initialize socket environment.
+ * 
+ * This function does the following things:
+ * 1. register `Socket` and `SockAddr` class
+ * 2. WSAStartup on windows
+ * 3. register WSACleanup on windows
+ * 
+ * This function should always be called with `initialize`.
  */
-lean_obj_res lean_socket_send(b_lean_obj_arg s, b_lean_obj_arg b, lean_obj_arg w)
+lean_obj_res lean_socket_initialize()
 {
-    lean_sarray_object *arr = lean_to_sarray(b);
-    ssize_t bytes = send(*socket_unbox(s), arr->m_data, arr->m_size, 0);
-    if (bytes >= 0)
+    g_socket_external_class = lean_register_external_class(socket_finalizer, noop_foreach);
+    g_sockaddr_external_class = lean_register_external_class(sockaddr_finalizer, noop_foreach);
+    g_handle_table_external_class = lean_register_external_class(handle_table_finalizer, handle_table_foreach);
+    g_prefix_trie_external_class = lean_register_external_class(prefix_trie_finalizer, noop_foreach);
+    g_rate_limiter_external_class = lean_register_external_class(rate_limiter_finalizer, noop_foreach);
+    g_router_external_class = lean_register_external_class(router_finalizer, noop_foreach);
+    g_router_captures_external_class = lean_register_external_class(router_captures_finalizer, noop_foreach);
+    g_static_file_external_class = lean_register_external_class(static_file_finalizer, noop_foreach);
+    g_splice_pipe_external_class = lean_register_external_class(splice_pipe_finalizer, noop_foreach);
+    g_maglev_external_class = lean_register_external_class(maglev_finalizer, maglev_foreach);
+#ifdef _WIN32
+    WSADATA d;
+    if (WSAStartup(MAKEWORD(2, 2), &d))
     {
-        return lean_io_result_mk_ok(lean_box_usize(bytes));
+        return lean_io_result_mk_error(get_socket_error());
     }
-    else
+    if (atexit(cleanup))
     {
         int errnum = errno;
-        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
-        {
-            return lean_io_result_mk_ok(lean_box_usize(0));
-        }
-        else
-        {
-            return lean_io_result_mk_error(get_socket_error());
-        }
+        lean_object *details = lean_mk_string(strerror(errnum));
+        return lean_io_result_mk_error(lean_mk_io_user_error(details));
     }
+#endif
+    return lean_io_result_mk_ok(lean_box(0));
 }
 
+// ==============================================================================
+// # External Implementation
+// ==============================================================================
+
+// ## Socket
+
 /**
- * opaque Socket.sendto (s : @& Socket) (b : @& ByteArray) (a : @& SockAddr) : IO USize
+ * opaque Socket.mk (d : AddressFamily) (t : SockType) : IO Socket
  */
-lean_obj_res lean_socket_sendto(b_lean_obj_arg s, b_lean_obj_arg b, b_lean_obj_arg a, lean_obj_arg w)
+lean_obj_res lean_socket_mk(uint8_t af_obj, uint8_t type_obj, lean_obj_arg w)
 {
-    lean_sarray_object *arr = lean_to_sarray(b);
-    sockaddr_len *sal = sockaddr_len_unbox(a);
-    ssize_t bytes = sendto(*socket_unbox(s), arr->m_data, arr->m_size, 0, (sockaddr *)&(sal->address), sal->address_len);
-    if (bytes >= 0)
+    int family = address_family_unbox(af_obj);
+    int type = sock_type_unbox(type_obj);
+    SOCKET *socket_fd = malloc(sizeof(SOCKET));
+    *socket_fd = socket(family, type, 0);
+    if (ISVALIDSOCKET(*socket_fd))
     {
-        return lean_io_result_mk_ok(lean_box_usize(bytes));
+        return lean_io_result_mk_ok(socket_box(socket_fd));
     }
     else
     {
-        int errnum = errno;
-        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
-        {
-            return lean_io_result_mk_ok(lean_box_usize(0));
-        }
-        else
-        {
-            return lean_io_result_mk_error(get_socket_error());
-        }
+        return lean_io_result_mk_error(get_socket_error());
     }
 }
 
 /**
- * opaque Socket.recv (s : @& Socket) (n : @& USize) : IO (Option ByteArray)
+ * opaque Socket.close (s : @& Socket) : IO Unit
  */
-lean_obj_res lean_socket_recv(b_lean_obj_arg s, size_t n, lean_obj_arg w)
+lean_obj_res lean_socket_close(b_lean_obj_arg s, lean_obj_arg w)
 {
-    lean_object *arr = lean_alloc_sarray(1, 0, n);
-    ssize_t bytes = recv(*socket_unbox(s), lean_sarray_cptr(arr), n, 0);
-    if (bytes >= 0)
+    SOCKET *fd = socket_unbox(s);
+    if (!ISVALIDSOCKET(*fd))
     {
-        lean_to_sarray(arr)->m_size = bytes;
-        return lean_io_result_mk_ok(lean_option_mk_some(arr));
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    SOCKET closing = *fd;
+    // invalidate first so the finalizer doesn't close a reused descriptor
+    *fd = INVALIDSOCKET;
+    if (close_deferred(closing) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
     }
     else
     {
-        lean_dec_ref(arr);
-        int errnum = errno;
-        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
-        {
-            return lean_io_result_mk_ok(lean_option_mk_none());
-        }
-        else
-        {
-            return lean_io_result_mk_error(get_socket_error());
-        }
+        return lean_io_result_mk_error(get_socket_error());
     }
 }
 
 /**
- * opaque Socket.recvfrom (s : @& Socket) (n : @& USize) : IO (Option (SockAddr × ByteArray))
+ * opaque Socket.closeMany (ss : @& Array Socket) : IO Unit
  */
-lean_obj_res lean_socket_recvfrom(b_lean_obj_arg s, size_t n, lean_obj_arg w)
+lean_obj_res lean_socket_close_many(b_lean_obj_arg ss, lean_obj_arg w)
 {
-    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
-    lean_object *arr = lean_alloc_sarray(1, 0, n);
-    ssize_t bytes = recvfrom(*socket_unbox(s), lean_sarray_cptr(arr), n, 0, (sockaddr *)&(sal->address), &(sal->address_len));
-    if (bytes >= 0)
+    size_t n = lean_array_size(ss);
+    int failed = 0;
+#ifndef _WIN32
+    pthread_mutex_lock(&g_close_mutex);
+    for (size_t i = 0; i < n; ++i)
     {
-        lean_to_sarray(arr)->m_size = bytes;
-        lean_object *o = lean_alloc_ctor(0, 2, 0);
-        lean_ctor_set(o, 0, sockaddr_len_box(sal));
-        lean_ctor_set(o, 1, arr);
-        return lean_io_result_mk_ok(lean_option_mk_some(o));
+        SOCKET *fd = socket_unbox(lean_array_get_core(ss, i));
+        if (ISVALIDSOCKET(*fd) && close_enqueue_locked(*fd))
+        {
+            *fd = INVALIDSOCKET;
+        }
     }
-    else
+    pthread_cond_signal(&g_close_cond);
+    pthread_mutex_unlock(&g_close_mutex);
+#endif
+    // anything left over is closed synchronously
+    for (size_t i = 0; i < n; ++i)
     {
-        lean_dec_ref(arr);
-        free(sal);
-        int errnum = errno;
-        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        SOCKET *fd = socket_unbox(lean_array_get_core(ss, i));
+        if (ISVALIDSOCKET(*fd))
         {
-            return lean_io_result_mk_ok(lean_option_mk_none());
+            failed |= CLOSESOCKET(*fd) != 0;
+            *fd = INVALIDSOCKET;
         }
-        else
+    }
+    if (failed)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    return lean_io_result_mk_ok(lean_box(0));
+}
+
+/**
+ * opaque Socket.setDeferredClose (enabled : Bool) : IO Unit
+ */
+lean_obj_res lean_socket_set_deferred_close(uint8_t enabled, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("Deferred close"));
+#else
+    pthread_mutex_lock(&g_close_mutex);
+    if (enabled && !g_close_started)
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int status = pthread_create(&thread, &attr, close_worker, NULL);
+        pthread_attr_destroy(&attr);
+        if (status != 0)
         {
+            pthread_mutex_unlock(&g_close_mutex);
+            errno = status;
             return lean_io_result_mk_error(get_socket_error());
         }
+        g_close_started = 1;
     }
+    g_close_enabled = enabled;
+    pthread_mutex_unlock(&g_close_mutex);
+    return lean_io_result_mk_ok(lean_box(0));
+#endif
 }
 
 /**
- * opaque Socket.peer (s : @& Socket) : IO SockAddr
+ * opaque Socket.flushDeferredClose : IO Unit
  */
-lean_obj_res lean_socket_peer(b_lean_obj_arg s, lean_obj_arg w)
+lean_obj_res lean_socket_flush_deferred_close(lean_obj_arg w)
 {
-    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
-    int status = getpeername(*socket_unbox(s), (sockaddr *)&(sal->address), &(sal->address_len));
-    if (status == 0)
+#ifndef _WIN32
+    pthread_mutex_lock(&g_close_mutex);
+    while (g_close_pending != 0)
     {
-        return lean_io_result_mk_ok(sockaddr_len_box(sal));
-    }
-    else
-    {
-        return lean_io_result_mk_error(get_socket_error());
+        pthread_cond_wait(&g_close_idle_cond, &g_close_mutex);
     }
+    pthread_mutex_unlock(&g_close_mutex);
+#endif
+    return lean_io_result_mk_ok(lean_box(0));
 }
 
 /**
- * opaque setBlocking (s : @& Socket) (blocking : Bool) : IO Unit
+ * opaque Socket.connect (s : @& Socket) (a : @& SockAddr) : IO Unit
  */
-lean_obj_res lean_socket_setblocking(b_lean_obj_arg s, uint8_t blocking, lean_obj_arg w)
+lean_obj_res lean_socket_connect(b_lean_obj_arg s, b_lean_obj_arg a, lean_obj_arg w)
 {
-#ifdef _WIN32
-    SOCKET s = *socket_unbox(s);
-    unsigned long mode = blocking ? 0 : 1;
-    int status = ioctlsocket(*socket_unbox(s), FIONBIO, &mode) == 0;
-    if (status == 0)
+    sockaddr_len *sa = sockaddr_len_unbox(a);
+    if (connect(*socket_unbox(s), (sockaddr *)&(sa->address), sa->address_len) == 0)
     {
         return lean_io_result_mk_ok(lean_box(0));
     }
@@ -543,16 +1066,15 @@ lean_obj_res lean_socket_setblocking(b_lean_obj_arg s, uint8_t blocking, lean_ob
     {
         return lean_io_result_mk_error(get_socket_error());
     }
-#else
-    SOCKET fd = *socket_unbox(s);
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1)
-    {
-        return lean_io_result_mk_error(get_socket_error());
-    }
-    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
-    int status = fcntl(fd, F_SETFL, flags);
-    if (status == 0)
+}
+
+/**
+ * opaque Socket.bind (s : @& Socket) (a : @& SockAddr) : IO Unit
+ */
+lean_obj_res lean_socket_bind(b_lean_obj_arg s, b_lean_obj_arg a, lean_obj_arg w)
+{
+    sockaddr_len *sa = sockaddr_len_unbox(a);
+    if (bind(*socket_unbox(s), (sockaddr *)&(sa->address), sa->address_len) == 0)
     {
         return lean_io_result_mk_ok(lean_box(0));
     }
@@ -560,235 +1082,3518 @@ lean_obj_res lean_socket_setblocking(b_lean_obj_arg s, uint8_t blocking, lean_ob
     {
         return lean_io_result_mk_error(get_socket_error());
     }
-#endif
 }
 
 /**
- * opaque blocking (s : @& Socket) : IO Bool
+ * opaque Socket.listen (s : @& Socket) (n : @& UInt8) : IO Unit
  */
-lean_obj_res lean_socket_getblocking(b_lean_obj_arg s, lean_obj_arg w)
+lean_obj_res lean_socket_listen(b_lean_obj_arg s, uint8_t n, lean_obj_arg w)
 {
-#ifdef _WIN32
-    return return lean_io_result_mk_error(lean_mk_string("Can't check if the socket is blocking on Windows"));
-#else
-    int flags = fcntl(*socket_unbox(s), F_GETFL, 0);
-    if (flags == -1)
+    if (listen(*socket_unbox(s), (int)n) == 0)
     {
-        return lean_io_result_mk_error(get_socket_error());
+        return lean_io_result_mk_ok(lean_box(0));
     }
     else
     {
-        return lean_io_result_mk_ok(lean_box((flags & O_NONBLOCK) == 0));
+        return lean_io_result_mk_error(get_socket_error());
     }
-#endif
 }
 
-uint16_t lean_socket_poll_in(lean_obj_arg unit) { return POLLIN; };
-uint16_t lean_socket_poll_pri(lean_obj_arg unit) { return POLLPRI; };
-uint16_t lean_socket_poll_out(lean_obj_arg unit) { return POLLOUT; };
-uint16_t lean_socket_poll_err(lean_obj_arg unit) { return POLLERR; };
-uint16_t lean_socket_poll_hup(lean_obj_arg unit) { return POLLHUP; };
-uint16_t lean_socket_poll_nval(lean_obj_arg unit) { return POLLNVAL; };
+/**
+ * Accept a connection as a `SockAddr × Socket` pair, `NULL` with `errno` set on failure.
+ */
+static lean_object *socket_accept(b_lean_obj_arg s)
+{
+    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
+    SOCKET *new_fd = malloc(sizeof(SOCKET));
+    // room for any family, IPv6 peers would be truncated to `sizeof(sockaddr)`
+    sal->address_len = sizeof(sockaddr_storage);
+    *new_fd = accept(*socket_unbox(s), (sockaddr *)(&(sal->address)), &(sal->address_len));
+    if (!ISVALIDSOCKET(*new_fd))
+    {
+        int errnum = errno;
+        free(sal);
+        free(new_fd);
+        errno = errnum;
+        return NULL;
+    }
+    lean_object *o = lean_alloc_ctor(0, 2, 0);
+    lean_ctor_set(o, 0, sockaddr_len_box(sal));
+    lean_ctor_set(o, 1, socket_box(new_fd));
+    return o;
+}
 
 /**
- * opaque poll (s : Array Poll) (timeout : UInt32) : IO (Array Poll)
+ * opaque Socket.accept (s : @& Socket) : IO (SockAddr × Socket)
  */
-lean_obj_res lean_socket_poll(lean_obj_arg s, uint32_t timeout, lean_obj_arg w) {
+lean_obj_res lean_socket_accept(b_lean_obj_arg s, lean_obj_arg w)
+{
+    lean_object *o = socket_accept(s);
+    if (o == NULL)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    return lean_io_result_mk_ok(o);
+}
+
+/**
+ * opaque Socket.tryAccept (s : @& Socket) : IO (Option (SockAddr × Socket))
+ */
+lean_obj_res lean_socket_try_accept(b_lean_obj_arg s, lean_obj_arg w)
+{
+    lean_object *o = socket_accept(s);
+    if (o != NULL)
+    {
+        return lean_io_result_mk_ok(lean_option_mk_some(o));
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        return lean_io_result_mk_ok(lean_option_mk_none());
+    }
+    return lean_io_result_mk_error(get_socket_error());
+}
+
+/**
+ * opaque Socket.shutdown (s : @& Socket) (h : ShutdownHow) : IO Unit 
+ */
+lean_obj_res lean_socket_shutdown(b_lean_obj_arg s, uint8_t h, lean_obj_arg w)
+{
+    if (shutdown(*socket_unbox(s), shutdown_how_unbox(h)) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+}
+
+/**
+ * opaque Socket.setLinger (s : @& Socket) (enabled : Bool) (secs : UInt16) : IO Unit
+ */
+lean_obj_res lean_socket_set_linger(b_lean_obj_arg s, uint8_t enabled, uint16_t secs, lean_obj_arg w)
+{
+    struct linger l;
+    l.l_onoff = enabled;
+    l.l_linger = secs;
+    if (setsockopt(*socket_unbox(s), SOL_SOCKET, SO_LINGER, (const char *)&l, sizeof(l)) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+}
+
+/**
+ * opaque Socket.abort (s : @& Socket) : IO Unit
+ */
+lean_obj_res lean_socket_abort(b_lean_obj_arg s, lean_obj_arg w)
+{
+    SOCKET *fd = socket_unbox(s);
+    if (!ISVALIDSOCKET(*fd))
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    // a zero linger timeout makes close() send RST and skip TIME_WAIT
+    struct linger l;
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    if (setsockopt(*fd, SOL_SOCKET, SO_LINGER, (const char *)&l, sizeof(l)) != 0)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    SOCKET closing = *fd;
+    *fd = INVALIDSOCKET;
+    if (CLOSESOCKET(closing) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+}
+
+/**
+ * opaque Socket.send (s : @& Socket) (b : @& ByteArray) : IO USize
+ */
+lean_obj_res lean_socket_send(b_lean_obj_arg s, b_lean_obj_arg b, lean_obj_arg w)
+{
+    lean_sarray_object *arr = lean_to_sarray(b);
+    ssize_t bytes = send(*socket_unbox(s), arr->m_data, arr->m_size, 0);
+    if (bytes >= 0)
+    {
+        return lean_io_result_mk_ok(lean_box_usize(bytes));
+    }
+    else
+    {
+        int errnum = errno;
+        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        {
+            return lean_io_result_mk_ok(lean_box_usize(0));
+        }
+        else
+        {
+            return lean_io_result_mk_error(get_socket_error());
+        }
+    }
+}
+
+/**
+ * opaque Socket.sendto (s : @& Socket) (b : @& ByteArray) (a : @& SockAddr) : IO USize
+ */
+lean_obj_res lean_socket_sendto(b_lean_obj_arg s, b_lean_obj_arg b, b_lean_obj_arg a, lean_obj_arg w)
+{
+    lean_sarray_object *arr = lean_to_sarray(b);
+    sockaddr_len *sal = sockaddr_len_unbox(a);
+    ssize_t bytes = sendto(*socket_unbox(s), arr->m_data, arr->m_size, 0, (sockaddr *)&(sal->address), sal->address_len);
+    if (bytes >= 0)
+    {
+        return lean_io_result_mk_ok(lean_box_usize(bytes));
+    }
+    else
+    {
+        int errnum = errno;
+        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        {
+            return lean_io_result_mk_ok(lean_box_usize(0));
+        }
+        else
+        {
+            return lean_io_result_mk_error(get_socket_error());
+        }
+    }
+}
+
+/**
+ * opaque Socket.sendv (s : @& Socket) (bufs : @& Array ByteArray) : IO USize
+ */
+lean_obj_res lean_socket_sendv(b_lean_obj_arg s, b_lean_obj_arg bufs, lean_obj_arg w)
+{
+    size_t count = lean_array_size(bufs);
 #ifdef _WIN32
-#error TODO
+    WSABUF stack[16];
+    WSABUF *iov = count <= 16 ? stack : malloc(count * sizeof(WSABUF));
+    for (size_t i = 0; i < count; i++)
+    {
+        lean_object *b = lean_array_get_core(bufs, i);
+        iov[i].buf = (char *)lean_sarray_cptr(b);
+        iov[i].len = (ULONG)lean_sarray_size(b);
+    }
+    DWORD sent = 0;
+    int ret = WSASend(*socket_unbox(s), iov, (DWORD)count, &sent, 0, NULL, NULL);
+    ssize_t bytes = ret == 0 ? (ssize_t)sent : -1;
 #else
-    size_t n = lean_array_size(s);
-    struct pollfd * pollfds = malloc(n * sizeof(struct pollfd));
-    for (size_t i = 0; i < n; ++i) {
-        lean_object* lP = lean_array_get_core(s, i);
-        pollfds[i].fd = *socket_unbox(lean_ctor_get(lP, 0));
-        if (lean_unbox(lean_ctor_get(lP, 3)) == 1) {
-            pollfds[i].fd = ~pollfds[i].fd;
+    // a longer vector is sent in part, like any short write
+    if (count > IOV_MAX)
+    {
+        count = IOV_MAX;
+    }
+    struct iovec stack[16];
+    struct iovec *iov = count <= 16 ? stack : malloc(count * sizeof(struct iovec));
+    for (size_t i = 0; i < count; i++)
+    {
+        lean_object *b = lean_array_get_core(bufs, i);
+        iov[i].iov_base = lean_sarray_cptr(b);
+        iov[i].iov_len = lean_sarray_size(b);
+    }
+    ssize_t bytes = writev(*socket_unbox(s), iov, (int)count);
+#endif
+    int errnum = errno;
+    if (iov != stack)
+    {
+        free(iov);
+    }
+    if (bytes >= 0)
+    {
+        return lean_io_result_mk_ok(lean_box_usize(bytes));
+    }
+    errno = errnum;
+    if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+    {
+        return lean_io_result_mk_ok(lean_box_usize(0));
+    }
+    return lean_io_result_mk_error(get_socket_error());
+}
+
+/**
+ * opaque Socket.recv (s : @& Socket) (n : @& USize) : IO (Option ByteArray)
+ */
+lean_obj_res lean_socket_recv(b_lean_obj_arg s, size_t n, lean_obj_arg w)
+{
+    lean_object *arr = lean_alloc_sarray(1, 0, n);
+    ssize_t bytes = recv(*socket_unbox(s), lean_sarray_cptr(arr), n, 0);
+    if (bytes >= 0)
+    {
+        lean_to_sarray(arr)->m_size = bytes;
+        return lean_io_result_mk_ok(lean_option_mk_some(arr));
+    }
+    else
+    {
+        // freeing the buffer may clobber errno
+        int errnum = errno;
+        lean_dec_ref(arr);
+        errno = errnum;
+        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        {
+            return lean_io_result_mk_ok(lean_option_mk_none());
         }
-        pollfds[i].events = (uint16_t)lean_unbox(lean_ctor_get(lP, 1));
-        pollfds[i].revents = 0;
+        else
+        {
+            return lean_io_result_mk_error(get_socket_error());
+        }
+    }
+}
+
+/**
+ * opaque Socket.recvfrom (s : @& Socket) (n : @& USize) : IO (Option (SockAddr × ByteArray))
+ */
+lean_obj_res lean_socket_recvfrom(b_lean_obj_arg s, size_t n, lean_obj_arg w)
+{
+    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
+    sal->address_len = sizeof(sockaddr_storage);
+    lean_object *arr = lean_alloc_sarray(1, 0, n);
+    ssize_t bytes = recvfrom(*socket_unbox(s), lean_sarray_cptr(arr), n, 0, (sockaddr *)&(sal->address), &(sal->address_len));
+    if (bytes >= 0)
+    {
+        lean_to_sarray(arr)->m_size = bytes;
+        lean_object *o = lean_alloc_ctor(0, 2, 0);
+        lean_ctor_set(o, 0, sockaddr_len_box(sal));
+        lean_ctor_set(o, 1, arr);
+        return lean_io_result_mk_ok(lean_option_mk_some(o));
+    }
+    else
+    {
+        int errnum = errno;
+        lean_dec_ref(arr);
+        free(sal);
+        errno = errnum;
+        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        {
+            return lean_io_result_mk_ok(lean_option_mk_none());
+        }
+        else
+        {
+            return lean_io_result_mk_error(get_socket_error());
+        }
+    }
+}
+
+/**
+ * opaque Socket.peer (s : @& Socket) : IO SockAddr
+ */
+lean_obj_res lean_socket_peer(b_lean_obj_arg s, lean_obj_arg w)
+{
+    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
+    sal->address_len = sizeof(sockaddr_storage);
+    int status = getpeername(*socket_unbox(s), (sockaddr *)&(sal->address), &(sal->address_len));
+    if (status == 0)
+    {
+        return lean_io_result_mk_ok(sockaddr_len_box(sal));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+}
+
+/**
+ * opaque setBlocking (s : @& Socket) (blocking : Bool) : IO Unit
+ */
+lean_obj_res lean_socket_setblocking(b_lean_obj_arg s, uint8_t blocking, lean_obj_arg w)
+{
+#ifdef _WIN32
+    SOCKET s = *socket_unbox(s);
+    unsigned long mode = blocking ? 0 : 1;
+    int status = ioctlsocket(*socket_unbox(s), FIONBIO, &mode) == 0;
+    if (status == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    SOCKET fd = *socket_unbox(s);
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    int status = fcntl(fd, F_SETFL, flags);
+    if (status == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#endif
+}
+
+/**
+ * opaque blocking (s : @& Socket) : IO Bool
+ */
+lean_obj_res lean_socket_getblocking(b_lean_obj_arg s, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return return lean_io_result_mk_error(lean_mk_string("Can't check if the socket is blocking on Windows"));
+#else
+    int flags = fcntl(*socket_unbox(s), F_GETFL, 0);
+    if (flags == -1)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    else
+    {
+        return lean_io_result_mk_ok(lean_box((flags & O_NONBLOCK) == 0));
+    }
+#endif
+}
+
+/**
+ * Byte offsets of the scalar fields of `Poll`, which come after its `Socket` field.
+ */
+#define POLL_EVENTS_OFFSET (sizeof(void *))
+#define POLL_REVENTS_OFFSET (sizeof(void *) + sizeof(uint16_t))
+#define POLL_IGNORE_OFFSET (sizeof(void *) + 2 * sizeof(uint16_t))
+#define POLL_SCALAR_SIZE (2 * sizeof(uint16_t) + sizeof(uint8_t))
+
+uint16_t lean_socket_poll_in(lean_obj_arg unit) { return POLLIN; };
+uint16_t lean_socket_poll_pri(lean_obj_arg unit) { return POLLPRI; };
+uint16_t lean_socket_poll_out(lean_obj_arg unit) { return POLLOUT; };
+uint16_t lean_socket_poll_err(lean_obj_arg unit) { return POLLERR; };
+uint16_t lean_socket_poll_hup(lean_obj_arg unit) { return POLLHUP; };
+uint16_t lean_socket_poll_nval(lean_obj_arg unit) { return POLLNVAL; };
+
+/**
+ * opaque poll (s : Array Poll) (timeout : UInt32) : IO (Array Poll)
+ */
+lean_obj_res lean_socket_poll(lean_obj_arg s, uint32_t timeout, lean_obj_arg w) {
+#ifdef _WIN32
+#error TODO
+#else
+    size_t n = lean_array_size(s);
+    struct pollfd * pollfds = malloc(n * sizeof(struct pollfd));
+    for (size_t i = 0; i < n; ++i) {
+        lean_object* lP = lean_array_get_core(s, i);
+        pollfds[i].fd = *socket_unbox(lean_ctor_get(lP, 0));
+        if (lean_ctor_get_uint8(lP, POLL_IGNORE_OFFSET)) {
+            pollfds[i].fd = ~pollfds[i].fd;
+        }
+        pollfds[i].events = lean_ctor_get_uint16(lP, POLL_EVENTS_OFFSET);
+        pollfds[i].revents = 0;
+    }
+    int res = poll(pollfds, n, (int32_t)timeout);
+    if (res < 0) {
+        lean_dec_ref(s);
+        free(pollfds);
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    if (!lean_is_exclusive(s)) {
+        lean_object* sCpy = lean_alloc_array(n, n);
+        for (size_t i = 0; i < n; ++i) {
+            lean_object* lP = lean_array_get_core(s, i);
+            lean_inc(lP);
+            lean_array_set_core(sCpy, i, lP);
+        }
+        lean_dec_ref(s);
+        s = sCpy;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        lean_object* lP = lean_array_get_core(s, i);
+        if (lean_ctor_get_uint8(lP, POLL_IGNORE_OFFSET)) {
+            continue;
+        }
+        if (!lean_is_exclusive(lP)) {
+            // `Poll` is one object field followed by two `UInt16` and a `Bool`
+            lean_object* lPCpy = lean_alloc_ctor(0, 1, POLL_SCALAR_SIZE);
+            lean_object* lSock = lean_ctor_get(lP, 0);
+            lean_inc_ref(lSock);
+            lean_ctor_set(lPCpy, 0, lSock);
+            lean_ctor_set_uint16(lPCpy, POLL_EVENTS_OFFSET, lean_ctor_get_uint16(lP, POLL_EVENTS_OFFSET));
+            lean_ctor_set_uint8(lPCpy, POLL_IGNORE_OFFSET, 0);
+            lean_dec_ref(lP);
+            lean_array_set_core(s, i, lPCpy);
+            lP = lPCpy;
+        }
+        lean_ctor_set_uint16(lP, POLL_REVENTS_OFFSET, (uint16_t)pollfds[i].revents);
+    }
+    free(pollfds);
+    return lean_io_result_mk_ok(s);
+#endif
+}
+
+// ## Socket Options
+
+/**
+ * `setsockopt` wrapped as an `IO Unit` result.
+ */
+static lean_obj_res set_socket_option(SOCKET fd, int level, int name, const void *value, socklen_t len)
+{
+    if (setsockopt(fd, level, name, value, len) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+}
+
+/**
+ * opaque Socket.setReuseAddr (s : @& Socket) (enabled : Bool) : IO Unit
+ */
+lean_obj_res lean_socket_set_reuse_addr(b_lean_obj_arg s, uint8_t enabled, lean_obj_arg w)
+{
+    int value = enabled;
+    return set_socket_option(*socket_unbox(s), SOL_SOCKET, SO_REUSEADDR, (const char *)&value, sizeof(value));
+}
+
+/**
+ * opaque Socket.setReusePort (s : @& Socket) (enabled : Bool) : IO Unit
+ */
+lean_obj_res lean_socket_set_reuse_port(b_lean_obj_arg s, uint8_t enabled, lean_obj_arg w)
+{
+#ifdef SO_REUSEPORT
+    int value = enabled;
+    return set_socket_option(*socket_unbox(s), SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+#else
+    return lean_io_result_mk_error(get_unsupported_error("SO_REUSEPORT"));
+#endif
+}
+
+/**
+ * opaque Socket.incomingCpu (s : @& Socket) : IO (Option UInt32)
+ */
+lean_obj_res lean_socket_get_incoming_cpu(b_lean_obj_arg s, lean_obj_arg w)
+{
+#if defined(__linux__) && defined(SO_INCOMING_CPU)
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(*socket_unbox(s), SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+    {
+        if (cpu < 0)
+        {
+            return lean_io_result_mk_ok(lean_option_mk_none());
+        }
+        return lean_io_result_mk_ok(lean_option_mk_some(lean_box_uint32((uint32_t)cpu)));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("SO_INCOMING_CPU"));
+#endif
+}
+
+/**
+ * opaque Socket.setIncomingCpu (s : @& Socket) (cpu : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_set_incoming_cpu(b_lean_obj_arg s, uint32_t cpu, lean_obj_arg w)
+{
+#if defined(__linux__) && defined(SO_INCOMING_CPU)
+    int value = (int)cpu;
+    if (setsockopt(*socket_unbox(s), SOL_SOCKET, SO_INCOMING_CPU, &value, sizeof(value)) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("SO_INCOMING_CPU"));
+#endif
+}
+
+/**
+ * opaque Socket.setBusyPoll (s : @& Socket) (usecs : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_set_busy_poll(b_lean_obj_arg s, uint32_t usecs, lean_obj_arg w)
+{
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    int value = (int)usecs;
+    if (setsockopt(*socket_unbox(s), SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("SO_BUSY_POLL"));
+#endif
+}
+
+/**
+ * opaque Socket.setPreferBusyPoll (s : @& Socket) (prefer : Bool) : IO Unit
+ */
+lean_obj_res lean_socket_set_prefer_busy_poll(b_lean_obj_arg s, uint8_t prefer, lean_obj_arg w)
+{
+#ifdef __linux__
+    int value = prefer;
+    if (setsockopt(*socket_unbox(s), SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value)) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("SO_PREFER_BUSY_POLL"));
+#endif
+}
+
+/**
+ * opaque Socket.attachFilter (s : @& Socket) (prog : @& ByteArray) : IO Unit
+ *
+ * `prog` holds 8 bytes per instruction: `code` (u16), `jt`, `jf` (u8), `k` (u32),
+ * multi-byte fields little endian regardless of the host.
+ */
+lean_obj_res lean_socket_attach_filter(b_lean_obj_arg s, b_lean_obj_arg prog, lean_obj_arg w)
+{
+#if defined(__linux__) && defined(SO_ATTACH_FILTER)
+    size_t size = lean_sarray_size(prog);
+    const uint8_t *bytes = lean_sarray_cptr(prog);
+    if (size == 0 || size % 8 != 0 || size / 8 > BPF_MAXINSNS)
+    {
+        return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("Socket.attachFilter: invalid program size")));
+    }
+    size_t n = size / 8;
+    struct sock_filter *filter = malloc(n * sizeof(struct sock_filter));
+    for (size_t i = 0; i < n; ++i)
+    {
+        const uint8_t *b = bytes + i * 8;
+        filter[i].code = (uint16_t)(b[0] | (b[1] << 8));
+        filter[i].jt = b[2];
+        filter[i].jf = b[3];
+        filter[i].k = (uint32_t)b[4] | ((uint32_t)b[5] << 8) | ((uint32_t)b[6] << 16) | ((uint32_t)b[7] << 24);
+    }
+    struct sock_fprog fprog;
+    fprog.len = (unsigned short)n;
+    fprog.filter = filter;
+    lean_obj_res res = set_socket_option(*socket_unbox(s), SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+    free(filter);
+    return res;
+#else
+    return lean_io_result_mk_error(get_unsupported_error("SO_ATTACH_FILTER"));
+#endif
+}
+
+/**
+ * opaque Socket.detachFilter (s : @& Socket) : IO Unit
+ */
+lean_obj_res lean_socket_detach_filter(b_lean_obj_arg s, lean_obj_arg w)
+{
+#if defined(__linux__) && defined(SO_DETACH_FILTER)
+    int value = 0;
+    return set_socket_option(*socket_unbox(s), SOL_SOCKET, SO_DETACH_FILTER, &value, sizeof(value));
+#else
+    return lean_io_result_mk_error(get_unsupported_error("SO_DETACH_FILTER"));
+#endif
+}
+
+/**
+ * opaque Socket.setDeferAccept (s : @& Socket) (secs : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_set_defer_accept(b_lean_obj_arg s, uint32_t secs, lean_obj_arg w)
+{
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+    int value = (int)secs;
+    return set_socket_option(*socket_unbox(s), IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value));
+#elif defined(SO_ACCEPTFILTER)
+    // BSD accept filters have no timeout, any non-zero value enables `dataready`
+    SOCKET fd = *socket_unbox(s);
+    if (secs == 0)
+    {
+        return set_socket_option(fd, SOL_SOCKET, SO_ACCEPTFILTER, NULL, 0);
+    }
+    struct accept_filter_arg afa;
+    memset(&afa, 0, sizeof(afa));
+    strcpy(afa.af_name, "dataready");
+    return set_socket_option(fd, SOL_SOCKET, SO_ACCEPTFILTER, &afa, sizeof(afa));
+#else
+    return lean_io_result_mk_error(get_unsupported_error("TCP_DEFER_ACCEPT"));
+#endif
+}
+
+/**
+ * opaque Socket.deferAccept (s : @& Socket) : IO UInt32
+ */
+lean_obj_res lean_socket_get_defer_accept(b_lean_obj_arg s, lean_obj_arg w)
+{
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+    int value = 0;
+    socklen_t len = sizeof(value);
+    if (getsockopt(*socket_unbox(s), IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, &len) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box_uint32((uint32_t)value));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("TCP_DEFER_ACCEPT"));
+#endif
+}
+
+// ## Busy Polling
+
+/**
+ * Monotonic clock in nanoseconds.
+ */
+static uint64_t monotonic_nanos()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * opaque Socket.recvSpin (s : @& Socket) (n : @& USize) (spinNanos : UInt64) : IO (Option ByteArray)
+ *
+ * Polls the socket with non-blocking `recv` calls for up to `spinNanos`,
+ * then falls back to a plain `recv` which blocks if the socket is blocking.
+ */
+lean_obj_res lean_socket_recv_spin(b_lean_obj_arg s, size_t n, uint64_t spin_nanos, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("Socket.recvSpin"));
+#else
+    SOCKET fd = *socket_unbox(s);
+    lean_object *arr = lean_alloc_sarray(1, 0, n);
+    ssize_t bytes = -1;
+    uint64_t deadline = monotonic_nanos() + spin_nanos;
+    do
+    {
+        bytes = recv(fd, lean_sarray_cptr(arr), n, MSG_DONTWAIT);
+        if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            break;
+        }
+    } while (monotonic_nanos() < deadline);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        bytes = recv(fd, lean_sarray_cptr(arr), n, 0);
+    }
+    if (bytes >= 0)
+    {
+        lean_to_sarray(arr)->m_size = bytes;
+        return lean_io_result_mk_ok(lean_option_mk_some(arr));
+    }
+    else
+    {
+        // freeing the buffer may clobber errno
+        int errnum = errno;
+        lean_dec_ref(arr);
+        errno = errnum;
+        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        {
+            return lean_io_result_mk_ok(lean_option_mk_none());
+        }
+        else
+        {
+            return lean_io_result_mk_error(get_socket_error());
+        }
+    }
+#endif
+}
+
+// ## Multicast
+
+/**
+ * Address family of a socket, `AF_UNSPEC` if it can't be determined.
+ */
+static int socket_family(SOCKET fd)
+{
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    memset(&ss, 0, sizeof(ss));
+    if (getsockname(fd, (sockaddr *)&ss, &len) != 0)
+    {
+        return AF_UNSPEC;
+    }
+    return ss.ss_family;
+}
+
+static lean_obj_res multicast_family_error()
+{
+    return lean_mk_io_user_error(lean_mk_string("multicast requires an AF_INET or AF_INET6 address"));
+}
+
+/**
+ * Join or leave (`join` = 0) a multicast group, optionally restricted to a source.
+ */
+static lean_obj_res multicast_membership(b_lean_obj_arg s, b_lean_obj_arg g, b_lean_obj_arg src, uint32_t iface, int join)
+{
+#if defined(MCAST_JOIN_GROUP) && defined(MCAST_JOIN_SOURCE_GROUP)
+    sockaddr_len *group = sockaddr_len_unbox(g);
+    int level;
+    switch (group->address.ss_family)
+    {
+    case AF_INET:
+        level = IPPROTO_IP;
+        break;
+    case AF_INET6:
+        level = IPPROTO_IPV6;
+        break;
+    default:
+        return lean_io_result_mk_error(multicast_family_error());
+    }
+    if (src == NULL)
+    {
+        struct group_req req;
+        memset(&req, 0, sizeof(req));
+        req.gr_interface = iface;
+        memcpy(&req.gr_group, &group->address, sizeof(sockaddr_storage));
+        return set_socket_option(*socket_unbox(s), level, join ? MCAST_JOIN_GROUP : MCAST_LEAVE_GROUP, &req, sizeof(req));
+    }
+    else
+    {
+        sockaddr_len *source = sockaddr_len_unbox(src);
+        if (source->address.ss_family != group->address.ss_family)
+        {
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("multicast source and group families differ")));
+        }
+        struct group_source_req req;
+        memset(&req, 0, sizeof(req));
+        req.gsr_interface = iface;
+        memcpy(&req.gsr_group, &group->address, sizeof(sockaddr_storage));
+        memcpy(&req.gsr_source, &source->address, sizeof(sockaddr_storage));
+        return set_socket_option(*socket_unbox(s), level, join ? MCAST_JOIN_SOURCE_GROUP : MCAST_LEAVE_SOURCE_GROUP, &req, sizeof(req));
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("Multicast group membership"));
+#endif
+}
+
+/**
+ * opaque Socket.joinGroup (s : @& Socket) (group : @& SockAddr) (iface : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_join_group(b_lean_obj_arg s, b_lean_obj_arg g, uint32_t iface, lean_obj_arg w)
+{
+    return multicast_membership(s, g, NULL, iface, 1);
+}
+
+/**
+ * opaque Socket.leaveGroup (s : @& Socket) (group : @& SockAddr) (iface : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_leave_group(b_lean_obj_arg s, b_lean_obj_arg g, uint32_t iface, lean_obj_arg w)
+{
+    return multicast_membership(s, g, NULL, iface, 0);
+}
+
+/**
+ * opaque Socket.joinSourceGroup (s : @& Socket) (group source : @& SockAddr) (iface : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_join_source_group(b_lean_obj_arg s, b_lean_obj_arg g, b_lean_obj_arg src, uint32_t iface, lean_obj_arg w)
+{
+    return multicast_membership(s, g, src, iface, 1);
+}
+
+/**
+ * opaque Socket.leaveSourceGroup (s : @& Socket) (group source : @& SockAddr) (iface : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_leave_source_group(b_lean_obj_arg s, b_lean_obj_arg g, b_lean_obj_arg src, uint32_t iface, lean_obj_arg w)
+{
+    return multicast_membership(s, g, src, iface, 0);
+}
+
+/**
+ * opaque Socket.setMulticastTtl (s : @& Socket) (ttl : UInt8) : IO Unit
+ */
+lean_obj_res lean_socket_set_multicast_ttl(b_lean_obj_arg s, uint8_t ttl, lean_obj_arg w)
+{
+    SOCKET fd = *socket_unbox(s);
+    switch (socket_family(fd))
+    {
+    case AF_INET:
+    {
+#if defined(__linux__) || defined(_WIN32)
+        int value = ttl;
+#else
+        unsigned char value = ttl;
+#endif
+        return set_socket_option(fd, IPPROTO_IP, IP_MULTICAST_TTL, (const char *)&value, sizeof(value));
+    }
+    case AF_INET6:
+    {
+        int value = ttl;
+        return set_socket_option(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (const char *)&value, sizeof(value));
+    }
+    default:
+        return lean_io_result_mk_error(multicast_family_error());
+    }
+}
+
+/**
+ * opaque Socket.setMulticastLoop (s : @& Socket) (loop : Bool) : IO Unit
+ */
+lean_obj_res lean_socket_set_multicast_loop(b_lean_obj_arg s, uint8_t loop, lean_obj_arg w)
+{
+    SOCKET fd = *socket_unbox(s);
+    switch (socket_family(fd))
+    {
+    case AF_INET:
+    {
+#if defined(__linux__) || defined(_WIN32)
+        int value = loop;
+#else
+        unsigned char value = loop;
+#endif
+        return set_socket_option(fd, IPPROTO_IP, IP_MULTICAST_LOOP, (const char *)&value, sizeof(value));
+    }
+    case AF_INET6:
+    {
+        unsigned int value = loop;
+        return set_socket_option(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (const char *)&value, sizeof(value));
+    }
+    default:
+        return lean_io_result_mk_error(multicast_family_error());
+    }
+}
+
+/**
+ * opaque Socket.setMulticastInterface (s : @& Socket) (iface : UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_set_multicast_interface(b_lean_obj_arg s, uint32_t iface, lean_obj_arg w)
+{
+    SOCKET fd = *socket_unbox(s);
+    switch (socket_family(fd))
+    {
+    case AF_INET:
+    {
+#if defined(__linux__)
+        struct ip_mreqn req;
+        memset(&req, 0, sizeof(req));
+        req.imr_ifindex = (int)iface;
+        return set_socket_option(fd, IPPROTO_IP, IP_MULTICAST_IF, &req, sizeof(req));
+#elif defined(_WIN32)
+        // an address in 0.0.0.0/8 is interpreted as an interface index
+        DWORD value = htonl(iface);
+        return set_socket_option(fd, IPPROTO_IP, IP_MULTICAST_IF, (const char *)&value, sizeof(value));
+#else
+        return lean_io_result_mk_error(get_unsupported_error("IP_MULTICAST_IF by interface index"));
+#endif
+    }
+    case AF_INET6:
+    {
+        unsigned int value = iface;
+        return set_socket_option(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, (const char *)&value, sizeof(value));
+    }
+    default:
+        return lean_io_result_mk_error(multicast_family_error());
+    }
+}
+
+// ## Ancillary Data
+
+/**
+ * Box a copy of a socket address as `SockAddr`.
+ */
+static lean_object *sockaddr_copy_box(const void *address, socklen_t len)
+{
+    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
+    memset(sal, 0, sizeof(sockaddr_len));
+    if (len > sizeof(sockaddr_storage))
+    {
+        len = sizeof(sockaddr_storage);
+    }
+    memcpy(&sal->address, address, len);
+    sal->address_len = len;
+    return sockaddr_len_box(sal);
+}
+
+#ifndef _WIN32
+
+/**
+ * `ControlMessage.pktInfo`, which holds a `SockAddr` and the interface index as a scalar.
+ */
+static lean_object *control_pktinfo_box(lean_object *addr, uint32_t iface)
+{
+    lean_object *o = lean_alloc_ctor(0, 1, sizeof(uint32_t));
+    lean_ctor_set(o, 0, addr);
+    lean_ctor_set_uint32(o, sizeof(void *), iface);
+    return o;
+}
+
+/**
+ * `ControlMessage.ttl` (`tag` = 2) and `ControlMessage.tos` (`tag` = 3).
+ */
+static lean_object *control_byte_box(unsigned tag, uint8_t value)
+{
+    lean_object *o = lean_alloc_ctor(tag, 0, sizeof(uint8_t));
+    lean_ctor_set_uint8(o, 0, value);
+    return o;
+}
+
+/**
+ * Decode one received control message, `NULL` if it isn't one `ControlMessage` covers.
+ */
+static lean_object *control_message_box(struct cmsghdr *cmsg)
+{
+    const void *data = CMSG_DATA(cmsg);
+    if (cmsg->cmsg_level == IPPROTO_IP)
+    {
+        switch (cmsg->cmsg_type)
+        {
+#ifdef IP_PKTINFO
+        case IP_PKTINFO:
+        {
+            struct in_pktinfo info;
+            memcpy(&info, data, sizeof(info));
+            sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            sin.sin_addr = info.ipi_addr;
+            return control_pktinfo_box(sockaddr_copy_box(&sin, sizeof(sin)), (uint32_t)info.ipi_ifindex);
+        }
+#endif
+#ifdef IP_ORIGDSTADDR
+        case IP_ORIGDSTADDR:
+        {
+            lean_object *o = lean_alloc_ctor(1, 1, 0);
+            lean_ctor_set(o, 0, sockaddr_copy_box(data, sizeof(sockaddr_in)));
+            return o;
+        }
+#endif
+        case IP_TTL:
+        {
+            int value;
+            memcpy(&value, data, sizeof(value));
+            return control_byte_box(2, (uint8_t)value);
+        }
+        case IP_TOS:
+            return control_byte_box(3, *(const uint8_t *)data);
+        }
+    }
+    else if (cmsg->cmsg_level == IPPROTO_IPV6)
+    {
+        int value;
+        switch (cmsg->cmsg_type)
+        {
+#ifdef IPV6_PKTINFO
+        case IPV6_PKTINFO:
+        {
+            struct in6_pktinfo info;
+            memcpy(&info, data, sizeof(info));
+            sockaddr_in6 sin6;
+            memset(&sin6, 0, sizeof(sin6));
+            sin6.sin6_family = AF_INET6;
+            sin6.sin6_addr = info.ipi6_addr;
+            return control_pktinfo_box(sockaddr_copy_box(&sin6, sizeof(sin6)), (uint32_t)info.ipi6_ifindex);
+        }
+#endif
+#ifdef IPV6_ORIGDSTADDR
+        case IPV6_ORIGDSTADDR:
+        {
+            lean_object *o = lean_alloc_ctor(1, 1, 0);
+            lean_ctor_set(o, 0, sockaddr_copy_box(data, sizeof(sockaddr_in6)));
+            return o;
+        }
+#endif
+        case IPV6_HOPLIMIT:
+            memcpy(&value, data, sizeof(value));
+            return control_byte_box(2, (uint8_t)value);
+        case IPV6_TCLASS:
+            memcpy(&value, data, sizeof(value));
+            return control_byte_box(3, (uint8_t)value);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Socket option enabling reception of a `ControlKind` for the given family, `-1` if unavailable.
+ */
+static int control_kind_option(uint8_t kind, int family, int *level)
+{
+    if (family == AF_INET6)
+    {
+        *level = IPPROTO_IPV6;
+        switch (kind)
+        {
+#ifdef IPV6_RECVPKTINFO
+        case 0:
+            return IPV6_RECVPKTINFO;
+#endif
+#ifdef IPV6_RECVORIGDSTADDR
+        case 1:
+            return IPV6_RECVORIGDSTADDR;
+#endif
+        case 2:
+            return IPV6_RECVHOPLIMIT;
+        case 3:
+            return IPV6_RECVTCLASS;
+        }
+    }
+    else
+    {
+        *level = IPPROTO_IP;
+        switch (kind)
+        {
+#ifdef IP_PKTINFO
+        case 0:
+            return IP_PKTINFO;
+#endif
+#ifdef IP_RECVORIGDSTADDR
+        case 1:
+            return IP_RECVORIGDSTADDR;
+#endif
+        case 2:
+            return IP_RECVTTL;
+        case 3:
+            return IP_RECVTOS;
+        }
+    }
+    return -1;
+}
+
+#endif
+
+/**
+ * opaque Socket.setRecvControl (s : @& Socket) (kind : ControlKind) (enabled : Bool) : IO Unit
+ */
+lean_obj_res lean_socket_set_recv_control(b_lean_obj_arg s, uint8_t kind, uint8_t enabled, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("Socket.setRecvControl"));
+#else
+    SOCKET fd = *socket_unbox(s);
+    int level;
+    int name = control_kind_option(kind, socket_family(fd), &level);
+    if (name < 0)
+    {
+        return lean_io_result_mk_error(get_unsupported_error("This control message"));
+    }
+    int value = enabled;
+    return set_socket_option(fd, level, name, &value, sizeof(value));
+#endif
+}
+
+/**
+ * opaque Socket.recvMsg (s : @& Socket) (n : @& USize) (controlLen : @& USize) : IO (Option Message)
+ */
+lean_obj_res lean_socket_recvmsg(b_lean_obj_arg s, size_t n, size_t control_len, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("Socket.recvMsg"));
+#else
+    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
+    lean_object *arr = lean_alloc_sarray(1, 0, n);
+    // `uint64_t` storage keeps the buffer aligned for `struct cmsghdr`
+    uint64_t *control = malloc(control_len + sizeof(uint64_t));
+    struct iovec iov;
+    iov.iov_base = lean_sarray_cptr(arr);
+    iov.iov_len = n;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sal->address;
+    msg.msg_namelen = sizeof(sockaddr_storage);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = control_len;
+    ssize_t bytes = recvmsg(*socket_unbox(s), &msg, 0);
+    if (bytes < 0)
+    {
+        int errnum = errno;
+        lean_dec_ref(arr);
+        free(sal);
+        free(control);
+        errno = errnum;
+        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        {
+            return lean_io_result_mk_ok(lean_option_mk_none());
+        }
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    lean_to_sarray(arr)->m_size = bytes;
+    sal->address_len = msg.msg_namelen;
+    lean_object *messages = lean_mk_empty_array();
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        lean_object *m = control_message_box(cmsg);
+        if (m != NULL)
+        {
+            messages = lean_array_push(messages, m);
+        }
+    }
+    free(control);
+    lean_object *o = lean_alloc_ctor(0, 3, 0);
+    lean_ctor_set(o, 0, arr);
+    lean_ctor_set(o, 1, sockaddr_len_box(sal));
+    lean_ctor_set(o, 2, messages);
+    return lean_io_result_mk_ok(lean_option_mk_some(o));
+#endif
+}
+
+/**
+ * opaque Socket.sendMsg (s : @& Socket) (b : @& ByteArray) (a : @& Option SockAddr) (control : @& Array ControlMessage) : IO USize
+ */
+lean_obj_res lean_socket_sendmsg(b_lean_obj_arg s, b_lean_obj_arg b, b_lean_obj_arg a, b_lean_obj_arg cs, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("Socket.sendMsg"));
+#else
+    SOCKET fd = *socket_unbox(s);
+    int family = socket_family(fd);
+    size_t count = lean_array_size(cs);
+    size_t control_len = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        lean_object *c = lean_array_get_core(cs, i);
+        switch (lean_obj_tag(c))
+        {
+        case 0:
+            control_len += family == AF_INET6 ? CMSG_SPACE(sizeof(struct in6_pktinfo)) : CMSG_SPACE(sizeof(struct in_pktinfo));
+            break;
+        case 1:
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("Socket.sendMsg: origDstAddr can only be received")));
+        default:
+            control_len += CMSG_SPACE(sizeof(int));
+            break;
+        }
+    }
+    uint64_t *control = control_len ? calloc(1, control_len + sizeof(uint64_t)) : NULL;
+    lean_sarray_object *arr = lean_to_sarray(b);
+    struct iovec iov;
+    iov.iov_base = arr->m_data;
+    iov.iov_len = arr->m_size;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    if (!lean_is_scalar(a))
+    {
+        sockaddr_len *sal = sockaddr_len_unbox(lean_ctor_get(a, 0));
+        msg.msg_name = &sal->address;
+        msg.msg_namelen = sal->address_len;
+    }
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = control_len;
+    struct cmsghdr *cmsg = control_len ? CMSG_FIRSTHDR(&msg) : NULL;
+    for (size_t i = 0; i < count && cmsg != NULL; ++i, cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        lean_object *c = lean_array_get_core(cs, i);
+        unsigned tag = lean_obj_tag(c);
+        if (tag == 0)
+        {
+            sockaddr_len *local = sockaddr_len_unbox(lean_ctor_get(c, 0));
+            uint32_t iface = lean_ctor_get_uint32(c, sizeof(void *));
+            if (family == AF_INET6)
+            {
+                struct in6_pktinfo info;
+                memset(&info, 0, sizeof(info));
+                if (local->address.ss_family == AF_INET6)
+                {
+                    info.ipi6_addr = ((sockaddr_in6 *)&local->address)->sin6_addr;
+                }
+                info.ipi6_ifindex = iface;
+                cmsg->cmsg_level = IPPROTO_IPV6;
+                cmsg->cmsg_type = IPV6_PKTINFO;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+                memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+            }
+            else
+            {
+#ifdef IP_PKTINFO
+                struct in_pktinfo info;
+                memset(&info, 0, sizeof(info));
+                if (local->address.ss_family == AF_INET)
+                {
+                    info.ipi_spec_dst = ((sockaddr_in *)&local->address)->sin_addr;
+                }
+                info.ipi_ifindex = (int)iface;
+                cmsg->cmsg_level = IPPROTO_IP;
+                cmsg->cmsg_type = IP_PKTINFO;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+                memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+#endif
+            }
+        }
+        else
+        {
+            int value = lean_ctor_get_uint8(c, 0);
+            cmsg->cmsg_level = family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+            if (tag == 2)
+            {
+                cmsg->cmsg_type = family == AF_INET6 ? IPV6_HOPLIMIT : IP_TTL;
+            }
+            else
+            {
+                cmsg->cmsg_type = family == AF_INET6 ? IPV6_TCLASS : IP_TOS;
+            }
+            cmsg->cmsg_len = CMSG_LEN(sizeof(value));
+            memcpy(CMSG_DATA(cmsg), &value, sizeof(value));
+        }
+    }
+    ssize_t bytes = sendmsg(fd, &msg, 0);
+    free(control);
+    if (bytes >= 0)
+    {
+        return lean_io_result_mk_ok(lean_box_usize(bytes));
+    }
+    else
+    {
+        int errnum = errno;
+        if (errnum == EAGAIN || errnum == EWOULDBLOCK)
+        {
+            return lean_io_result_mk_ok(lean_box_usize(0));
+        }
+        else
+        {
+            return lean_io_result_mk_error(get_socket_error());
+        }
+    }
+#endif
+}
+
+// ## SockAddr
+
+/**
+ * opaque mk
+  (host : @& String)
+  (port : @& String)
+  (family : AddressFamily := AddressFamily.unspecified)
+  (type : SockType := SockType.unspecified)
+  : IO SockAddr
+ */
+lean_obj_res lean_sockaddr_mk(b_lean_obj_arg h, b_lean_obj_arg p, uint8_t f, uint8_t t, lean_obj_arg w)
+{
+    const char *host = lean_string_cstr(h);
+    const char *port = lean_string_cstr(p);
+    int family = address_family_unbox(f);
+    int type = sock_type_unbox(t);
+    addrinfo hints;
+    addrinfo *ai_res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = family;
+    hints.ai_socktype = type;
+    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
+    int status = getaddrinfo(host, port, &hints, &ai_res);
+    if (status < 0)
+    {
+#ifdef _WIN32
+        int errnum = WSAGetLastError();
+        wchar_t *s = NULL;
+        FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                       NULL, errnum,
+                       MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                       (LPWSTR)&s, 0, NULL);
+        char *err_str;
+        wcstombs(err_str, s, 100);
+        lean_object *details = lean_mk_string(err_str);
+        LocalFree(s);
+#else
+        lean_object *details = lean_mk_string(gai_strerror(status));
+#endif
+        return lean_io_result_mk_error(lean_mk_io_user_error(details));
+    }
+    sal->address_len = ai_res->ai_addrlen;
+    sal->address = *(sockaddr_storage *)(ai_res->ai_addr);
+    freeaddrinfo(ai_res);
+    return lean_io_result_mk_ok(sockaddr_len_box(sal));
+}
+
+/**
+ * opaque Sock.family (a : @&SockAddr) : Option AddressFamily
+ */
+lean_obj_res lean_sockaddr_family(b_lean_obj_arg a, lean_obj_arg w)
+{
+    switch (sockaddr_len_unbox(a)->address.ss_family)
+    {
+    case AF_UNSPEC:
+        return lean_option_mk_some(lean_box(0));
+    case AF_INET:
+        return lean_option_mk_some(lean_box(1));
+    case AF_INET6:
+        return lean_option_mk_some(lean_box(2));
+    default:
+        return lean_option_mk_none();
+    }
+}
+
+/**
+ * opaque Sock.port (a : @&SockAddr) : Option UInt16
+ */
+lean_obj_res lean_sockaddr_port(b_lean_obj_arg a, lean_obj_arg w)
+{
+    lean_object *o;
+    sockaddr_len *sa = sockaddr_len_unbox(a);
+    if (sa->address.ss_family == AF_INET)
+    {
+        o = lean_alloc_ctor(1, 1, 0);
+        lean_ctor_set(o, 0, lean_box(ntohs(((sockaddr_in *)&(sa->address))->sin_port)));
+    }
+    else if (sa->address.ss_family == AF_INET6)
+    {
+        o = lean_alloc_ctor(1, 1, 0);
+        lean_ctor_set(o, 0, lean_box(ntohs(((sockaddr_in6 *)&(sa->address))->sin6_port)));
+    }
+    else
+    {
+        o = lean_alloc_ctor(0, 0, 0);
+    }
+    return o;
+}
+
+/**
+ * opaque SockAddr.host (a : @&SockAddr) : Option String
+ */
+lean_obj_res lean_sockaddr_host(b_lean_obj_arg a, lean_obj_arg w)
+{
+    lean_object *o;
+    sockaddr_len *sa = sockaddr_len_unbox(a);
+    if (sa->address.ss_family == AF_INET)
+    {
+        char ip4[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(((sockaddr_in *)&(sa->address))->sin_addr), ip4, INET_ADDRSTRLEN);
+        o = lean_alloc_ctor(1, 1, 0);
+        lean_ctor_set(o, 0, lean_mk_string(ip4));
+    }
+    else if (sa->address.ss_family == AF_INET6)
+    {
+        char ip6[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &(((sockaddr_in6 *)&(sa->address))->sin6_addr), ip6, INET6_ADDRSTRLEN);
+        o = lean_alloc_ctor(1, 1, 0);
+        lean_ctor_set(o, 0, lean_mk_string(ip6));
+    }
+    else
+    {
+        o = lean_alloc_ctor(0, 0, 0);
+    }
+    return o;
+}
+
+/**
+ * opaque beq (a1 a2 : @& SockAddr) : Bool
+ */
+uint8_t lean_sockaddr_beq(b_lean_obj_arg a1, b_lean_obj_arg a2) {
+    sockaddr_len* a1s = sockaddr_len_unbox(a1);
+    sockaddr_len* a2s = sockaddr_len_unbox(a2);
+    if (a1s->address.ss_family != a2s->address.ss_family)
+        return 0;
+    switch (a1s->address.ss_family) {
+        case AF_INET: {
+            sockaddr_in* a1i = (sockaddr_in *)&(a1s->address);
+            sockaddr_in* a2i = (sockaddr_in *)&(a2s->address);
+            return a1i->sin_addr.s_addr == a2i->sin_addr.s_addr &&
+                a1i->sin_port == a2i->sin_port;
+        }
+        case AF_INET6: {
+            sockaddr_in6* a1i = (sockaddr_in6 *)&(a1s->address);
+            sockaddr_in6* a2i = (sockaddr_in6 *)&(a2s->address);
+            return a1i->sin6_port == a2i->sin6_port &&
+                memcmp(&a1i->sin6_addr, &a2i->sin6_addr, sizeof(a1i->sin6_addr)) == 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+/**
+ * opaque SockAddr.ofBytes (ip : @& ByteArray) (port : UInt16) : Option SockAddr
+ */
+lean_obj_res lean_sockaddr_of_bytes(b_lean_obj_arg ip, uint16_t port)
+{
+    size_t size = lean_sarray_size(ip);
+    if (size != 4 && size != 16)
+    {
+        return lean_option_mk_none();
+    }
+    sockaddr_len *sal = calloc(1, sizeof(sockaddr_len));
+    if (size == 4)
+    {
+        sockaddr_in *in = (sockaddr_in *)&sal->address;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        memcpy(&in->sin_addr, lean_sarray_cptr(ip), 4);
+        sal->address_len = sizeof(sockaddr_in);
+    }
+    else
+    {
+        sockaddr_in6 *in6 = (sockaddr_in6 *)&sal->address;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        memcpy(&in6->sin6_addr, lean_sarray_cptr(ip), 16);
+        sal->address_len = sizeof(sockaddr_in6);
+    }
+    return lean_option_mk_some(sockaddr_len_box(sal));
+}
+
+/**
+ * opaque SockAddr.parseIP (s : @& String) : Option ByteArray
+ */
+lean_obj_res lean_sockaddr_parse_ip(b_lean_obj_arg s)
+{
+    uint8_t buffer[16];
+    const char *text = lean_string_cstr(s);
+    size_t size;
+    if (inet_pton(AF_INET, text, buffer) == 1)
+    {
+        size = 4;
+    }
+    else if (inet_pton(AF_INET6, text, buffer) == 1)
+    {
+        size = 16;
+    }
+    else
+    {
+        return lean_option_mk_none();
+    }
+    lean_object *bytes = lean_alloc_sarray(1, size, size);
+    memcpy(lean_sarray_cptr(bytes), buffer, size);
+    return lean_option_mk_some(bytes);
+}
+
+// ## HandleTable
+
+/**
+ * opaque HandleTable.mk (capacity : UInt32) : IO HandleTable
+ */
+lean_obj_res lean_handle_table_mk(uint32_t capacity, lean_obj_arg w)
+{
+    handle_table *t = malloc(sizeof(handle_table));
+    t->capacity = capacity ? capacity : 1;
+    t->slots = calloc(t->capacity, sizeof(handle_slot));
+    t->size = 0;
+    if (t->slots == NULL)
+    {
+        free(t);
+        errno = ENOMEM;
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    MUTEX_INIT(&t->lock);
+    return lean_io_result_mk_ok(lean_alloc_external(g_handle_table_external_class, t));
+}
+
+/**
+ * Whether the socket of slot `index` is still open on that descriptor. A socket closed while
+ * registered leaves its slot behind, and the descriptor may have been reused since.
+ */
+static int handle_slot_live(const handle_slot *slot, size_t index)
+{
+    return slot->socket != NULL && *socket_unbox(slot->socket) == (SOCKET)index;
+}
+
+/**
+ * Look up the slot referenced by `token`, `NULL` if the token is stale. The table lock must be held.
+ */
+static handle_slot *handle_table_slot(handle_table *t, uint64_t token)
+{
+    size_t index = (size_t)(token & 0xffffffffu);
+    if (index >= t->capacity)
+    {
+        return NULL;
+    }
+    handle_slot *slot = &t->slots[index];
+    if (slot->socket == NULL || slot->generation != (uint32_t)(token >> 32))
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+/**
+ * opaque HandleTable.insert (t : @& HandleTable) (s : Socket) : IO UInt64
+ */
+lean_obj_res lean_handle_table_insert(b_lean_obj_arg tbl, lean_obj_arg s, lean_obj_arg w)
+{
+    handle_table *t = (handle_table *)lean_get_external_data(tbl);
+    SOCKET fd = *socket_unbox(s);
+    if (!ISVALIDSOCKET(fd))
+    {
+        lean_dec(s);
+        return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("HandleTable.insert: socket is closed")));
+    }
+    size_t index = (size_t)fd;
+    MUTEX_LOCK(&t->lock);
+    if (index >= t->capacity)
+    {
+        size_t capacity = t->capacity;
+        while (capacity <= index)
+        {
+            capacity *= 2;
+        }
+        handle_slot *slots = realloc(t->slots, capacity * sizeof(handle_slot));
+        if (slots == NULL)
+        {
+            MUTEX_UNLOCK(&t->lock);
+            lean_dec(s);
+            errno = ENOMEM;
+            return lean_io_result_mk_error(get_socket_error());
+        }
+        memset(slots + t->capacity, 0, (capacity - t->capacity) * sizeof(handle_slot));
+        t->slots = slots;
+        t->capacity = capacity;
+    }
+    handle_slot *slot = &t->slots[index];
+    lean_object *stale = NULL;
+    if (slot->socket != NULL)
+    {
+        if (handle_slot_live(slot, index))
+        {
+            MUTEX_UNLOCK(&t->lock);
+            lean_dec(s);
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("HandleTable.insert: socket is already registered")));
+        }
+        // its socket was closed without being removed, and the descriptor reused by `s`
+        stale = slot->socket;
+        slot->socket = NULL;
+        t->size--;
+    }
+    // the table may be shared between threads, so the socket must be too
+    lean_mark_mt(s);
+    slot->socket = s;
+    slot->generation++;
+    if (slot->generation == 0)
+    {
+        slot->generation = 1;
+    }
+    t->size++;
+    uint64_t token = ((uint64_t)slot->generation << 32) | (uint64_t)index;
+    MUTEX_UNLOCK(&t->lock);
+    if (stale != NULL)
+    {
+        lean_dec(stale);
+    }
+    return lean_io_result_mk_ok(lean_box_uint64(token));
+}
+
+/**
+ * opaque HandleTable.find? (t : @& HandleTable) (token : UInt64) : IO (Option Socket)
+ */
+lean_obj_res lean_handle_table_find(b_lean_obj_arg tbl, uint64_t token, lean_obj_arg w)
+{
+    handle_table *t = (handle_table *)lean_get_external_data(tbl);
+    lean_object *o;
+    MUTEX_LOCK(&t->lock);
+    handle_slot *slot = handle_table_slot(t, token);
+    if (slot != NULL && handle_slot_live(slot, (size_t)(token & 0xffffffffu)))
+    {
+        lean_inc(slot->socket);
+        o = lean_option_mk_some(slot->socket);
+    }
+    else
+    {
+        o = lean_option_mk_none();
+    }
+    MUTEX_UNLOCK(&t->lock);
+    return lean_io_result_mk_ok(o);
+}
+
+/**
+ * opaque HandleTable.remove? (t : @& HandleTable) (token : UInt64) : IO (Option Socket)
+ */
+lean_obj_res lean_handle_table_remove(b_lean_obj_arg tbl, uint64_t token, lean_obj_arg w)
+{
+    handle_table *t = (handle_table *)lean_get_external_data(tbl);
+    lean_object *o;
+    MUTEX_LOCK(&t->lock);
+    handle_slot *slot = handle_table_slot(t, token);
+    if (slot != NULL)
+    {
+        // ownership of the table's reference moves to the result
+        o = lean_option_mk_some(slot->socket);
+        slot->socket = NULL;
+        t->size--;
+    }
+    else
+    {
+        o = lean_option_mk_none();
+    }
+    MUTEX_UNLOCK(&t->lock);
+    return lean_io_result_mk_ok(o);
+}
+
+/**
+ * opaque HandleTable.size (t : @& HandleTable) : IO USize
+ */
+lean_obj_res lean_handle_table_size(b_lean_obj_arg tbl, lean_obj_arg w)
+{
+    handle_table *t = (handle_table *)lean_get_external_data(tbl);
+    MUTEX_LOCK(&t->lock);
+    size_t size = t->size;
+    MUTEX_UNLOCK(&t->lock);
+    return lean_io_result_mk_ok(lean_box_usize(size));
+}
+
+// ## PrefixTrie
+
+/**
+ * Address bytes of an inet or inet6 `SockAddr` in network order, with IPv4-mapped
+ * IPv6 addresses reported as IPv4. Returns the number of address bits, `0` for other families.
+ */
+static int sockaddr_address_bytes(const sockaddr_len *sal, const uint8_t **bytes)
+{
+    if (sal->address.ss_family == AF_INET)
+    {
+        *bytes = (const uint8_t *)&((const sockaddr_in *)&sal->address)->sin_addr;
+        return 32;
+    }
+    if (sal->address.ss_family == AF_INET6)
+    {
+        const uint8_t *a = (const uint8_t *)&((const sockaddr_in6 *)&sal->address)->sin6_addr;
+        static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        if (memcmp(a, mapped, sizeof(mapped)) == 0)
+        {
+            *bytes = a + 12;
+            return 32;
+        }
+        *bytes = a;
+        return 128;
+    }
+    return 0;
+}
+
+static uint32_t prefix_trie_alloc(prefix_trie *t)
+{
+    if (t->size == t->capacity)
+    {
+        size_t capacity = t->capacity * 2;
+        prefix_node *nodes = realloc(t->nodes, capacity * sizeof(prefix_node));
+        if (nodes == NULL)
+        {
+            return 0;
+        }
+        t->nodes = nodes;
+        t->capacity = capacity;
+    }
+    memset(&t->nodes[t->size], 0, sizeof(prefix_node));
+    return (uint32_t)t->size++;
+}
+
+/**
+ * opaque PrefixTrie.build' (entries : @& Array (SockAddr × UInt8 × UInt32)) : IO PrefixTrie
+ */
+lean_obj_res lean_prefix_trie_build(b_lean_obj_arg entries, lean_obj_arg w)
+{
+    prefix_trie *t = malloc(sizeof(prefix_trie));
+    t->capacity = 64;
+    t->nodes = calloc(t->capacity, sizeof(prefix_node));
+    // node 0 is the null index, followed by the two roots
+    t->size = 3;
+    size_t n = lean_array_size(entries);
+    for (size_t i = 0; i < n; ++i)
+    {
+        lean_object *entry = lean_array_get_core(entries, i);
+        lean_object *rest = lean_ctor_get(entry, 1);
+        const uint8_t *bytes;
+        int bits = sockaddr_address_bytes(sockaddr_len_unbox(lean_ctor_get(entry, 0)), &bytes);
+        int len = (int)lean_unbox(lean_ctor_get(rest, 0));
+        uint32_t value = lean_unbox_uint32(lean_ctor_get(rest, 1));
+        if (bits == 0 || len > bits)
+        {
+            prefix_trie_finalizer(t);
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("PrefixTrie.build: invalid prefix")));
+        }
+        uint32_t node = bits == 32 ? PREFIX_TRIE_ROOT4 : PREFIX_TRIE_ROOT6;
+        for (int b = 0; b < len; ++b)
+        {
+            int bit = (bytes[b >> 3] >> (7 - (b & 7))) & 1;
+            if (t->nodes[node].child[bit] == 0)
+            {
+                uint32_t child = prefix_trie_alloc(t);
+                if (child == 0)
+                {
+                    prefix_trie_finalizer(t);
+                    errno = ENOMEM;
+                    return lean_io_result_mk_error(get_socket_error());
+                }
+                t->nodes[node].child[bit] = child;
+            }
+            node = t->nodes[node].child[bit];
+        }
+        t->nodes[node].value = value;
+        t->nodes[node].has_value = 1;
+    }
+    return lean_io_result_mk_ok(lean_alloc_external(g_prefix_trie_external_class, t));
+}
+
+/**
+ * Longest prefix matching `a`, `NULL` if none.
+ */
+static const prefix_node *prefix_trie_find(const prefix_trie *t, b_lean_obj_arg a)
+{
+    const uint8_t *bytes;
+    int bits = sockaddr_address_bytes(sockaddr_len_unbox(a), &bytes);
+    if (bits == 0)
+    {
+        return NULL;
+    }
+    uint32_t node = bits == 32 ? PREFIX_TRIE_ROOT4 : PREFIX_TRIE_ROOT6;
+    const prefix_node *best = t->nodes[node].has_value ? &t->nodes[node] : NULL;
+    for (int b = 0; b < bits; ++b)
+    {
+        node = t->nodes[node].child[(bytes[b >> 3] >> (7 - (b & 7))) & 1];
+        if (node == 0)
+        {
+            break;
+        }
+        if (t->nodes[node].has_value)
+        {
+            best = &t->nodes[node];
+        }
+    }
+    return best;
+}
+
+/**
+ * opaque PrefixTrie.lookup? (t : @& PrefixTrie) (a : @& SockAddr) : Option UInt32
+ */
+lean_obj_res lean_prefix_trie_lookup(b_lean_obj_arg t, b_lean_obj_arg a)
+{
+    const prefix_node *best = prefix_trie_find((const prefix_trie *)lean_get_external_data(t), a);
+    if (best == NULL)
+    {
+        return lean_option_mk_none();
+    }
+    return lean_option_mk_some(lean_box_uint32(best->value));
+}
+
+/**
+ * opaque PrefixTrie.lookupD (t : @& PrefixTrie) (a : @& SockAddr) (default : UInt32) : UInt32
+ */
+uint32_t lean_prefix_trie_lookup_d(b_lean_obj_arg t, b_lean_obj_arg a, uint32_t d)
+{
+    const prefix_node *best = prefix_trie_find((const prefix_trie *)lean_get_external_data(t), a);
+    return best == NULL ? d : best->value;
+}
+
+// ## RateLimiter
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t next_power_of_two(uint64_t x)
+{
+    uint64_t p = 1;
+    while (p < x)
+    {
+        p <<= 1;
+    }
+    return p;
+}
+
+/**
+ * Address of a `SockAddr` as a 16 byte key, IPv4 as IPv4-mapped IPv6. Returns 0 for other families.
+ */
+static int sockaddr_address_key(const sockaddr_len *sal, uint64_t key[2])
+{
+    const uint8_t *bytes;
+    uint8_t buffer[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    int bits = sockaddr_address_bytes(sal, &bytes);
+    if (bits == 32)
+    {
+        memcpy(buffer + 12, bytes, 4);
+    }
+    else if (bits == 128)
+    {
+        memcpy(buffer, bytes, 16);
+    }
+    else
+    {
+        return 0;
+    }
+    memcpy(key, buffer, 16);
+    return 1;
+}
+
+/**
+ * opaque RateLimiter.mk (rate burst : Float) (shards capacity : UInt32) : IO RateLimiter
+ */
+lean_obj_res lean_rate_limiter_mk(double rate, double burst, uint32_t shards, uint32_t capacity, lean_obj_arg w)
+{
+    uint64_t shard_count = next_power_of_two(shards ? shards : 1);
+    uint64_t per_shard = (capacity + shard_count - 1) / shard_count;
+    uint64_t sets = next_power_of_two((per_shard + RATE_LIMITER_WAYS - 1) / RATE_LIMITER_WAYS);
+    rate_limiter *l = malloc(sizeof(rate_limiter));
+    rate_shard *shard_array = cache_aligned_calloc(shard_count, sizeof(rate_shard));
+    if (l == NULL || shard_array == NULL)
+    {
+        free(l);
+        cache_aligned_free(shard_array);
+        errno = ENOMEM;
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    l->shards = shard_array;
+    l->shard_mask = shard_count - 1;
+    l->set_mask = sets - 1;
+    l->rate_per_ns = rate / 1e9;
+    l->burst = burst;
+    for (uint64_t i = 0; i < shard_count; ++i)
+    {
+        MUTEX_INIT(&l->shards[i].lock);
+        // zeroed buckets have `last_ns == 0`, so they are evicted first
+        l->shards[i].buckets = calloc(sets * RATE_LIMITER_WAYS, sizeof(rate_bucket));
+        if (l->shards[i].buckets == NULL)
+        {
+            l->shard_mask = i;
+            rate_limiter_finalizer(l);
+            errno = ENOMEM;
+            return lean_io_result_mk_error(get_socket_error());
+        }
+    }
+    return lean_io_result_mk_ok(lean_alloc_external(g_rate_limiter_external_class, l));
+}
+
+/**
+ * opaque RateLimiter.consume (l : @& RateLimiter) (a : @& SockAddr) (tokens : Float) : IO Bool
+ */
+lean_obj_res lean_rate_limiter_consume(b_lean_obj_arg lobj, b_lean_obj_arg a, double tokens, lean_obj_arg w)
+{
+    rate_limiter *l = (rate_limiter *)lean_get_external_data(lobj);
+    uint64_t key[2];
+    if (!sockaddr_address_key(sockaddr_len_unbox(a), key))
+    {
+        return lean_io_result_mk_ok(lean_box(1));
+    }
+    uint64_t hash = mix64(key[0] ^ mix64(key[1]));
+    rate_shard *shard = &l->shards[hash & l->shard_mask];
+    uint8_t allowed;
+    MUTEX_LOCK(&shard->lock);
+    // read under the lock, so `last_ns` never lies ahead of `now`
+    uint64_t now = monotonic_nanos();
+    rate_bucket *set = &shard->buckets[((hash >> 32) & l->set_mask) * RATE_LIMITER_WAYS];
+    rate_bucket *bucket = NULL;
+    rate_bucket *oldest = &set[0];
+    for (int i = 0; i < RATE_LIMITER_WAYS; ++i)
+    {
+        if (set[i].last_ns != 0 && set[i].key[0] == key[0] && set[i].key[1] == key[1])
+        {
+            bucket = &set[i];
+            break;
+        }
+        if (set[i].last_ns < oldest->last_ns)
+        {
+            oldest = &set[i];
+        }
+    }
+    if (bucket == NULL)
+    {
+        // evict the least recently seen address of the set
+        bucket = oldest;
+        bucket->key[0] = key[0];
+        bucket->key[1] = key[1];
+        bucket->tokens = l->burst;
+    }
+    else
+    {
+        if (now > bucket->last_ns)
+        {
+            bucket->tokens += (double)(now - bucket->last_ns) * l->rate_per_ns;
+        }
+        if (bucket->tokens > l->burst)
+        {
+            bucket->tokens = l->burst;
+        }
+    }
+    bucket->last_ns = now;
+    allowed = bucket->tokens >= tokens;
+    if (allowed)
+    {
+        bucket->tokens -= tokens;
+    }
+    MUTEX_UNLOCK(&shard->lock);
+    return lean_io_result_mk_ok(lean_box(allowed));
+}
+
+// ## Maglev
+
+/**
+ * opaque SockAddr.hostHash (a : @& SockAddr) : UInt64
+ */
+uint64_t lean_sockaddr_host_hash(b_lean_obj_arg a)
+{
+    uint64_t key[2];
+    if (!sockaddr_address_key(sockaddr_len_unbox(a), key))
+    {
+        return 0;
+    }
+    return mix64(key[0] ^ mix64(key[1]));
+}
+
+/**
+ * Hash of the whole socket address, seeded so that one address yields independent hashes.
+ */
+static uint64_t sockaddr_hash(const sockaddr_len *sal, uint64_t seed)
+{
+    const uint8_t *bytes = (const uint8_t *)&sal->address;
+    uint64_t h = mix64(seed ^ sal->address_len);
+    for (socklen_t i = 0; i < sal->address_len; i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, sal->address_len - i < 8 ? sal->address_len - i : 8);
+        h = mix64(h ^ word);
+    }
+    return h;
+}
+
+static int is_prime(uint32_t n)
+{
+    if (n < 2)
+    {
+        return 0;
+    }
+    for (uint32_t d = 2; (uint64_t)d * d <= n; ++d)
+    {
+        if (n % d == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * opaque Maglev.mk (backends : @& Array (SockAddr × UInt32)) (size : UInt32) : IO Maglev
+ */
+lean_obj_res lean_maglev_mk(b_lean_obj_arg backends, uint32_t size, lean_obj_arg w)
+{
+    size_t count = lean_array_size(backends);
+    if (!is_prime(size) || count > size)
+    {
+        return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("Maglev.mk: size must be a prime no smaller than the number of backends")));
+    }
+    maglev *m = malloc(sizeof(maglev));
+    m->count = count;
+    m->size = size;
+    m->backends = malloc(sizeof(lean_object *) * (count ? count : 1));
+    m->indices = malloc(sizeof(lean_object *) * (count ? count : 1));
+    m->entries = malloc(sizeof(uint32_t) * size);
+    uint64_t *offset = malloc(sizeof(uint64_t) * (count ? count : 1));
+    uint64_t *skip = malloc(sizeof(uint64_t) * (count ? count : 1));
+    uint64_t *next = calloc(count ? count : 1, sizeof(uint64_t));
+    uint64_t *credit = calloc(count ? count : 1, sizeof(uint64_t));
+    uint32_t max_weight = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        lean_object *pair = lean_array_get_core(backends, i);
+        lean_object *addr = lean_ctor_get(pair, 0);
+        uint32_t weight = lean_unbox_uint32(lean_ctor_get(pair, 1));
+        lean_inc(addr);
+        m->backends[i] = lean_option_mk_some(addr);
+        m->indices[i] = lean_option_mk_some(lean_box(i));
+        offset[i] = sockaddr_hash(sockaddr_len_unbox(addr), 0) % size;
+        skip[i] = sockaddr_hash(sockaddr_len_unbox(addr), 1) % (size - 1) + 1;
+        max_weight = weight > max_weight ? weight : max_weight;
+    }
+    for (uint32_t j = 0; j < size; ++j)
+    {
+        m->entries[j] = UINT32_MAX;
+    }
+    // every backend walks its own permutation of the slots, taking the first free one on its
+    // turn; weights give a backend `weight / max_weight` turns per round
+    uint32_t filled = 0;
+    while (max_weight > 0 && filled < size)
+    {
+        for (size_t i = 0; i < count && filled < size; ++i)
+        {
+            credit[i] += lean_unbox_uint32(lean_ctor_get(lean_array_get_core(backends, i), 1));
+            while (credit[i] >= max_weight && filled < size)
+            {
+                credit[i] -= max_weight;
+                uint32_t slot;
+                do
+                {
+                    slot = (offset[i] + next[i] * skip[i]) % size;
+                    next[i] += 1;
+                } while (m->entries[slot] != UINT32_MAX);
+                m->entries[slot] = i;
+                filled += 1;
+            }
+        }
+    }
+    free(offset);
+    free(skip);
+    free(next);
+    free(credit);
+    if (filled < size)
+    {
+        // no backend has a weight, so nothing is ever picked
+        for (size_t i = 0; i < count; ++i)
+        {
+            lean_dec(m->backends[i]);
+            lean_dec(m->indices[i]);
+        }
+        m->count = 0;
+    }
+    return lean_io_result_mk_ok(lean_alloc_external(g_maglev_external_class, m));
+}
+
+static inline uint32_t maglev_slot(const maglev *m, uint64_t key)
+{
+    return m->entries[mix64(key) % m->size];
+}
+
+/**
+ * opaque Maglev.lookup (m : @& Maglev) (key : UInt64) : Option SockAddr
+ */
+lean_obj_res lean_maglev_lookup(b_lean_obj_arg mobj, uint64_t key)
+{
+    const maglev *m = (const maglev *)lean_get_external_data(mobj);
+    if (m->count == 0)
+    {
+        // `none` as a scalar, which needs no allocation either
+        return lean_box(0);
+    }
+    lean_object *some_addr = m->backends[maglev_slot(m, key)];
+    lean_inc(some_addr);
+    return some_addr;
+}
+
+/**
+ * opaque Maglev.lookupIndex (m : @& Maglev) (key : UInt64) : Option Nat
+ */
+lean_obj_res lean_maglev_lookup_index(b_lean_obj_arg mobj, uint64_t key)
+{
+    const maglev *m = (const maglev *)lean_get_external_data(mobj);
+    if (m->count == 0)
+    {
+        return lean_box(0);
+    }
+    lean_object *some_index = m->indices[maglev_slot(m, key)];
+    lean_inc(some_index);
+    return some_index;
+}
+
+/**
+ * opaque Maglev.backendCount (m : @& Maglev) : Nat
+ */
+lean_obj_res lean_maglev_backend_count(b_lean_obj_arg mobj)
+{
+    return lean_box(((const maglev *)lean_get_external_data(mobj))->count);
+}
+
+// ## HealthCheck
+
+/**
+ * Byte offset of `Target.timeoutMs`, which comes after the `addr`, `send` and `expect` fields.
+ */
+#define HEALTH_TARGET_TIMEOUT_OFFSET (3 * sizeof(void *))
+
+#ifndef _WIN32
+
+static lean_object *health_up(uint64_t micros)
+{
+    lean_object *o = lean_alloc_ctor(0, 0, sizeof(uint32_t));
+    lean_ctor_set_uint32(o, 0, micros > UINT32_MAX ? UINT32_MAX : (uint32_t)micros);
+    return o;
+}
+
+static lean_object *health_down(const char *reason)
+{
+    lean_object *o = lean_alloc_ctor(1, 1, 0);
+    lean_ctor_set(o, 0, lean_mk_string(reason));
+    return o;
+}
+
+/**
+ * Finish probe `i` with `outcome`, closing its socket.
+ */
+static void health_finish(health_probe *p, lean_object *results, size_t i, lean_object *outcome)
+{
+    if (p->fd >= 0)
+    {
+        close(p->fd);
+        p->fd = -1;
+    }
+    p->phase = HEALTH_DONE;
+    lean_array_set_core(results, i, outcome);
+}
+
+/**
+ * Advance probe `i` after its socket became ready, or right after connecting.
+ */
+static void health_step(health_probe *p, lean_object *target, lean_object *results, size_t i, uint64_t now)
+{
+    lean_object *request = lean_ctor_get(target, 1);
+    lean_object *expect = lean_ctor_get(target, 2);
+    if (p->phase == HEALTH_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+        {
+            err = errno;
+        }
+        if (err != 0)
+        {
+            health_finish(p, results, i, health_down(strerror(err)));
+            return;
+        }
+        p->phase = HEALTH_SENDING;
+        p->progress = 0;
+    }
+    if (p->phase == HEALTH_SENDING)
+    {
+        size_t size = lean_sarray_size(request);
+        while (p->progress < size)
+        {
+#ifdef MSG_NOSIGNAL
+            ssize_t n = send(p->fd, lean_sarray_cptr(request) + p->progress, size - p->progress, MSG_NOSIGNAL);
+#else
+            ssize_t n = send(p->fd, lean_sarray_cptr(request) + p->progress, size - p->progress, 0);
+#endif
+            if (n < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    health_finish(p, results, i, health_down(strerror(errno)));
+                }
+                return;
+            }
+            p->progress += n;
+        }
+        p->phase = HEALTH_READING;
+        p->progress = 0;
+    }
+    if (p->phase == HEALTH_READING)
+    {
+        size_t size = lean_sarray_size(expect);
+        uint8_t buffer[512];
+        while (p->progress < size)
+        {
+            size_t want = size - p->progress < sizeof(buffer) ? size - p->progress : sizeof(buffer);
+            ssize_t n = recv(p->fd, buffer, want, 0);
+            if (n < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    health_finish(p, results, i, health_down(strerror(errno)));
+                }
+                return;
+            }
+            if (n == 0)
+            {
+                health_finish(p, results, i, health_down("connection closed before the expected response"));
+                return;
+            }
+            if (memcmp(buffer, lean_sarray_cptr(expect) + p->progress, n) != 0)
+            {
+                health_finish(p, results, i, health_down("unexpected response"));
+                return;
+            }
+            p->progress += n;
+        }
+        health_finish(p, results, i, health_up((now - p->started_ns) / 1000));
+    }
+}
+
+/**
+ * Start probe `i` with a non-blocking connect.
+ */
+static void health_start(health_probe *p, lean_object *target, lean_object *results, size_t i)
+{
+    sockaddr_len *sa = sockaddr_len_unbox(lean_ctor_get(target, 0));
+    uint32_t timeout_ms = lean_ctor_get_uint32(target, HEALTH_TARGET_TIMEOUT_OFFSET);
+    p->started_ns = monotonic_nanos();
+    p->deadline_ns = p->started_ns + (uint64_t)timeout_ms * 1000000ull;
+    p->fd = socket(sa->address.ss_family, SOCK_STREAM, 0);
+    if (p->fd < 0)
+    {
+        health_finish(p, results, i, health_down(strerror(errno)));
+        return;
+    }
+    fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL, 0) | O_NONBLOCK);
+    p->phase = HEALTH_CONNECTING;
+    if (connect(p->fd, (sockaddr *)&sa->address, sa->address_len) == 0)
+    {
+        health_step(p, target, results, i, monotonic_nanos());
+    }
+    else if (errno != EINPROGRESS)
+    {
+        health_finish(p, results, i, health_down(strerror(errno)));
+    }
+}
+
+#endif
+
+/**
+ * opaque probe (targets : @& Array Target) (concurrency : UInt32) : IO (Array Outcome)
+ */
+lean_obj_res lean_health_probe(b_lean_obj_arg targets, uint32_t concurrency, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("HealthCheck.probe"));
+#else
+    size_t n = lean_array_size(targets);
+    size_t limit = concurrency == 0 ? 1 : concurrency;
+    health_probe *probes = malloc(sizeof(health_probe) * (n ? n : 1));
+    struct pollfd *pollfds = malloc(sizeof(struct pollfd) * (limit < n ? limit : (n ? n : 1)));
+    size_t *polled = malloc(sizeof(size_t) * (limit < n ? limit : (n ? n : 1)));
+    lean_object *results = lean_alloc_array(n, n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        probes[i].fd = -1;
+        probes[i].phase = HEALTH_PENDING;
+        lean_array_set_core(results, i, lean_box(0));
+    }
+    // probes are started in order, keeping at most `limit` in flight
+    size_t next = 0;
+    size_t done = 0;
+    while (done < n)
+    {
+        size_t in_flight = 0;
+        uint64_t now = monotonic_nanos();
+        uint64_t deadline = UINT64_MAX;
+        for (size_t i = 0; i < next; ++i)
+        {
+            if (probes[i].phase != HEALTH_DONE && probes[i].deadline_ns <= now)
+            {
+                health_finish(&probes[i], results, i, health_down("timed out"));
+            }
+            in_flight += probes[i].phase != HEALTH_DONE;
+        }
+        for (; next < n && in_flight < limit; ++next)
+        {
+            health_start(&probes[next], lean_array_get_core(targets, next), results, next);
+            in_flight += probes[next].phase != HEALTH_DONE;
+        }
+        size_t count = 0;
+        done = 0;
+        for (size_t i = 0; i < next; ++i)
+        {
+            if (probes[i].phase == HEALTH_DONE)
+            {
+                done += 1;
+                continue;
+            }
+            pollfds[count].fd = probes[i].fd;
+            pollfds[count].events = probes[i].phase == HEALTH_READING ? POLLIN : POLLOUT;
+            pollfds[count].revents = 0;
+            polled[count] = i;
+            deadline = probes[i].deadline_ns < deadline ? probes[i].deadline_ns : deadline;
+            count += 1;
+        }
+        if (count == 0)
+        {
+            continue;
+        }
+        now = monotonic_nanos();
+        int timeout = deadline <= now ? 0 : (int)((deadline - now + 999999) / 1000000);
+        if (poll(pollfds, count, timeout) < 0 && errno != EINTR)
+        {
+            int errnum = errno;
+            for (size_t i = 0; i < next; ++i)
+            {
+                if (probes[i].fd >= 0)
+                {
+                    close(probes[i].fd);
+                }
+            }
+            free(probes);
+            free(pollfds);
+            free(polled);
+            lean_dec(results);
+            errno = errnum;
+            return lean_io_result_mk_error(get_socket_error());
+        }
+        now = monotonic_nanos();
+        for (size_t k = 0; k < count; ++k)
+        {
+            if (pollfds[k].revents != 0)
+            {
+                size_t i = polled[k];
+                health_step(&probes[i], lean_array_get_core(targets, i), results, i, now);
+            }
+        }
+    }
+    free(probes);
+    free(pollfds);
+    free(polled);
+    return lean_io_result_mk_ok(results);
+#endif
+}
+
+// ## Framing
+
+/**
+ * Length prefix kinds, in the order of the `Framing.Prefix` constructors.
+ */
+enum
+{
+    FRAME_U16BE,
+    FRAME_U16LE,
+    FRAME_U32BE,
+    FRAME_U32LE,
+    FRAME_U64BE,
+    FRAME_U64LE,
+    FRAME_VARINT
+};
+
+static size_t frame_prefix_width(uint8_t kind)
+{
+    switch (kind)
+    {
+    case FRAME_U16BE:
+    case FRAME_U16LE:
+        return 2;
+    case FRAME_U32BE:
+    case FRAME_U32LE:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+/**
+ * Read a length prefix at `p`, with `avail` bytes available.
+ * Returns the prefix size, `0` if the prefix is incomplete and `-1` for a malformed varint.
+ */
+static int frame_prefix_read(uint8_t kind, const uint8_t *p, size_t avail, uint64_t *len)
+{
+    if (kind == FRAME_VARINT)
+    {
+        uint64_t v = 0;
+        for (size_t i = 0; i < 10; i++)
+        {
+            if (i == avail)
+            {
+                return 0;
+            }
+            uint64_t b = p[i] & 0x7f;
+            // the tenth byte may only carry the top bit of a 64-bit value
+            if (i == 9 && b > 1)
+            {
+                return -1;
+            }
+            v |= b << (7 * i);
+            if ((p[i] & 0x80) == 0)
+            {
+                *len = v;
+                return (int)i + 1;
+            }
+        }
+        return -1;
+    }
+    size_t width = frame_prefix_width(kind);
+    if (avail < width)
+    {
+        return 0;
+    }
+    uint64_t v = 0;
+    if (kind == FRAME_U16BE || kind == FRAME_U32BE || kind == FRAME_U64BE)
+    {
+        for (size_t i = 0; i < width; i++)
+        {
+            v = (v << 8) | p[i];
+        }
+    }
+    else
+    {
+        for (size_t i = width; i > 0; i--)
+        {
+            v = (v << 8) | p[i - 1];
+        }
+    }
+    *len = v;
+    return (int)width;
+}
+
+/**
+ * Size of the prefix for a payload of `len` bytes, `0` if `len` does not fit the prefix.
+ */
+static size_t frame_prefix_size(uint8_t kind, uint64_t len)
+{
+    if (kind == FRAME_VARINT)
+    {
+        size_t n = 1;
+        while (len >= 0x80)
+        {
+            len >>= 7;
+            n++;
+        }
+        return n;
+    }
+    size_t width = frame_prefix_width(kind);
+    if (width < 8 && len >> (8 * width) != 0)
+    {
+        return 0;
+    }
+    return width;
+}
+
+static uint8_t *frame_prefix_write(uint8_t kind, uint8_t *p, uint64_t len)
+{
+    if (kind == FRAME_VARINT)
+    {
+        while (len >= 0x80)
+        {
+            *p++ = (uint8_t)(len | 0x80);
+            len >>= 7;
+        }
+        *p++ = (uint8_t)len;
+        return p;
+    }
+    size_t width = frame_prefix_width(kind);
+    if (kind == FRAME_U16BE || kind == FRAME_U32BE || kind == FRAME_U64BE)
+    {
+        for (size_t i = width; i > 0; i--)
+        {
+            p[i - 1] = (uint8_t)len;
+            len >>= 8;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < width; i++)
+        {
+            p[i] = (uint8_t)len;
+            len >>= 8;
+        }
+    }
+    return p + width;
+}
+
+/**
+ * opaque Framing.decode (p : Prefix) (buf : @& ByteArray) (start : @& Nat) (maxFrame : USize) : Except String (Array ByteSlice × Nat)
+ */
+lean_obj_res lean_framing_decode(uint8_t kind, b_lean_obj_arg buf, b_lean_obj_arg start, size_t max_frame)
+{
+    const uint8_t *data = lean_sarray_cptr(buf);
+    size_t size = lean_sarray_size(buf);
+    size_t pos = nat_offset_unbox(start);
+    if (pos > size)
+    {
+        pos = size;
+    }
+    lean_object *frames = lean_mk_empty_array();
+    for (;;)
+    {
+        uint64_t len;
+        int n = frame_prefix_read(kind, data + pos, size - pos, &len);
+        if (n < 0)
+        {
+            lean_dec_ref(frames);
+            return lean_except_mk_error("Framing.decode: malformed length prefix");
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        if (len > max_frame)
+        {
+            lean_dec_ref(frames);
+            return lean_except_mk_error("Framing.decode: frame exceeds maxFrame");
+        }
+        if (size - pos - n < len)
+        {
+            break;
+        }
+        size_t begin = pos + n;
+        pos = begin + len;
+        frames = lean_array_push(frames, byte_slice_box(buf, begin, pos));
+    }
+    lean_object *pair = lean_alloc_ctor(0, 2, 0);
+    lean_ctor_set(pair, 0, frames);
+    lean_ctor_set(pair, 1, lean_usize_to_nat(pos));
+    return lean_except_mk_ok(pair);
+}
+
+/**
+ * opaque Framing.encodeMany (p : Prefix) (payloads : @& Array ByteArray) : Except String ByteArray
+ */
+lean_obj_res lean_framing_encode_many(uint8_t kind, b_lean_obj_arg payloads)
+{
+    size_t count = lean_array_size(payloads);
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len = lean_sarray_size(lean_array_get_core(payloads, i));
+        size_t n = frame_prefix_size(kind, len);
+        if (n == 0)
+        {
+            return lean_except_mk_error("Framing.encode: payload too large for the length prefix");
+        }
+        total += n + len;
+    }
+    lean_object *out = lean_alloc_sarray(1, total, total);
+    uint8_t *p = lean_sarray_cptr(out);
+    for (size_t i = 0; i < count; i++)
+    {
+        lean_object *payload = lean_array_get_core(payloads, i);
+        size_t len = lean_sarray_size(payload);
+        p = frame_prefix_write(kind, p, len);
+        memcpy(p, lean_sarray_cptr(payload), len);
+        p += len;
+    }
+    return lean_except_mk_ok(out);
+}
+
+// ## WebSocket
+
+/**
+ * opaque WebSocket.mask (buf : ByteArray) (start stop : USize) (key : UInt32) : ByteArray
+ */
+lean_obj_res lean_websocket_mask(lean_obj_arg buf, size_t start, size_t stop, uint32_t key)
+{
+    if (!lean_is_exclusive(buf))
+    {
+        buf = lean_copy_byte_array(buf);
+    }
+    size_t size = lean_sarray_size(buf);
+    stop = stop < size ? stop : size;
+    if (start >= stop)
+    {
+        return buf;
+    }
+    uint8_t *p = lean_sarray_cptr(buf) + start;
+    size_t n = stop - start;
+    const uint8_t k[4] = {(uint8_t)(key >> 24), (uint8_t)(key >> 16), (uint8_t)(key >> 8), (uint8_t)key};
+    size_t i = 0;
+    while (i < n && ((uintptr_t)(p + i) & 7) != 0)
+    {
+        p[i] ^= k[i & 3];
+        i++;
+    }
+    if (n - i >= 8)
+    {
+        // the key repeated from the current phase; whole words keep the phase
+        uint8_t bytes[8];
+        for (size_t j = 0; j < 8; j++)
+        {
+            bytes[j] = k[(i + j) & 3];
+        }
+        uint64_t m;
+        memcpy(&m, bytes, sizeof(m));
+#ifdef __SSE2__
+        const __m128i m128 = _mm_set1_epi64x((long long)m);
+        for (; n - i >= 64; i += 64)
+        {
+            __m128i *q = (__m128i *)(p + i);
+            _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q), m128));
+            _mm_storeu_si128(q + 1, _mm_xor_si128(_mm_loadu_si128(q + 1), m128));
+            _mm_storeu_si128(q + 2, _mm_xor_si128(_mm_loadu_si128(q + 2), m128));
+            _mm_storeu_si128(q + 3, _mm_xor_si128(_mm_loadu_si128(q + 3), m128));
+        }
+        for (; n - i >= 16; i += 16)
+        {
+            __m128i *q = (__m128i *)(p + i);
+            _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q), m128));
+        }
+#endif
+        for (; n - i >= 8; i += 8)
+        {
+            uint64_t v;
+            memcpy(&v, p + i, sizeof(v));
+            v ^= m;
+            memcpy(p + i, &v, sizeof(v));
+        }
+    }
+    for (; i < n; i++)
+    {
+        p[i] ^= k[i & 3];
+    }
+    return buf;
+}
+
+// ## Chunked Encoding
+
+/**
+ * Decoder phases, matching `Chunked.Phase`.
+ */
+enum
+{
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+    CHUNK_DONE
+};
+
+/**
+ * Longest chunk size or trailer line accepted, extensions included.
+ */
+#define CHUNK_LINE_MAX 8192
+
+/**
+ * Find the end of the line starting at `pos`: the offset of its CRLF, `SIZE_MAX` if incomplete.
+ */
+static size_t chunk_line_end(const uint8_t *data, size_t pos, size_t size)
+{
+    const uint8_t *lf = memchr(data + pos, '\n', size - pos);
+    return lf == NULL ? SIZE_MAX : (size_t)(lf - data);
+}
+
+static lean_object *chunked_step_box(lean_object *chunks, lean_object *trailers, size_t pos, uint64_t remaining, uint8_t phase)
+{
+    lean_object *o = lean_alloc_ctor(0, 3, sizeof(uint64_t) + sizeof(uint8_t));
+    lean_ctor_set(o, 0, chunks);
+    lean_ctor_set(o, 1, trailers);
+    lean_ctor_set(o, 2, lean_usize_to_nat(pos));
+    lean_ctor_set_uint64(o, sizeof(void *) * 3, remaining);
+    lean_ctor_set_uint8(o, sizeof(void *) * 3 + sizeof(uint64_t), phase);
+    return o;
+}
+
+/**
+ * opaque Chunked.decode (phase : Phase) (remaining : UInt64) (buf : @& ByteArray) (start : @& Nat) : Except String Step
+ */
+lean_obj_res lean_chunked_decode(uint8_t phase, uint64_t remaining, b_lean_obj_arg buf, b_lean_obj_arg start)
+{
+    const uint8_t *data = lean_sarray_cptr(buf);
+    size_t size = lean_sarray_size(buf);
+    size_t pos = nat_offset_unbox(start);
+    if (pos > size)
+    {
+        pos = size;
+    }
+    lean_object *chunks = lean_mk_empty_array();
+    lean_object *trailers = lean_mk_empty_array();
+    const char *error = NULL;
+    while (error == NULL && phase != CHUNK_DONE && pos < size)
+    {
+        if (phase == CHUNK_DATA)
+        {
+            size_t n = size - pos < remaining ? size - pos : (size_t)remaining;
+            chunks = lean_array_push(chunks, byte_slice_box(buf, pos, pos + n));
+            pos += n;
+            remaining -= n;
+            if (remaining == 0)
+            {
+                phase = CHUNK_DATA_END;
+            }
+            continue;
+        }
+        if (phase == CHUNK_DATA_END)
+        {
+            if (size - pos < 2)
+            {
+                break;
+            }
+            if (data[pos] != '\r' || data[pos + 1] != '\n')
+            {
+                error = "Chunked.decode: missing CRLF after chunk data";
+                break;
+            }
+            pos += 2;
+            phase = CHUNK_SIZE;
+            continue;
+        }
+        size_t lf = chunk_line_end(data, pos, size);
+        if (lf == SIZE_MAX)
+        {
+            if (size - pos > CHUNK_LINE_MAX)
+            {
+                error = "Chunked.decode: line too long";
+            }
+            break;
+        }
+        if (lf == pos || data[lf - 1] != '\r')
+        {
+            error = "Chunked.decode: line not terminated by CRLF";
+            break;
+        }
+        size_t end = lf - 1;
+        if (phase == CHUNK_TRAILER)
+        {
+            if (end == pos)
+            {
+                phase = CHUNK_DONE;
+            }
+            else
+            {
+                trailers = lean_array_push(trailers, byte_slice_box(buf, pos, end));
+            }
+            pos = lf + 1;
+            continue;
+        }
+        // chunk-size [ ";" chunk-ext ], extensions are skipped
+        uint64_t n = 0;
+        size_t i = pos;
+        for (; i < end; i++)
+        {
+            uint8_t c = data[i];
+            int digit = c >= '0' && c <= '9'   ? c - '0'
+                        : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                        : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                               : -1;
+            if (digit < 0)
+            {
+                break;
+            }
+            if (n >> 60 != 0)
+            {
+                error = "Chunked.decode: chunk size too large";
+                break;
+            }
+            n = (n << 4) | (uint64_t)digit;
+        }
+        if (error != NULL)
+        {
+            break;
+        }
+        if (i == pos || (i < end && data[i] != ';' && data[i] != ' ' && data[i] != '\t'))
+        {
+            error = "Chunked.decode: invalid chunk size";
+            break;
+        }
+        pos = lf + 1;
+        remaining = n;
+        phase = n == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+    }
+    if (error != NULL)
+    {
+        lean_dec_ref(chunks);
+        lean_dec_ref(trailers);
+        return lean_except_mk_error(error);
+    }
+    return lean_except_mk_ok(chunked_step_box(chunks, trailers, pos, remaining, phase));
+}
+
+// ## HTTP
+
+/**
+ * Longest response head accepted, status line and headers included.
+ */
+#define HTTP_HEAD_MAX 65536
+
+static int http_is_tchar(uint8_t c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+static lean_object *http_header_box(b_lean_obj_arg buf, size_t name, size_t name_end, size_t value, size_t value_end)
+{
+    lean_object *o = lean_alloc_ctor(0, 2, 0);
+    lean_ctor_set(o, 0, byte_slice_box(buf, name, name_end));
+    lean_ctor_set(o, 1, byte_slice_box(buf, value, value_end));
+    return o;
+}
+
+/**
+ * opaque Http.parseHead (buf : @& ByteArray) (start : @& Nat) : Except String (Option Head)
+ */
+lean_obj_res lean_http_parse_head(b_lean_obj_arg buf, b_lean_obj_arg start)
+{
+    const uint8_t *data = lean_sarray_cptr(buf);
+    size_t size = lean_sarray_size(buf);
+    size_t pos = nat_offset_unbox(start);
+    if (pos > size)
+    {
+        pos = size;
+    }
+    // find the empty line ending the head before looking at any of it
+    size_t limit = size - pos > HTTP_HEAD_MAX ? pos + HTTP_HEAD_MAX : size;
+    size_t stop = SIZE_MAX;
+    for (const uint8_t *lf = memchr(data + pos, '\n', limit - pos); lf != NULL;
+         lf = memchr(lf + 1, '\n', limit - (size_t)(lf + 1 - data)))
+    {
+        size_t i = (size_t)(lf - data);
+        if (i >= pos + 3 && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r')
+        {
+            stop = i + 1;
+            break;
+        }
+    }
+    if (stop == SIZE_MAX)
+    {
+        if (limit - pos == HTTP_HEAD_MAX)
+        {
+            return lean_except_mk_error("Http.parseHead: response head too large");
+        }
+        return lean_except_mk_ok(lean_option_mk_none());
+    }
+    // status line: HTTP/1.x SP 3DIGIT SP reason CRLF
+    const uint8_t *line = data + pos;
+    if (stop - pos < 14 || memcmp(line, "HTTP/1.", 7) != 0 || line[7] < '0' || line[7] > '9' || line[8] != ' ' ||
+        line[9] < '0' || line[9] > '9' || line[10] < '0' || line[10] > '9' || line[11] < '0' || line[11] > '9')
+    {
+        return lean_except_mk_error("Http.parseHead: invalid status line");
+    }
+    uint8_t minor = line[7] - '0';
+    uint16_t status = (uint16_t)((line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0'));
+    size_t eol = (size_t)((const uint8_t *)memchr(line, '\n', stop - pos) - data) - 1;
+    if (data[eol] != '\r')
+    {
+        return lean_except_mk_error("Http.parseHead: line not terminated by CRLF");
+    }
+    size_t reason = line[12] == ' ' ? pos + 13 : pos + 12;
+    if (reason > eol)
+    {
+        reason = eol;
+    }
+    lean_object *headers = lean_mk_empty_array();
+    size_t i = eol + 2;
+    while (i < stop - 2)
+    {
+        size_t end = (size_t)((const uint8_t *)memchr(data + i, '\n', stop - i) - data) - 1;
+        if (data[end] != '\r')
+        {
+            lean_dec_ref(headers);
+            return lean_except_mk_error("Http.parseHead: line not terminated by CRLF");
+        }
+        size_t name = i;
+        while (i < end && http_is_tchar(data[i]))
+        {
+            i++;
+        }
+        if (i == name || i == end || data[i] != ':')
+        {
+            lean_dec_ref(headers);
+            return lean_except_mk_error("Http.parseHead: invalid header line");
+        }
+        size_t name_end = i++;
+        while (i < end && (data[i] == ' ' || data[i] == '\t'))
+        {
+            i++;
+        }
+        size_t value_end = end;
+        while (value_end > i && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t'))
+        {
+            value_end--;
+        }
+        headers = lean_array_push(headers, http_header_box(buf, name, name_end, i, value_end));
+        i = end + 2;
+    }
+    lean_object *head = lean_alloc_ctor(0, 3, sizeof(uint16_t) + sizeof(uint8_t));
+    lean_ctor_set(head, 0, byte_slice_box(buf, reason, eol));
+    lean_ctor_set(head, 1, headers);
+    lean_ctor_set(head, 2, lean_usize_to_nat(stop));
+    lean_ctor_set_uint16(head, sizeof(void *) * 3, status);
+    lean_ctor_set_uint8(head, sizeof(void *) * 3 + sizeof(uint16_t), minor);
+    return lean_except_mk_ok(lean_option_mk_some(head));
+}
+
+// ## Router
+
+static uint32_t router_alloc(router *r, const uint8_t *label, size_t len)
+{
+    if (r->size == r->capacity)
+    {
+        size_t capacity = r->capacity * 2;
+        router_node *nodes = realloc(r->nodes, capacity * sizeof(router_node));
+        if (nodes == NULL)
+        {
+            return 0;
+        }
+        r->nodes = nodes;
+        r->capacity = capacity;
+    }
+    router_node *n = &r->nodes[r->size];
+    memset(n, 0, sizeof(router_node));
+    if (len > 0)
+    {
+        n->label = malloc(len);
+        if (n->label == NULL)
+        {
+            return 0;
+        }
+        memcpy(n->label, label, len);
+    }
+    n->label_len = (uint32_t)len;
+    return (uint32_t)r->size++;
+}
+
+static int router_add_child(router *r, uint32_t parent, uint32_t child)
+{
+    router_node *p = &r->nodes[parent];
+    uint32_t *children = realloc(p->children, (p->child_count + 1) * sizeof(uint32_t));
+    if (children == NULL)
+    {
+        return -1;
+    }
+    p->children = children;
+    uint8_t *first = realloc(p->first, p->child_count + 1);
+    if (first == NULL)
+    {
+        return -1;
+    }
+    p->first = first;
+    p->children[p->child_count] = child;
+    p->first[p->child_count] = r->nodes[child].label[0];
+    p->child_count++;
+    return 0;
+}
+
+/**
+ * Insert the pattern of route `route`. Returns an error message, `NULL` on success.
+ */
+static const char *router_insert(router *r, const uint8_t *p, size_t len, uint32_t route)
+{
+    static const char *oom = "Router.build: out of memory";
+    uint32_t n = ROUTER_ROOT;
+    size_t params = 0;
+    size_t i = 0;
+    while (i < len)
+    {
+        if (p[i] == ':' || p[i] == '*')
+        {
+            int wildcard = p[i] == '*';
+            const uint8_t *slash = memchr(p + i, '/', len - i);
+            size_t end = slash == NULL ? len : (size_t)(slash - p);
+            if (end == i + 1)
+            {
+                return "Router.build: empty parameter name";
+            }
+            if (wildcard && end != len)
+            {
+                return "Router.build: a wildcard must end the pattern";
+            }
+            if (++params > ROUTER_MAX_PARAMS)
+            {
+                return "Router.build: too many parameters";
+            }
+            uint32_t c = wildcard ? r->nodes[n].wildcard : r->nodes[n].param;
+            if (c == 0)
+            {
+                c = router_alloc(r, NULL, 0);
+                if (c == 0)
+                {
+                    return oom;
+                }
+                if (wildcard)
+                {
+                    r->nodes[n].wildcard = c;
+                }
+                else
+                {
+                    r->nodes[n].param = c;
+                }
+            }
+            n = c;
+            i = end;
+            continue;
+        }
+        size_t end = i;
+        while (end < len && p[end] != ':' && p[end] != '*')
+        {
+            end++;
+        }
+        uint32_t k = 0;
+        uint32_t c = 0;
+        for (; k < r->nodes[n].child_count; k++)
+        {
+            if (r->nodes[n].first[k] == p[i])
+            {
+                c = r->nodes[n].children[k];
+                break;
+            }
+        }
+        if (c == 0)
+        {
+            c = router_alloc(r, p + i, end - i);
+            if (c == 0 || router_add_child(r, n, c) != 0)
+            {
+                return oom;
+            }
+            n = c;
+            i = end;
+            continue;
+        }
+        size_t common = 0;
+        while (common < r->nodes[c].label_len && i + common < end && r->nodes[c].label[common] == p[i + common])
+        {
+            common++;
+        }
+        if (common < r->nodes[c].label_len)
+        {
+            // split the edge: `m` takes the common prefix, `c` keeps the rest of its label
+            uint32_t m = router_alloc(r, r->nodes[c].label, common);
+            if (m == 0)
+            {
+                return oom;
+            }
+            router_node *child = &r->nodes[c];
+            memmove(child->label, child->label + common, child->label_len - common);
+            child->label_len -= (uint32_t)common;
+            r->nodes[n].children[k] = m;
+            if (router_add_child(r, m, c) != 0)
+            {
+                return oom;
+            }
+            c = m;
+        }
+        n = c;
+        i += common;
+    }
+    if (r->nodes[n].route != 0)
+    {
+        return "Router.build: duplicate route";
+    }
+    r->nodes[n].route = route + 1;
+    return NULL;
+}
+
+/**
+ * Match `p[pos, len)` below node `n`, preferring static segments over parameters over
+ * wildcards. Captures are appended to `caps` as offset pairs. Returns the route plus one.
+ */
+static uint32_t router_find(const router *r, uint32_t n, const uint8_t *p, size_t pos, size_t len, uint32_t *caps, size_t ncaps, size_t *out_caps)
+{
+    const router_node *node = &r->nodes[n];
+    if (pos == len && node->route != 0)
+    {
+        *out_caps = ncaps;
+        return node->route;
+    }
+    if (pos < len)
+    {
+        for (uint32_t k = 0; k < node->child_count; k++)
+        {
+            if (node->first[k] == p[pos])
+            {
+                const router_node *c = &r->nodes[node->children[k]];
+                if (len - pos >= c->label_len && memcmp(c->label, p + pos, c->label_len) == 0)
+                {
+                    uint32_t route = router_find(r, node->children[k], p, pos + c->label_len, len, caps, ncaps, out_caps);
+                    if (route != 0)
+                    {
+                        return route;
+                    }
+                }
+                break;
+            }
+        }
+        if (node->param != 0)
+        {
+            const uint8_t *slash = memchr(p + pos, '/', len - pos);
+            size_t end = slash == NULL ? len : (size_t)(slash - p);
+            if (end > pos)
+            {
+                caps[2 * ncaps] = (uint32_t)pos;
+                caps[2 * ncaps + 1] = (uint32_t)end;
+                uint32_t route = router_find(r, node->param, p, end, len, caps, ncaps + 1, out_caps);
+                if (route != 0)
+                {
+                    return route;
+                }
+            }
+        }
+    }
+    if (node->wildcard != 0 && r->nodes[node->wildcard].route != 0)
+    {
+        caps[2 * ncaps] = (uint32_t)pos;
+        caps[2 * ncaps + 1] = (uint32_t)len;
+        *out_caps = ncaps + 1;
+        return r->nodes[node->wildcard].route;
+    }
+    return 0;
+}
+
+static void store_u32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/**
+ * opaque Router.Table.build (patterns : @& Array String) : IO Router.Table
+ */
+lean_obj_res lean_router_build(b_lean_obj_arg patterns, lean_obj_arg w)
+{
+    router *r = malloc(sizeof(router));
+    r->capacity = 64;
+    r->size = 0;
+    r->nodes = malloc(r->capacity * sizeof(router_node));
+    // node 0 is the null index
+    router_alloc(r, NULL, 0);
+    router_alloc(r, NULL, 0);
+    size_t count = lean_array_size(patterns);
+    for (size_t i = 0; i < count; i++)
+    {
+        lean_object *pattern = lean_array_get_core(patterns, i);
+        const char *error = router_insert(r, (const uint8_t *)lean_string_cstr(pattern), lean_string_size(pattern) - 1, (uint32_t)i);
+        if (error != NULL)
+        {
+            router_finalizer(r);
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string(error)));
+        }
+    }
+    return lean_io_result_mk_ok(lean_alloc_external(g_router_external_class, r));
+}
+
+/**
+ * opaque Router.Table.lookup (t : @& Router.Table) (path : @& ByteArray) (start stop : USize) (scratch : ByteArray) : ByteArray
+ */
+lean_obj_res lean_router_lookup(b_lean_obj_arg t, b_lean_obj_arg path, size_t start, size_t stop, lean_obj_arg scratch)
+{
+    const router *r = (const router *)lean_get_external_data(t);
+    size_t size = lean_sarray_size(path);
+    stop = stop < size ? stop : size;
+    start = start < stop ? start : stop;
+    uint32_t caps[2 * ROUTER_MAX_PARAMS];
+    size_t ncaps = 0;
+    uint32_t route = router_find(r, ROUTER_ROOT, lean_sarray_cptr(path), start, stop, caps, 0, &ncaps);
+    if (route == 0)
+    {
+        ncaps = 0;
+    }
+    // reuse the caller's buffer when nobody else holds it
+    size_t need = 8 + 8 * ncaps;
+    if (!lean_is_exclusive(scratch) || lean_sarray_capacity(scratch) < need)
+    {
+        lean_dec(scratch);
+        scratch = lean_alloc_sarray(1, 0, 8 + 8 * ROUTER_MAX_PARAMS);
+    }
+    uint8_t *out = lean_sarray_cptr(scratch);
+    store_u32_le(out, route);
+    store_u32_le(out + 4, (uint32_t)ncaps);
+    for (size_t i = 0; i < 2 * ncaps; i++)
+    {
+        store_u32_le(out + 8 + 4 * i, caps[i]);
+    }
+    lean_to_sarray(scratch)->m_size = need;
+    return scratch;
+}
+
+/**
+ * opaque Router.Captures.mk : IO Router.Captures
+ */
+lean_obj_res lean_router_captures_mk(lean_obj_arg w)
+{
+    router_captures *c = calloc(1, sizeof(router_captures));
+    if (c == NULL)
+    {
+        errno = ENOMEM;
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    return lean_io_result_mk_ok(lean_alloc_external(g_router_captures_external_class, c));
+}
+
+/**
+ * opaque Router.Table.find (t : @& Router.Table) (path : @& ByteArray) (start stop : USize) (caps : @& Router.Captures) : IO UInt32
+ */
+lean_obj_res lean_router_find(b_lean_obj_arg t, b_lean_obj_arg path, size_t start, size_t stop, b_lean_obj_arg caps, lean_obj_arg w)
+{
+    const router *r = (const router *)lean_get_external_data(t);
+    router_captures *c = (router_captures *)lean_get_external_data(caps);
+    size_t size = lean_sarray_size(path);
+    stop = stop < size ? stop : size;
+    start = start < stop ? start : stop;
+    size_t ncaps = 0;
+    uint32_t route = router_find(r, ROUTER_ROOT, lean_sarray_cptr(path), start, stop, c->offsets, 0, &ncaps);
+    c->count = route == 0 ? 0 : (uint32_t)ncaps;
+    return lean_io_result_mk_ok(lean_box_uint32(route));
+}
+
+/**
+ * opaque Router.Captures.size (c : @& Router.Captures) : IO UInt32
+ */
+lean_obj_res lean_router_captures_size(b_lean_obj_arg caps, lean_obj_arg w)
+{
+    const router_captures *c = (const router_captures *)lean_get_external_data(caps);
+    return lean_io_result_mk_ok(lean_box_uint32(c->count));
+}
+
+/**
+ * opaque Router.Captures.offset (c : @& Router.Captures) (i : UInt32) : IO UInt32
+ */
+lean_obj_res lean_router_captures_offset(b_lean_obj_arg caps, uint32_t i, lean_obj_arg w)
+{
+    const router_captures *c = (const router_captures *)lean_get_external_data(caps);
+    if (i >= 2 * c->count)
+    {
+        return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("Router.Captures.offset: index out of range")));
+    }
+    return lean_io_result_mk_ok(lean_box_uint32(c->offsets[i]));
+}
+
+// ## StaticFile
+
+#ifndef _WIN32
+static uint64_t stat_mtime_ns(const struct stat *st)
+{
+#ifdef __APPLE__
+    return (uint64_t)st->st_mtimespec.tv_sec * 1000000000 + (uint64_t)st->st_mtimespec.tv_nsec;
+#else
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000 + (uint64_t)st->st_mtim.tv_nsec;
+#endif
+}
+#endif
+
+/**
+ * opaque StaticFile.open (path : @& String) (mapLimit : UInt64) : IO StaticFile
+ */
+lean_obj_res lean_static_file_open(b_lean_obj_arg path, uint64_t map_limit, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("StaticFile.open"));
+#else
+    int fd = open(lean_string_cstr(path), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return lean_io_result_mk_error(get_socket_error());
     }
-    int res = poll(pollfds, n, (int32_t)timeout);
-    if (res < 0) {
-        lean_dec_ref(s);
-        free(pollfds);
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int errnum = errno;
+        close(fd);
+        errno = errnum;
         return lean_io_result_mk_error(get_socket_error());
     }
-    if (lean_is_exclusive(s)) {
-        for (size_t i = 0; i < n; ++i) {
-            lean_object* lP = lean_array_get_core(s, i);
-            if (lean_unbox(lean_ctor_get(lP, 3)) == 0) {
-                lean_ctor_set(lP, 2, lean_box((uint16_t)pollfds[i].revents));
-            }
-        }
-        free(pollfds);
-        return lean_io_result_mk_ok(s);
+    if (!S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("StaticFile.open: not a regular file")));
     }
-    else {
-        lean_object* sCpy = lean_alloc_array(n, n);
-        for (size_t i = 0; i < n; ++i) {
-            lean_object* lP = lean_array_get_core(s, i);
-            lean_object* lPCpy = lean_alloc_ctor(0, 4, 0);
-            lean_object* lSock = lean_ctor_get(lP, 0);
-            size_t ignore = lean_unbox(lean_ctor_get(lP, 3));
-            uint16_t revents = ignore == 1 ?
-                lean_unbox(lean_ctor_get(lP, 2))
-                : (uint16_t)pollfds[i].revents;
-            lean_inc_ref(lSock);
-            lean_ctor_set(lPCpy, 0, lSock);
-            lean_ctor_set(lPCpy, 1, lean_ctor_get(lP, 1));
-            lean_ctor_set(lPCpy, 2, lean_box(revents));
-            lean_ctor_set(lPCpy, 3, lean_box(ignore));
-            lean_array_set_core(sCpy, i, lPCpy);
+    static_file *f = malloc(sizeof(static_file));
+    f->fd = fd;
+    f->data = NULL;
+    f->size = (uint64_t)st.st_size;
+    f->mtime_ns = stat_mtime_ns(&st);
+    if (f->size > 0 && f->size <= map_limit)
+    {
+        void *data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            f->data = data;
+            f->fd = -1;
+            close(fd);
         }
-        lean_dec_ref(s);
-        free(pollfds);
-        return lean_io_result_mk_ok(sCpy);
     }
+    return lean_io_result_mk_ok(lean_alloc_external(g_static_file_external_class, f));
 #endif
 }
 
-// ## SockAddr
+/**
+ * opaque StaticFile.size (f : @& StaticFile) : UInt64
+ */
+uint64_t lean_static_file_size(b_lean_obj_arg f)
+{
+    return ((static_file *)lean_get_external_data(f))->size;
+}
 
 /**
- * opaque mk
-  (host : @& String)
-  (port : @& String)
-  (family : AddressFamily := AddressFamily.unspecified)
-  (type : SockType := SockType.unspecified)
-  : IO SockAddr
+ * opaque StaticFile.mtime (f : @& StaticFile) : UInt64
  */
-lean_obj_res lean_sockaddr_mk(b_lean_obj_arg h, b_lean_obj_arg p, uint8_t f, uint8_t t, lean_obj_arg w)
+uint64_t lean_static_file_mtime(b_lean_obj_arg f)
 {
-    const char *host = lean_string_cstr(h);
-    const char *port = lean_string_cstr(p);
-    int family = address_family_unbox(f);
-    int type = sock_type_unbox(t);
-    addrinfo hints;
-    addrinfo *ai_res;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = family;
-    hints.ai_socktype = type;
-    sockaddr_len *sal = malloc(sizeof(sockaddr_len));
-    int status = getaddrinfo(host, port, &hints, &ai_res);
-    if (status < 0)
-    {
-#ifdef _WIN32
-        int errnum = WSAGetLastError();
-        wchar_t *s = NULL;
-        FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                       NULL, errnum,
-                       MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                       (LPWSTR)&s, 0, NULL);
-        char *err_str;
-        wcstombs(err_str, s, 100);
-        lean_object *details = lean_mk_string(err_str);
-        LocalFree(s);
-#else
-        lean_object *details = lean_mk_string(gai_strerror(status));
-#endif
-        return lean_io_result_mk_error(lean_mk_io_user_error(details));
-    }
-    sal->address_len = ai_res->ai_addrlen;
-    sal->address = *(sockaddr_storage *)(ai_res->ai_addr);
-    freeaddrinfo(ai_res);
-    return lean_io_result_mk_ok(sockaddr_len_box(sal));
+    return ((static_file *)lean_get_external_data(f))->mtime_ns;
 }
 
 /**
- * opaque Sock.family (a : @&SockAddr) : Option AddressFamily
+ * opaque StaticFile.mapped (f : @& StaticFile) : Bool
  */
-lean_obj_res lean_sockaddr_family(b_lean_obj_arg a, lean_obj_arg w)
+uint8_t lean_static_file_mapped(b_lean_obj_arg f)
 {
-    switch (sockaddr_len_unbox(a)->address.ss_family)
+    return ((static_file *)lean_get_external_data(f))->data != NULL;
+}
+
+/**
+ * opaque StaticFile.statMtime (path : @& String) : IO (Option UInt64)
+ */
+lean_obj_res lean_static_file_stat_mtime(b_lean_obj_arg path, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("StaticFile.statMtime"));
+#else
+    struct stat st;
+    if (stat(lean_string_cstr(path), &st) != 0 || !S_ISREG(st.st_mode))
     {
-    case AF_UNSPEC:
-        return lean_option_mk_some(lean_box(0));
-    case AF_INET:
-        return lean_option_mk_some(lean_box(1));
-    case AF_INET6:
-        return lean_option_mk_some(lean_box(2));
-    default:
-        return lean_option_mk_none();
+        return lean_io_result_mk_ok(lean_option_mk_none());
     }
+    return lean_io_result_mk_ok(lean_option_mk_some(lean_box_uint64(stat_mtime_ns(&st))));
+#endif
 }
 
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 /**
- * opaque Sock.port (a : @&SockAddr) : Option UInt16
+ * opaque Socket.sendStatic (s : @& Socket) (header : @& ByteArray) (f : @& StaticFile) (offset : UInt64) : IO UInt64
  */
-lean_obj_res lean_sockaddr_port(b_lean_obj_arg a, lean_obj_arg w)
+lean_obj_res lean_socket_send_static(b_lean_obj_arg s, b_lean_obj_arg header, b_lean_obj_arg file, uint64_t offset, lean_obj_arg w)
 {
-    lean_object *o;
-    sockaddr_len *sa = sockaddr_len_unbox(a);
-    if (sa->address.ss_family == AF_INET)
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("Socket.sendStatic"));
+#else
+    const static_file *f = (const static_file *)lean_get_external_data(file);
+    SOCKET fd = *socket_unbox(s);
+    uint64_t hlen = lean_sarray_size(header);
+    if (offset >= hlen + f->size)
     {
-        o = lean_alloc_ctor(1, 1, 0);
-        lean_ctor_set(o, 0, lean_box(ntohs(((sockaddr_in *)&(sa->address))->sin_port)));
+        return lean_io_result_mk_ok(lean_box_uint64(0));
     }
-    else if (sa->address.ss_family == AF_INET6)
+    ssize_t bytes;
+    if (f->data != NULL || offset < hlen)
     {
-        o = lean_alloc_ctor(1, 1, 0);
-        lean_ctor_set(o, 0, lean_box(ntohs(((sockaddr_in6 *)&(sa->address))->sin6_port)));
+        // header and mapped contents in one call; an unmapped file follows with `sendfile`
+        struct iovec iov[2];
+        int n = 0;
+        uint64_t file_offset = 0;
+        if (offset < hlen)
+        {
+            iov[n].iov_base = lean_sarray_cptr(header) + offset;
+            iov[n].iov_len = hlen - offset;
+            n++;
+        }
+        else
+        {
+            file_offset = offset - hlen;
+        }
+        if (f->data != NULL && file_offset < f->size)
+        {
+            iov[n].iov_base = f->data + file_offset;
+            iov[n].iov_len = f->size - file_offset;
+            n++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        bytes = sendmsg(fd, &msg, f->data == NULL && f->size > 0 ? MSG_MORE : 0);
     }
     else
     {
-        o = lean_alloc_ctor(0, 0, 0);
+        uint64_t file_offset = offset - hlen;
+        uint64_t left = f->size - file_offset;
+#ifdef __linux__
+        off_t off = (off_t)file_offset;
+        bytes = sendfile(fd, f->fd, &off, left < (1u << 30) ? left : (1u << 30));
+        if (bytes == 0)
+        {
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("Socket.sendStatic: file truncated")));
+        }
+#else
+        uint8_t buffer[65536];
+        ssize_t got = pread(f->fd, buffer, left < sizeof(buffer) ? left : sizeof(buffer), (off_t)file_offset);
+        if (got <= 0)
+        {
+            if (got == 0)
+            {
+                return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("Socket.sendStatic: file truncated")));
+            }
+            return lean_io_result_mk_error(get_socket_error());
+        }
+        bytes = send(fd, buffer, got, 0);
+#endif
     }
-    return o;
+    if (bytes >= 0)
+    {
+        return lean_io_result_mk_ok(lean_box_uint64(bytes));
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        return lean_io_result_mk_ok(lean_box_uint64(0));
+    }
+    return lean_io_result_mk_error(get_socket_error());
+#endif
 }
 
+// ## StaticBytes
+
 /**
- * opaque SockAddr.host (a : @&SockAddr) : Option String
+ * opaque StaticBytes.persist (s : StaticBytes) : IO StaticBytes
  */
-lean_obj_res lean_sockaddr_host(b_lean_obj_arg a, lean_obj_arg w)
+lean_obj_res lean_static_bytes_persist(lean_obj_arg s, lean_obj_arg w)
 {
-    lean_object *o;
-    sockaddr_len *sa = sockaddr_len_unbox(a);
-    if (sa->address.ss_family == AF_INET)
-    {
-        char ip4[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(((sockaddr_in *)&(sa->address))->sin_addr), ip4, INET_ADDRSTRLEN);
-        o = lean_alloc_ctor(1, 1, 0);
-        lean_ctor_set(o, 0, lean_mk_string(ip4));
-    }
-    else if (sa->address.ss_family == AF_INET6)
+    // persistent objects have no reference count, so sharing them across threads costs nothing
+    lean_mark_persistent(s);
+    return lean_io_result_mk_ok(s);
+}
+
+// ## SplicePipe
+
+/**
+ * opaque SplicePipe.mk : IO SplicePipe
+ */
+lean_obj_res lean_splice_pipe_mk(lean_obj_arg w)
+{
+    splice_pipe *p = malloc(sizeof(splice_pipe));
+    if (p == NULL)
     {
-        char ip6[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &(((sockaddr_in6 *)&(sa->address))->sin6_addr), ip6, INET6_ADDRSTRLEN);
-        o = lean_alloc_ctor(1, 1, 0);
-        lean_ctor_set(o, 0, lean_mk_string(ip6));
+        errno = ENOMEM;
+        return lean_io_result_mk_error(get_socket_error());
     }
-    else
+    p->fds[0] = -1;
+    p->fds[1] = -1;
+#ifdef __linux__
+    if (pipe2(p->fds, O_CLOEXEC) != 0)
     {
-        o = lean_alloc_ctor(0, 0, 0);
+        int errnum = errno;
+        free(p);
+        errno = errnum;
+        return lean_io_result_mk_error(get_socket_error());
     }
-    return o;
+#endif
+    return lean_io_result_mk_ok(lean_alloc_external(g_splice_pipe_external_class, p));
 }
 
 /**
- * opaque beq (a1 a2 : @& SockAddr) : Bool
+ * opaque SplicePipe.forward (p : @& SplicePipe) (src dst : @& Socket) (max : USize) : IO USize
  */
-uint8_t lean_sockaddr_beq(b_lean_obj_arg a1, b_lean_obj_arg a2) {
-    sockaddr_len* a1s = sockaddr_len_unbox(a1);
-    sockaddr_len* a2s = sockaddr_len_unbox(a2);
-    if (a1s->address.ss_family != a2s->address.ss_family)
-        return 0;
-    switch (a1s->address.ss_family) {
-        case AF_INET: {
-            sockaddr_in* a1i = (sockaddr_in *)&(a1s->address);
-            sockaddr_in* a2i = (sockaddr_in *)&(a2s->address);
-            return a1i->sin_addr.s_addr == a2i->sin_addr.s_addr &&
-                a1i->sin_port == a2i->sin_port;
+lean_obj_res lean_splice_pipe_forward(b_lean_obj_arg pipe, b_lean_obj_arg src, b_lean_obj_arg dst, size_t max, lean_obj_arg w)
+{
+    SOCKET in = *socket_unbox(src);
+    SOCKET out = *socket_unbox(dst);
+#ifdef __linux__
+    const splice_pipe *p = (const splice_pipe *)lean_get_external_data(pipe);
+    ssize_t got = splice(in, NULL, p->fds[1], NULL, max, SPLICE_F_MOVE);
+    if (got < 0)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    // drain the pipe completely, so it is empty again for the next call. Every call offers all
+    // bytes left, so `SPLICE_F_MORE` would only cork the last segment of the chunk
+    for (ssize_t left = got; left > 0;)
+    {
+        ssize_t put = splice(p->fds[0], NULL, out, NULL, left, SPLICE_F_MOVE);
+        if (put < 0)
+        {
+            return lean_io_result_mk_error(get_socket_error());
         }
-        case AF_INET6: {
-            sockaddr_in6* a1i = (sockaddr_in6 *)&(a1s->address);
-            sockaddr_in6* a2i = (sockaddr_in6 *)&(a2s->address);
-            return a1i->sin6_port == a2i->sin6_port &&
-                memcmp(&a1i->sin6_addr, &a2i->sin6_addr, sizeof(a1i->sin6_addr)) == 0;
+        if (put == 0)
+        {
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("SplicePipe.forward: destination accepted no bytes")));
         }
-        default:
-            return 0;
+        left -= put;
+    }
+    return lean_io_result_mk_ok(lean_box_usize(got));
+#else
+    char buffer[65536];
+    ssize_t got = recv(in, buffer, max < sizeof(buffer) ? max : sizeof(buffer), 0);
+    if (got < 0)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    for (ssize_t sent = 0; sent < got;)
+    {
+        ssize_t put = send(out, buffer + sent, got - sent, 0);
+        if (put < 0)
+        {
+            return lean_io_result_mk_error(get_socket_error());
+        }
+        if (put == 0)
+        {
+            return lean_io_result_mk_error(lean_mk_io_user_error(lean_mk_string("SplicePipe.forward: destination accepted no bytes")));
+        }
+        sent += put;
     }
+    return lean_io_result_mk_ok(lean_box_usize(got));
+#endif
 }
 
 // ## Other Functions
@@ -805,4 +4610,103 @@ lean_obj_res lean_gethostname()
         return lean_io_result_mk_error(get_socket_error());
     }
     return lean_io_result_mk_ok(lean_mk_string(buffer));
-}
\ No newline at end of file
+}
+
+/**
+ * opaque setThreadAffinity (cpus : @& Array UInt32) : IO Unit
+ */
+lean_obj_res lean_socket_set_thread_affinity(b_lean_obj_arg cpus, lean_obj_arg w)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    size_t n = lean_array_size(cpus);
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint32_t cpu = lean_unbox_uint32(lean_array_get_core(cpus, i));
+        if (cpu >= CPU_SETSIZE)
+        {
+            errno = EINVAL;
+            return lean_io_result_mk_error(get_socket_error());
+        }
+        CPU_SET(cpu, &set);
+    }
+    // pid 0 is the calling thread, not the whole process
+    if (sched_setaffinity(0, sizeof(set), &set) == 0)
+    {
+        return lean_io_result_mk_ok(lean_box(0));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("Thread affinity"));
+#endif
+}
+
+/**
+ * opaque threadAffinity : IO (Array UInt32)
+ */
+lean_obj_res lean_socket_get_thread_affinity(lean_obj_arg w)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+    lean_object *arr = lean_mk_empty_array();
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &set))
+        {
+            arr = lean_array_push(arr, lean_box_uint32(cpu));
+        }
+    }
+    return lean_io_result_mk_ok(arr);
+#else
+    return lean_io_result_mk_error(get_unsupported_error("Thread affinity"));
+#endif
+}
+
+/**
+ * opaque currentCpu : IO UInt32
+ */
+lean_obj_res lean_socket_current_cpu(lean_obj_arg w)
+{
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+    {
+        return lean_io_result_mk_ok(lean_box_uint32((uint32_t)cpu));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#else
+    return lean_io_result_mk_error(get_unsupported_error("sched_getcpu"));
+#endif
+}
+
+/**
+ * opaque interfaceIndex (name : @& String) : IO UInt32
+ */
+lean_obj_res lean_socket_interface_index(b_lean_obj_arg name, lean_obj_arg w)
+{
+#ifdef _WIN32
+    return lean_io_result_mk_error(get_unsupported_error("Socket.interfaceIndex"));
+#else
+    unsigned int index = if_nametoindex(lean_string_cstr(name));
+    if (index != 0)
+    {
+        return lean_io_result_mk_ok(lean_box_uint32(index));
+    }
+    else
+    {
+        return lean_io_result_mk_error(get_socket_error());
+    }
+#endif
+}